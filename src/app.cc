@@ -18,20 +18,179 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <assert.h>
+#include <errno.h>
+#include <ctype.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
 #include <imago2.h>
 #include "app.h"
 #include "opengl.h"
 #include "texture.h"
 #include "mesh.h"
 #include "meshgen.h"
+#include "convert.h"
+#include "threadpool.h"
+#include "remap.h"
+#include "reverse.h"
+#include "ktx.h"
+#include "dds.h"
+#include "stream.h"
+#include "rawimg.h"
+#include "layout.h"
+#include "pipeline.h"
+#include "watch.h"
+#include "server.h"
+#include "prefilter.h"
+#include "sh.h"
+#include "dirty.h"
+#include "bcenc.h"
+#include "seams.h"
 
 static void draw_equilateral();
 static void draw_cubemap();
 static bool parse_args(int argc, char **argv);
 
-static const char *img_fname, *img_suffix;
+/* face buffers of saved frames, reused by the next frames in sequence mode
+ * instead of allocating (and faulting in) new ones for every frame
+ */
+struct BufferPool {
+	std::mutex lock;
+	std::vector<Image> free_imgs;
+};
+
+static bool init_output(Image *img, const char *fname, int width, int height, int fmt,
+		BufferPool *pool = 0);
+static bool get_buffer(BufferPool *pool, Image *img, int width, int height, int fmt);
+static void put_buffer(BufferPool *pool, Image *img);
+static void trim_buffers(BufferPool *pool, size_t keep);
+
+// per-job output settings, the command-line options by default
+struct OutputSettings {
+	int face_size;		// 0 for the height of the panorama
+	int layout;
+	char suffix[16];	// empty for the suffix of the input
+	const char *tmpl;	// output filename template, 0 for the default names
+	int mip_levels;		// GGX prefiltered levels including the base, 0 for none, -1 for all
+	int sh_order;		// spherical harmonics order, 0 for none
+	bool sh_binary;		// binary spherical harmonics instead of JSON
+	int compress;		// block compression format (COMP_NONE or a BC format of bcenc.h)
+	int comp_quality;
+	int seam_width;		// edge fixup band in texels (see seams.h), 0 for none
+	const char *root;	// directory of relative output names, 0 for the working directory
+};
+
+// single file cubemap containers
+enum {
+	CUBEFILE_NONE,
+	CUBEFILE_KTX,
+	CUBEFILE_KTX2,
+	CUBEFILE_DDS
+};
+
+// output filenames of the six faces, and of the atlas or cubemap file
+struct OutputNames {
+	char face[6][512];
+	char atlas[512];
+	char sh[512];		// spherical harmonics coefficients
+	int cubefile;		// CUBEFILE_NONE unless saving a KTX, KTX2 or DDS cubemap
+	int layout;			// LAYOUT_SEPARATE for cubemap files
+};
+
+static const char *cubefile_name[] = {"", "KTX", "KTX2", "DDS"};
+
+/* GGX prefiltered mip levels 1 to levels - 1 of a cubemap (see prefilter.h).
+ * Saved in the same layout as the base level, with _m<level> appended to the
+ * output filenames, or as the mip levels of KTX, KTX2 and DDS files. Without
+ * --ggx, cubemap files get a box filtered mip chain instead.
+ */
+struct MipChain {
+	int levels;			// including the base level, 1 without a mip chain
+	bool prefiltered;	// GGX prefiltered, or box filtered
+	Image faces[PREFILTER_MAX_LEVELS - 1][6];
+	Image atlas[PREFILTER_MAX_LEVELS - 1];
+	double time;
+};
+
+static bool init_output_names(OutputNames *names, const char *in_fname, bool multi,
+		const OutputSettings *set);
+static bool expand_template(char *buf, int bufsz, const char *tmpl, const char *in_fname,
+		const char *face, const char *suffix);
+static void make_parent_dirs(const char *fname);
+static bool init_faces(Image *faces, Image *atlas, int size, int fmt, const OutputNames *names,
+		bool mapped, BufferPool *pool = 0);
+static bool save_faces(const Image *faces, const Image *atlas, const OutputNames *names,
+		ThreadPool *tpool, const MipChain *mips = 0);
+static bool save_cubefile_compressed(const BlockImage *faces, const OutputNames *names,
+		int levels);
+static bool compress_cubemap(BlockImage *comp, const Image *faces, const MipChain *mips,
+		const OutputSettings *set, ThreadPool *tpool);
+static void destroy_faces(Image *faces, Image *atlas, BufferPool *pool = 0);
+static int mip_levels(const OutputSettings *set, int size);
+static bool init_mips(MipChain *mips, int size, int fmt, const OutputNames *names);
+static bool make_mips(MipChain *mips, const Image *faces, int size, int fmt,
+		const OutputNames *names, const OutputSettings *set, ThreadPool *tpool);
+static void mip_output_names(OutputNames *mnames, const OutputNames *names, int level);
+static void destroy_mips(MipChain *mips);
+static void run_benchmark(const Image *src, Image *faces, ThreadPool *tpool);
+static int batch_convert();
+static int batch_bench();
+static int batch_watch();
+static int batch_serve();
+static int batch_to_equirect();
+static int batch_stream();
+static int batch_update();
+static double get_time_sec();
+static const char *pixfmt_name(int fmt);
+static int cubefile_type(const char *suffix);
+static int find_name(const char **names, const char *name);
+
+static const char *img_fname;
+static const char **img_fnames;	// all the input images, img_fname is the first
+static int num_inputs, max_inputs;
+static const char *out_template;
+static const char *watch_path;
+static const char *serve_path;
+static const char *serve_root;	// request paths are relative to it, the working directory by default
+static int max_upload_mb = 1024;
+static int max_face_size = 8192;	// largest face-size a request can ask for
+static int remap_cache_mb = 1024;	// remap tables kept between requests
+static const char *seq_pattern;	// printf pattern of numbered frames
+static int seq_first = -1, seq_last = -1;
+static bool no_remap;
+static bool verbose = true;
+static OutputSettings out_settings;	// set from the options by parse_args
+static int num_threads;
+static ConvOptions conv_opt;
+static bool use_remap;
+static bool bench_mode;
+static bool filter_set;
+static int face_size;
+static bool to_equirect;
+static unsigned int load_flags;
+static bool stream_mode;
+static int mem_limit_mb = 1024;
+static int layout = LAYOUT_SEPARATE;
+static int queue_depth[2] = {1, 1};	// images waiting for conversion and for saving
+static int ggx_levels;
+static int ggx_samples = 128;
+static int sh_order;
+static bool sh_binary;
+static int comp_format;
+static int comp_quality = COMP_NORMAL;
+static int seam_width;
+static std::vector<DirtyRect> dirty_rects;
+static const char *diff_fname;	// previous version of the input
+static char out_suffix[16];
 static float cam_theta, cam_phi;
 
 static Texture *tex;
@@ -44,7 +203,6 @@ static unsigned int fbo;
 static unsigned int cube_tex;
 static int cube_size;
 
-
 bool app_init(int argc, char **argv)
 {
 	if(!parse_args(argc, argv)) {
@@ -54,6 +212,10 @@ bool app_init(int argc, char **argv)
 		fprintf(stderr, "please specify an equilateral panoramic image\n");
 		return false;
 	}
+	if(num_inputs > 1) {
+		fprintf(stderr, "only one image can be converted interactively, use --cpu for more\n");
+		return false;
+	}
 
 	if(!init_opengl()) {
 		return false;
@@ -78,12 +240,8 @@ bool app_init(int argc, char **argv)
 	}
 	printf("loaded image: %dx%d\n", tex->get_width(), tex->get_height());
 
-	if(!(img_suffix = strrchr(img_fname, '.'))) {
-		img_suffix = ".jpg";
-	}
-
 	// create cubemap
-	cube_size = tex->get_height();
+	cube_size = face_size > 0 ? face_size : tex->get_height();
 	glGenTextures(1, &cube_tex);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, cube_tex);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -92,9 +250,11 @@ bool app_init(int argc, char **argv)
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
+	// LDR images stay 8bit all the way to the saved faces
+	unsigned int cube_intfmt = tex->is_float() || (load_flags & LOAD_FLOAT) ? GL_RGB16F : GL_RGB8;
 	for(int i=0; i<6; i++) {
-		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB16F, cube_size, cube_size,
-				0, GL_RGB, GL_FLOAT, 0);
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, cube_intfmt, cube_size, cube_size,
+				0, GL_RGB, GL_UNSIGNED_BYTE, 0);
 	}
 
 
@@ -154,7 +314,30 @@ void render_cubemap()
 {
 	printf("rendering cubemap %dx%d\n", cube_size, cube_size);
 
-	float *pixels = new float[cube_size * cube_size * 3];
+	int fmt = PIXFMT_RGB8;
+	unsigned int pixtype = GL_UNSIGNED_BYTE;
+	if(tex->is_float() || (load_flags & LOAD_FLOAT)) {
+		if(load_flags & LOAD_HALF) {
+			fmt = PIXFMT_RGBH;
+			pixtype = GL_HALF_FLOAT;
+		} else {
+			fmt = PIXFMT_RGBF;
+			pixtype = GL_FLOAT;
+		}
+	}
+
+	/* 8bit faces are read back straight into mapped PPM outputs. PFM files are
+	 * stored bottom-up, which glGetTexImage can't write.
+	 */
+	OutputNames names;
+	if(!init_output_names(&names, img_fname, false, &out_settings)) {
+		return;
+	}
+
+	Image faces[6], atlas;
+	if(!init_faces(faces, &atlas, cube_size, fmt, &names, fmt == PIXFMT_RGB8)) {
+		return;
+	}
 
 	glViewport(0, 0, cube_size, cube_size);
 
@@ -167,17 +350,6 @@ void render_cubemap()
 	viewmat[3].rotate_y(deg_to_rad(180));
 	viewmat[4].rotation_y(deg_to_rad(180));	// +Z
 
-	// this must coincide with the order of GL_TEXTURE_CUBE_MAP_* values
-	static const char *fname_pattern[] = {
-		"cubemap_px%s",
-		"cubemap_nx%s",
-		"cubemap_py%s",
-		"cubemap_ny%s",
-		"cubemap_pz%s",
-		"cubemap_nz%s"
-	};
-	static char fname[64];
-
 	glMatrixMode(GL_PROJECTION);
 	glPushMatrix();
 	glLoadIdentity();
@@ -185,6 +357,7 @@ void render_cubemap()
 	glScalef(-1, -1, 1);
 
 	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
 	for(int i=0; i<6; i++) {
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
@@ -197,13 +370,11 @@ void render_cubemap()
 
 		draw_equilateral();
 
-		glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, GL_FLOAT, pixels);
-
-		sprintf(fname, fname_pattern[i], img_suffix);
-		if(img_save_pixels(fname, pixels, cube_size, cube_size, IMG_FMT_RGBF) == -1) {
-			fprintf(stderr, "failed to save %dx%d image: %s\n", cube_size, cube_size, fname);
-		}
+		// atlas faces are read back in place, with the atlas row length
+		glPixelStorei(GL_PACK_ROW_LENGTH, faces[i].pitch / pixel_size(fmt));
+		glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, pixtype, faces[i].pixels);
 	}
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glViewport(0, 0, win_width, win_height);
@@ -211,114 +382,2219 @@ void render_cubemap()
 	glMatrixMode(GL_PROJECTION);
 	glPopMatrix();
 
-	delete [] pixels;
+	ThreadPool tpool(num_threads);
+
+	if(seam_width && !fix_cube_seams(faces, seam_width, &tpool)) {
+		destroy_faces(faces, &atlas);
+		return;
+	}
+
+	// the faces come from the GPU, so they are projected to SH separately
+	if(sh_order) {
+		ShProjection sh;
+		init_sh(&sh, sh_order);
+		sh_begin(&sh, cube_size, 1);
+		for(int i=0; i<6; i++) {
+			sh_accum_tile(&sh, 0, i, 0, 0, cube_size, cube_size, fmt, faces[i].pixels,
+					faces[i].pitch / pixel_size(fmt));
+		}
+		sh_end(&sh);
+		save_sh(&sh, names.sh);
+		destroy_sh(&sh);
+	}
+
+	// the levels computed for the outputs replace the GL mipmaps
+	MipChain mips;
+	if(!make_mips(&mips, faces, cube_size, fmt, &names, &out_settings, &tpool)) {
+		destroy_faces(faces, &atlas);
+		return;
+	}
+
+	double t0 = get_time_sec();
+	if(out_settings.compress) {
+		// init_output_names only allows --compress with a cubemap file
+		BlockImage comp[PREFILTER_MAX_LEVELS * 6];
+		if(compress_cubemap(comp, faces, &mips, &out_settings, &tpool)) {
+			printf("compressed to %s in %.3f sec\n", comp_format_name[out_settings.compress],
+					get_time_sec() - t0);
+			t0 = get_time_sec();
+			if(save_cubefile_compressed(comp, &names, mips.levels)) {
+				printf("saved in %.3f sec\n", get_time_sec() - t0);
+			}
+			for(int i=0; i<mips.levels * 6; i++) {
+				destroy_block_image(comp + i);
+			}
+		}
+	} else if(save_faces(faces, &atlas, &names, &tpool, &mips)) {
+		printf("saved in %.3f sec\n", get_time_sec() - t0);
+	}
+	destroy_faces(faces, &atlas);
 
 	glBindTexture(GL_TEXTURE_CUBE_MAP, cube_tex);
-	glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+	if(mips.levels > 1) {
+		unsigned int intfmt = fmt == PIXFMT_RGB8 ? GL_RGB8 : GL_RGB16F;
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for(int i=1; i<mips.levels; i++) {
+			for(int j=0; j<6; j++) {
+				const Image *img = mips.faces[i - 1] + j;
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, img->pitch / pixel_size(fmt));
+				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + j, i, intfmt, img->width,
+						img->height, 0, GL_RGB, pixtype, img->pixels);
+			}
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, mips.levels - 1);
+		destroy_mips(&mips);
+	} else {
+		glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+	}
 }
 
-static void draw_equilateral()
+bool app_headless(int argc, char **argv)
 {
-	tex->bind();
-	glEnable(GL_TEXTURE_2D);
-	mesh->draw();
-	glDisable(GL_TEXTURE_2D);
+	for(int i=1; i<argc; i++) {
+		if(strcmp(argv[i], "--cpu") == 0 || strcmp(argv[i], "--bench") == 0 ||
+				strcmp(argv[i], "--to-equirect") == 0 || strcmp(argv[i], "--stream") == 0 ||
+				strcmp(argv[i], "--mem-limit") == 0 || strcmp(argv[i], "--layout") == 0 ||
+				strcmp(argv[i], "--queue-depth") == 0 || strcmp(argv[i], "--list") == 0 ||
+				strcmp(argv[i], "--watch") == 0 || strcmp(argv[i], "--serve") == 0 ||
+				strcmp(argv[i], "--dirty") == 0 || strcmp(argv[i], "--diff") == 0 ||
+				strcmp(argv[i], "--sequence") == 0) {
+			return true;
+		}
+	}
+	return false;
 }
 
-static void draw_cubemap()
+/* headless CPU conversion, never touches OpenGL. Produces the same cubemap_*
+ * files as render_cubemap.
+ */
+int app_batch(int argc, char **argv)
 {
-	glPushAttrib(GL_ENABLE_BIT);
+	if(!parse_args(argc, argv)) {
+		return 1;
+	}
+	if(watch_path || serve_path) {
+		if(img_fname) {
+			fprintf(stderr, "input images can't be passed with --watch or --serve\n");
+			return 1;
+		}
+		return watch_path ? batch_watch() : batch_serve();
+	}
+	if(!img_fname) {
+		fprintf(stderr, "please specify an equilateral panoramic image\n");
+		return 1;
+	}
 
-	glBindTexture(GL_TEXTURE_CUBE_MAP, cube_tex);
-	glEnable(GL_TEXTURE_CUBE_MAP);
-	glEnable(GL_TEXTURE_GEN_S);
-	glEnable(GL_TEXTURE_GEN_T);
-	glEnable(GL_TEXTURE_GEN_R);
+	if(num_inputs > 1 && (to_equirect || stream_mode || bench_mode)) {
+		fprintf(stderr, "only one image can be passed with --to-equirect, --stream or --bench\n");
+		return 1;
+	}
+	if(ggx_levels && (to_equirect || stream_mode)) {
+		fprintf(stderr, "--ggx can't be used with --to-equirect or --stream\n");
+		return 1;
+	}
+	if(sh_order && to_equirect) {
+		fprintf(stderr, "--sh can't be used with --to-equirect\n");
+		return 1;
+	}
+	if(comp_format && (to_equirect || stream_mode)) {
+		fprintf(stderr, "--compress can't be used with --to-equirect or --stream\n");
+		return 1;
+	}
+	if(seam_width && (to_equirect || stream_mode)) {
+		fprintf(stderr, "--seam-fix can't be used with --to-equirect or --stream\n");
+		return 1;
+	}
 
-	mesh->draw();
+	if(seq_pattern && (to_equirect || stream_mode || bench_mode)) {
+		fprintf(stderr, "--sequence can't be used with --to-equirect, --stream or --bench\n");
+		return 1;
+	}
+	if(!dirty_rects.empty() || diff_fname) {
+		if(num_inputs > 1 || to_equirect || stream_mode || bench_mode || ggx_levels || sh_order ||
+				seam_width) {
+			fprintf(stderr, "--dirty and --diff update the outputs of a single image, and can't be used with --to-equirect, --stream, --bench, --ggx, --sh or --seam-fix\n");
+			return 1;
+		}
+		return batch_update();
+	}
 
-	glPopAttrib();
+	if(to_equirect) {
+		return batch_to_equirect();
+	}
+	if(stream_mode) {
+		return batch_stream();
+	}
+	if(bench_mode) {
+		return batch_bench();
+	}
+	return batch_convert();
 }
 
-void app_reshape(int x, int y)
+/* picks the filter for converting a panorama of the given height to faces of
+ * the given size, unless one was specified, and whether a remap table can be
+ * used with it
+ */
+static void job_options(ConvOptions *opt, bool *remap, int src_height, int size)
 {
-	glViewport(0, 0, x, y);
+	*opt = conv_opt;
+	if(!filter_set && (opt->filter = auto_filter(src_height, size)) != FILTER_BILINEAR && verbose) {
+		printf("using %s filter for downsampling\n", filter_name[opt->filter]);
+	}
+	*remap = use_remap;
+	if(use_remap && opt->filter == FILTER_AREA) {
+		if(verbose) {
+			printf("remap tables can't be used with the %s filter\n", filter_name[FILTER_AREA]);
+		}
+		*remap = false;
+	}
+}
 
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(50.0, (float)x / (float)y, 0.5, 500.0);
+struct BatchJob {
+	const char *fname;
+	const OutputSettings *set;
+	OutputNames out;
+	Image src, faces[6], atlas;
+	MipChain mips;
+	ShProjection sh;	// if set->sh_order is set
+	BlockImage comp[PREFILTER_MAX_LEVELS * 6];	// all levels, if set->compress is set
+	double comp_time;
+
+	int src_width, src_height, size;
+	double load_time, conv_time, save_time;
+};
+
+struct Batch {
+	BatchJob *jobs;
+	int num_jobs;		// 0 if not known in advance
+	ThreadPool *conv_pool, *save_pool;
+	BufferPool *bufpool;	// 0 unless converting a sequence, or watching a directory
+	std::atomic<int> num_failed, num_done;
+	std::atomic<long long> out_pixels;
+	double first_save, last_save;	// times the first and the last image were saved
+};
+
+static bool load_job(Batch *batch, BatchJob *job)
+{
+	double t0 = get_time_sec();
+	if(!load_image(&job->src, job->fname, load_flags)) {
+		batch->num_failed++;
+		return false;
+	}
+	job->load_time = get_time_sec() - t0;
+	job->src_width = job->src.width;
+	job->src_height = job->src.height;
 
-	win_width = x;
-	win_height = y;
+	if(verbose) {
+		printf("loaded image: %dx%d (%s)\n", job->src.width, job->src.height, pixfmt_name(job->src.fmt));
+	}
+	return true;
 }
 
-void app_keyboard(int key, bool press)
+static bool convert_job(Batch *batch, BatchJob *job)
 {
-	if(press) {
-		switch(key) {
-		case 27:
-			app_quit();
-			break;
+	ThreadPool *tpool = batch->conv_pool;
+	Image *src = &job->src;
 
-		case ' ':
-			show_cubemap = !show_cubemap;
-			app_redisplay();
-			break;
+	int size = job->size = job->set->face_size > 0 ? job->set->face_size : src->height;
 
-		case 'c':
-			render_cubemap();
-			show_cubemap = 1;
-			app_redisplay();
+	ConvOptions opt;
+	bool remap;
+	job_options(&opt, &remap, src->height, size);
+
+	ShProjection *sh = 0;
+	if(job->set->sh_order) {
+		init_sh(&job->sh, job->set->sh_order);
+		sh = &job->sh;
+	}
+
+	if(!init_faces(job->faces, &job->atlas, size, src->fmt, &job->out, true, batch->bufpool)) {
+		goto fail;
+	}
+
+	if(verbose) {
+		printf("rendering cubemap %dx%d (cpu, %d threads)\n", size, size, tpool->get_num_threads());
+	}
+	{
+		double t0 = get_time_sec();
+		if(remap) {
+			RemapKey key;
+			init_remap_key(&key, src->width, src->height, size, &opt);
+
+			RemapTable *rmap = get_remap(&key, tpool);
+			if(!rmap) {
+				destroy_faces(job->faces, &job->atlas, batch->bufpool);
+				goto fail;
+			}
+			double t1 = get_time_sec();
+			if(verbose) {
+				printf("remap table ready in %.3f sec\n", t1 - t0);
+			}
+			t0 = t1;
+
+			convert_cubemap_remap(src, job->faces, rmap, tpool, sh);
+		} else {
+			if(!convert_cubemap(src, job->faces, &opt, tpool, sh)) {
+				destroy_faces(job->faces, &job->atlas, batch->bufpool);
+				goto fail;
+			}
+		}
+		// while the faces are still hot, before anything reads them
+		if(job->set->seam_width && !fix_cube_seams(job->faces, job->set->seam_width, tpool)) {
+			destroy_faces(job->faces, &job->atlas, batch->bufpool);
+			goto fail;
+		}
+		job->conv_time = get_time_sec() - t0;
+		if(verbose) {
+			printf("converted in %.3f sec (%.2f Mpixels/s)\n", job->conv_time,
+					6.0 * size * size / job->conv_time * 1e-6);
+		}
+	}
+
+	if(!make_mips(&job->mips, job->faces, size, src->fmt, &job->out, job->set, tpool)) {
+		destroy_faces(job->faces, &job->atlas, batch->bufpool);
+		goto fail;
+	}
+
+	if(job->set->compress) {
+		double t0 = get_time_sec();
+		if(!compress_cubemap(job->comp, job->faces, &job->mips, job->set, tpool)) {
+			destroy_mips(&job->mips);
+			destroy_faces(job->faces, &job->atlas, batch->bufpool);
+			goto fail;
+		}
+		job->comp_time = get_time_sec() - t0;
+		if(verbose) {
+			printf("compressed to %s in %.3f sec\n", comp_format_name[job->set->compress], job->comp_time);
+		}
+	}
+
+	destroy_image(src);
+	return true;
+
+fail:
+	destroy_image(src);
+	if(sh) {
+		destroy_sh(sh);
+	}
+	batch->num_failed++;
+	return false;
+}
+
+static bool save_job(Batch *batch, BatchJob *job)
+{
+	double t0 = get_time_sec();
+	bool res;
+	if(job->set->compress) {
+		res = save_cubefile_compressed(job->comp, &job->out, job->mips.levels);
+		for(int i=0; i<job->mips.levels * 6; i++) {
+			destroy_block_image(job->comp + i);
+		}
+	} else {
+		res = save_faces(job->faces, &job->atlas, &job->out, batch->save_pool, &job->mips);
+	}
+	if(job->set->sh_order) {
+		res = save_sh(&job->sh, job->out.sh) && res;
+		destroy_sh(&job->sh);
+	}
+	double t1 = get_time_sec();
+	job->save_time = t1 - t0;
+	destroy_faces(job->faces, &job->atlas, batch->bufpool);
+	destroy_mips(&job->mips);
+
+	if(!res) {
+		batch->num_failed++;
+		return false;
+	}
+	batch->out_pixels += 6LL * job->size * job->size;
+	if(!batch->num_done) {
+		batch->first_save = t1;
+	}
+	batch->last_save = t1;
+
+	if(verbose) {
+		printf("saved in %.3f sec\n", job->save_time);
+	} else {
+		char count[32];
+		if(batch->num_jobs) {
+			sprintf(count, "%d/%d", ++batch->num_done, batch->num_jobs);
+		} else {
+			sprintf(count, "%d", ++batch->num_done);
+		}
+		char prefilter[64] = "", compress[64] = "";
+		if(job->mips.levels > 1) {
+			sprintf(prefilter, ", %s %.3f", job->mips.prefiltered ? "prefilter" : "mips", job->mips.time);
+		}
+		if(job->set->compress) {
+			sprintf(compress, ", compress %.3f", job->comp_time);
+		}
+		printf("[%s] %s: %dx%d -> 6x %dx%d, load %.3f, convert %.3f (%.2f Mpixels/s)%s%s, save %.3f sec\n",
+				count, job->fname, job->src_width, job->src_height, job->size,
+				job->size, job->load_time, job->conv_time, 6.0 * job->size * job->size /
+				job->conv_time * 1e-6, prefilter, compress, job->save_time);
+	}
+	return true;
+}
+
+static bool decode_stage(int idx, void *cls)
+{
+	Batch *batch = (Batch*)cls;
+	return load_job(batch, batch->jobs + idx);
+}
+
+static bool convert_stage(int idx, void *cls)
+{
+	Batch *batch = (Batch*)cls;
+	return convert_job(batch, batch->jobs + idx);
+}
+
+static bool save_stage(int idx, void *cls)
+{
+	Batch *batch = (Batch*)cls;
+	return save_job(batch, batch->jobs + idx);
+}
+
+/* converts all the input images in a three stage pipeline, so that the next
+ * image is loaded and the previous one is saved while the current one is
+ * converted. The queue depths limit how many images can be waiting for
+ * conversion and for saving. The thread pools and remap tables are shared by
+ * all the images, and for sequences the face buffers too.
+ */
+static int batch_convert()
+{
+	BufferPool bufpool;
+
+	Batch batch;
+	batch.jobs = new BatchJob[num_inputs];
+	batch.num_jobs = num_inputs;
+	batch.num_failed = 0;
+	batch.num_done = 0;
+	batch.out_pixels = 0;
+	batch.bufpool = seq_pattern ? &bufpool : 0;
+
+	// with multiple inputs, print one line per image instead
+	verbose = num_inputs == 1;
+
+	for(int i=0; i<num_inputs; i++) {
+		BatchJob *job = batch.jobs + i;
+		job->fname = img_fnames[i];
+		job->set = &out_settings;
+		if(!init_output_names(&job->out, job->fname, num_inputs > 1, &out_settings)) {
+			delete [] batch.jobs;
+			return 1;
+		}
+	}
+
+	ThreadPool conv_pool(num_threads);
+	ThreadPool save_pool(num_threads);
+	batch.conv_pool = &conv_pool;
+	batch.save_pool = &save_pool;
+
+	PipelineStage stages[3];
+	stages[0].func = decode_stage;
+	stages[0].queue_depth = 0;
+	stages[1].func = convert_stage;
+	stages[1].queue_depth = queue_depth[0];
+	stages[2].func = save_stage;
+	stages[2].queue_depth = queue_depth[1];
+
+	double t0 = get_time_sec();
+	run_pipeline(num_inputs, stages, 3, &batch);
+	double dt = get_time_sec() - t0;
+
+	if(seq_pattern) {
+		/* the sustained rate leaves out the time to fill the pipeline, until the
+		 * first frame is saved
+		 */
+		int num_conv = num_inputs - batch.num_failed;
+		printf("%d frames in %.3f sec: %.2f fps, %.2f Mpixels/s\n", num_conv, dt, num_conv / dt,
+				batch.out_pixels / dt * 1e-6);
+		if(num_conv > 1) {
+			printf("sustained: %.2f fps\n", (num_conv - 1) / (batch.last_save - batch.first_save));
+		}
+		printf("busy time: load %.3f, convert %.3f, save %.3f sec\n", stages[0].busy_time,
+				stages[1].busy_time, stages[2].busy_time);
+	} else if(num_inputs > 1) {
+		int num_conv = num_inputs - batch.num_failed;
+		printf("%d images in %.3f sec: %.2f images/s, %.2f Mpixels/s\n", num_conv, dt,
+				num_conv / dt, batch.out_pixels / dt * 1e-6);
+		printf("busy time: load %.3f, convert %.3f, save %.3f sec\n", stages[0].busy_time,
+				stages[1].busy_time, stages[2].busy_time);
+	}
+	if(batch.num_failed) {
+		fprintf(stderr, "%d of %d images failed\n", (int)batch.num_failed, num_inputs);
+	}
+
+	delete [] batch.jobs;
+	clear_remap_cache();
+	trim_buffers(&bufpool, 0);
+	return batch.num_failed ? 1 : 0;
+}
+
+static volatile sig_atomic_t quit_watch;
+
+static void watch_signal(int sig)
+{
+	quit_watch = 1;
+}
+
+/* daemon mode: converts the images arriving in watch_path, one at a time on
+ * the same thread pools, remap table cache and face buffers, until SIGINT or
+ * SIGTERM. The image being converted is finished before exiting.
+ */
+static int batch_watch()
+{
+	// outputs written in the watched directory would be picked up as inputs
+	OutputNames names;
+	std::string probe = std::string(watch_path) + "/probe.jpg";
+	if(!init_output_names(&names, probe.c_str(), true, &out_settings)) {
+		return 1;
+	}
+	std::string outdir = names.atlas;
+	size_t slash = outdir.rfind('/');
+	outdir = slash == std::string::npos ? "." : outdir.substr(0, slash + 1);
+
+	char *real_out = realpath(outdir.c_str(), 0);
+	char *real_watch = realpath(watch_path, 0);
+	bool same = real_out && real_watch && strcmp(real_out, real_watch) == 0;
+	free(real_out);
+	free(real_watch);
+	if(same) {
+		fprintf(stderr, "the outputs can't be written in the watched directory, use -o to write them elsewhere\n");
+		return 1;
+	}
+
+	WatchDir *wd = open_watch_dir(watch_path);
+	if(!wd) {
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = watch_signal;	// no SA_RESTART, to interrupt the wait for new files
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	ThreadPool conv_pool(num_threads);
+	ThreadPool save_pool(num_threads);
+	BufferPool bufpool;
+
+	BatchJob job;
+	job.set = &out_settings;
+
+	Batch batch;
+	batch.jobs = &job;
+	batch.num_jobs = 0;
+	batch.num_failed = 0;
+	batch.num_done = 0;
+	batch.out_pixels = 0;
+	batch.conv_pool = &conv_pool;
+	batch.save_pool = &save_pool;
+	batch.bufpool = &bufpool;
+	verbose = false;
+
+	printf("watching %s (%d images pending)\n", watch_path, watch_dir_pending(wd));
+	fflush(stdout);
+
+	int prev_width = 0, prev_height = 0;
+	char fname[512];
+	while(!quit_watch && watch_dir_next(wd, fname, sizeof fname)) {
+		job.fname = fname;
+
+		bool res = init_output_names(&job.out, fname, true, &out_settings) && load_job(&batch, &job);
+		if(res && (job.src_width != prev_width || job.src_height != prev_height)) {
+			// only the remap table of the current panorama size is kept
+			clear_remap_cache();
+			prev_width = job.src_width;
+			prev_height = job.src_height;
+		}
+		res = res && convert_job(&batch, &job) && save_job(&batch, &job);
+		if(!res) {
+			fprintf(stderr, "failed to convert: %s\n", fname);
+		}
+		if(!watch_dir_done(wd, fname, res)) {
 			break;
 		}
+		// keep the buffers of the last image only (its six faces, or the atlas)
+		trim_buffers(&bufpool, 6);
+		fflush(stdout);
 	}
+
+	printf("stopped watching %s: %d images converted, %d failed\n", watch_path,
+			(int)batch.num_done, (int)batch.num_failed);
+
+	close_watch_dir(wd);
+	clear_remap_cache();
+	trim_buffers(&bufpool, 0);
+	return 0;
 }
 
-static float prev_x, prev_y;
-static bool bnstate[16];
+static Batch *serve_batch;
+static std::mutex conv_mutex, save_mutex;
 
-void app_mouse_button(int bn, bool press, int x, int y)
+static bool remove_dir(const char *path)
 {
-	if(bn < (int)(sizeof bnstate / sizeof *bnstate)) {
-		bnstate[bn] = press;
+	DIR *dir = opendir(path);
+	if(!dir) return false;
+
+	struct dirent *dent;
+	while((dent = readdir(dir))) {
+		if(strcmp(dent->d_name, ".") != 0 && strcmp(dent->d_name, "..") != 0) {
+			std::string fname = std::string(path) + "/" + dent->d_name;
+			unlink(fname.c_str());
+		}
 	}
-	prev_x = x;
-	prev_y = y;
+	closedir(dir);
+	return rmdir(path) == 0;
 }
 
-void app_mouse_motion(int x, int y)
+/* request paths must be relative and can't go up with "..", so that clients
+ * can only read and write files under the server root (see --serve-root)
+ */
+static bool valid_request_path(const char *path)
 {
-	float dx = x - prev_x;
-	float dy = y - prev_y;
-	prev_x = x;
-	prev_y = y;
+	if(!*path || *path == '/') {
+		return false;
+	}
+	while(*path) {
+		const char *end = strchr(path, '/');
+		size_t len = end ? end - path : strlen(path);
+		if(len == 2 && path[0] == '.' && path[1] == '.') {
+			return false;
+		}
+		path += len;
+		while(*path == '/') path++;
+	}
+	return true;
+}
 
-	if(!dx && !dy) return;
+// prefixes a relative path with the server root, if one was set
+static bool root_path(char *buf, int bufsz, const char *path)
+{
+	if(!serve_root || path[0] == '/') {
+		if((int)strlen(path) >= bufsz) return false;
+		strcpy(buf, path);
+		return true;
+	}
+	return snprintf(buf, bufsz, "%s/%s", serve_root, path) < bufsz;
+}
 
-	if(bnstate[0]) {
-		cam_theta += dx * 0.5;
-		cam_phi += dy * 0.5;
+/* reads the uploaded image into the temporary directory. The size must be a
+ * plain decimal number, no larger than --max-upload.
+ */
+static bool read_upload(ServerRequest *req, const char *size_str, const char *tmpdir,
+		std::string *fname)
+{
+	char *endp;
+	errno = 0;
+	unsigned long long size = strtoull(size_str, &endp, 10);
+	if(!isdigit(*size_str) || *endp || errno == ERANGE) {
+		request_error(req, "invalid data size: %s", size_str);
+		request_hangup(req);
+		return false;
+	}
+	if(size > (unsigned long long)max_upload_mb << 20) {
+		request_error(req, "data too large: %llu bytes (limit %d MB)", size, max_upload_mb);
+		request_hangup(req);
+		return false;
+	}
 
-		if(cam_phi < -90) cam_phi = -90;
-		if(cam_phi > 90) cam_phi = 90;
-		app_redisplay();
+	const char *name = request_arg(req, "name");
+	if(!name || !*name || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		name = "input";
 	}
+	*fname = std::string(tmpdir) + "/" + name;
+	return request_read_data(req, size, fname->c_str());
 }
 
-static bool parse_args(int argc, char **argv)
+/* converts in_fname, and replies with the output files. out_dir is the
+ * temporary directory for return=data outputs.
+ */
+static bool serve_convert_file(ServerRequest *req, const char *in_fname, const char *out_dir)
 {
-	for(int i=1; i<argc; i++) {
-		if(argv[i][0] == '-') {
-			fprintf(stderr, "invalid option: %s\n", argv[i]);
+	const char *arg;
+
+	OutputSettings set = out_settings;
+	if((arg = request_arg(req, "face-size")) && (set.face_size = atoi(arg)) <= 0) {
+		request_error(req, "invalid face-size: %s", arg);
+		return false;
+	}
+	if(set.face_size > max_face_size) {
+		request_error(req, "face-size too large: %d (limit %d)", set.face_size, max_face_size);
+		return false;
+	}
+	if((arg = request_arg(req, "format"))) {
+		if(strlen(arg) >= sizeof set.suffix - 1) {
+			request_error(req, "invalid format: %s", arg);
+			return false;
+		}
+		sprintf(set.suffix, "%s%s", arg[0] == '.' ? "" : ".", arg);
+	}
+	if((arg = request_arg(req, "layout")) && (set.layout = find_layout(arg)) == -1) {
+		request_error(req, "invalid layout: %s", arg);
+		return false;
+	}
+	if((arg = request_arg(req, "output"))) {
+		if(!valid_request_path(arg)) {
+			request_error(req, "invalid output: %s (must be relative, without ..)", arg);
+			return false;
+		}
+		set.tmpl = arg;
+	}
+	if((arg = request_arg(req, "sh")) && (set.sh_order = atoi(arg)) != 0 &&
+			set.sh_order != 2 && set.sh_order != 3) {
+		request_error(req, "invalid sh: %s (2 or 3)", arg);
+		return false;
+	}
+	if((arg = request_arg(req, "sh-format"))) {
+		if(strcmp(arg, "json") != 0 && strcmp(arg, "bin") != 0) {
+			request_error(req, "invalid sh-format: %s (json or bin)", arg);
+			return false;
+		}
+		set.sh_binary = strcmp(arg, "bin") == 0;
+	}
+	if((arg = request_arg(req, "compress")) && (set.compress = find_name(comp_format_name, arg)) == -1) {
+		request_error(req, "invalid compress: %s (none, bc1, bc7 or bc6h)", arg);
+		return false;
+	}
+	if((arg = request_arg(req, "compress-quality")) &&
+			(set.comp_quality = find_name(comp_quality_name, arg)) == -1) {
+		request_error(req, "invalid compress-quality: %s (fast, normal or best)", arg);
+		return false;
+	}
+	if((arg = request_arg(req, "seam-fix")) && (set.seam_width = atoi(arg)) < 0) {
+		request_error(req, "invalid seam-fix: %s (band width in texels)", arg);
+		return false;
+	}
+	if((arg = request_arg(req, "ggx"))) {
+		if(strcmp(arg, "all") == 0) {
+			set.mip_levels = -1;
+		} else if((set.mip_levels = atoi(arg)) <= 0) {
+			request_error(req, "invalid ggx: %s (number of mip levels, or all)", arg);
 			return false;
-		} else {
-			if(img_fname) {
-				fprintf(stderr, "unexpected option: %s\n", argv[i]);
-				return false;
-			}
-			img_fname = argv[i];
 		}
 	}
 
+	std::string out_tmpl;
+	if(out_dir) {
+		out_tmpl = std::string(out_dir) + "/out/{name}_{face}{ext}";
+		set.tmpl = out_tmpl.c_str();
+	}
+
+	// input names are relative to the root, and so are the output names made from them
+	BatchJob job;
+	job.set = &set;
+	char in_path[512];
+	if(!root_path(in_path, sizeof in_path, in_fname)) {
+		request_error(req, "input path too long");
+		return false;
+	}
+	job.fname = in_path;
+
+	set.root = serve_root;
+	if(!init_output_names(&job.out, in_fname, true, &set)) {
+		request_error(req, "invalid output settings");
+		return false;
+	}
+	if(!load_job(serve_batch, &job)) {
+		request_error(req, "failed to load %s", in_fname);
+		return false;
+	}
+
+	bool res;
+	{
+		// loading and saving overlap with other requests, the pools are shared
+		std::lock_guard<std::mutex> lock(conv_mutex);
+		res = convert_job(serve_batch, &job);
+		// no other conversion can be using the remap tables now
+		trim_remap_cache((size_t)remap_cache_mb << 20);
+	}
+	if(res) {
+		std::lock_guard<std::mutex> lock(save_mutex);
+		res = save_job(serve_batch, &job);
+	}
+	if(!res) {
+		request_error(req, "conversion failed");
+		return false;
+	}
+
+	int num_out = job.out.layout == LAYOUT_SEPARATE && !job.out.cubefile ? 6 : 1;
+	int num_levels = job.out.cubefile ? 1 : job.mips.levels;
+	for(int i=0; i<num_levels * num_out && res; i++) {
+		OutputNames mnames;
+		const OutputNames *names = &job.out;
+		if(i >= num_out) {
+			mip_output_names(&mnames, &job.out, i / num_out);
+			names = &mnames;
+		}
+		const char *fname = num_out == 1 ? names->atlas : names->face[i % num_out];
+		if(out_dir) {
+			res = reply_file(req, strrchr(fname, '/') + 1, fname);
+		} else {
+			reply_line(req, "output %s", fname);
+		}
+	}
+	if(set.sh_order && res) {
+		if(out_dir) {
+			res = reply_file(req, strrchr(job.out.sh, '/') + 1, job.out.sh);
+		} else {
+			reply_line(req, "output %s", job.out.sh);
+		}
+	}
+	return res;
+}
+
+/* "convert" request handler. Arguments:
+ * - input=<path>, or data=<size> with the image data following the request
+ *   line, and name=<filename> for the uploaded image
+ * - face-size, format, layout and output, as the command-line options
+ * - return=paths (default) replies with "output <path>" for each output
+ *   file, return=data sends the output files back instead of keeping them
+ * input and output paths are relative to the server root. Uploaded data is
+ * read before anything else, so that the rest of the request can be
+ * rejected without losing track of the connection.
+ */
+static bool serve_convert(ServerRequest *req)
+{
+	const char *input = request_arg(req, "input");
+	const char *data = request_arg(req, "data");
+	if(!input == !data) {
+		request_error(req, "either input or data must be passed");
+		if(data) request_hangup(req);
+		return false;
+	}
+	if(input && !valid_request_path(input)) {
+		request_error(req, "invalid input: %s (must be relative, without ..)", input);
+		return false;
+	}
+
+	bool ret_data = false;
+	const char *arg;
+	if((arg = request_arg(req, "return"))) {
+		if(strcmp(arg, "data") == 0) {
+			ret_data = true;
+		} else if(strcmp(arg, "paths") != 0) {
+			request_error(req, "invalid return: %s (paths or data)", arg);
+			if(data) request_hangup(req);
+			return false;
+		}
+	}
+
+	// uploaded inputs, and outputs which are sent back, go in a temporary directory
+	char tmpdir[] = "/tmp/cubemapper-XXXXXX";
+	bool use_tmpdir = data || ret_data;
+	if(use_tmpdir && !mkdtemp(tmpdir)) {
+		request_error(req, "failed to create temporary directory: %s", strerror(errno));
+		if(data) request_hangup(req);
+		return false;
+	}
+
+	std::string in_fname = input ? input : "";
+	bool res = true;
+	if(data) {
+		res = read_upload(req, data, tmpdir, &in_fname);
+	}
+	if(res) {
+		res = serve_convert_file(req, in_fname.c_str(), ret_data ? tmpdir : 0);
+	}
+
+	if(use_tmpdir) {
+		if(ret_data) {
+			remove_dir((std::string(tmpdir) + "/out").c_str());
+		}
+		remove_dir(tmpdir);
+	}
+	return res;
+}
+
+static bool serve_request(ServerRequest *req, void *cls)
+{
+	const char *cmd = request_command(req);
+	if(strcmp(cmd, "convert") == 0) {
+		return serve_convert(req);
+	}
+	request_error(req, "unknown command: %s", cmd);
+	return false;
+}
+
+/* server mode: serves conversion requests on a Unix domain socket, all on the
+ * same thread pools and remap table cache (see server.h and serve_convert)
+ */
+static int batch_serve()
+{
+	ThreadPool conv_pool(num_threads);
+	ThreadPool save_pool(num_threads);
+
+	Batch batch;
+	batch.jobs = 0;
+	batch.num_jobs = 0;
+	batch.num_failed = 0;
+	batch.num_done = 0;
+	batch.out_pixels = 0;
+	batch.conv_pool = &conv_pool;
+	batch.save_pool = &save_pool;
+	batch.bufpool = 0;
+	serve_batch = &batch;
+	verbose = false;
+
+	bool res = run_server(serve_path, serve_request, 0);
+
+	clear_remap_cache();
+	return res ? 0 : 1;
+}
+
+static int batch_bench()
+{
+	Image src;
+	if(!load_image(&src, img_fname, load_flags)) {
+		return 1;
+	}
+	printf("loaded image: %dx%d (%s)\n", src.width, src.height, pixfmt_name(src.fmt));
+
+	cube_size = face_size > 0 ? face_size : src.height;
+
+	bool remap;
+	job_options(&conv_opt, &remap, src.height, cube_size);
+
+	OutputNames names;
+	if(!init_output_names(&names, img_fname, false, &out_settings)) {
+		destroy_image(&src);
+		return 1;
+	}
+
+	Image faces[6], atlas;
+	if(!init_faces(faces, &atlas, cube_size, src.fmt, &names, false)) {
+		destroy_image(&src);
+		return 1;
+	}
+
+	ThreadPool tpool(num_threads);
+	run_benchmark(&src, faces, &tpool);
+
+	destroy_faces(faces, &atlas);
+	destroy_image(&src);
+	return 0;
+}
+
+/* cubemap -> equirect conversion, img_fname is the +X face, or the atlas with
+ * --layout. The output is 4 face sizes wide and 2 face sizes high.
+ */
+static int batch_to_equirect()
+{
+	Image faces[6], atlas;
+	atlas.pixels = 0;
+	if(layout != LAYOUT_SEPARATE) {
+		if(!load_image(&atlas, img_fname, load_flags)) {
+			return 1;
+		}
+		if(!layout_face_size(layout, atlas.width, atlas.height)) {
+			fprintf(stderr, "%s: %dx%d isn't a %s layout atlas\n", img_fname, atlas.width,
+					atlas.height, layout_name[layout]);
+			destroy_image(&atlas);
+			return 1;
+		}
+		layout_faces(layout, &atlas, faces);
+	} else if(!load_cubemap(faces, img_fname, load_flags)) {
+		return 1;
+	}
+	int size = faces[0].width;
+	printf("loaded cubemap: 6x %dx%d (%s)\n", size, size, pixfmt_name(faces[0].fmt));
+
+	if(conv_opt.filter == FILTER_AREA) {
+		printf("the %s filter isn't supported for cubemap to equirect conversion\n",
+				filter_name[FILTER_AREA]);
+		conv_opt.filter = FILTER_BILINEAR;
+	}
+
+	// named like the other outputs, with "equirect" as the face
+	const char *name = strrchr(img_fname, '/');
+	const char *suffix = out_suffix;
+	if(!*suffix && !(suffix = strrchr(name ? name : img_fname, '.'))) {
+		suffix = ".jpg";
+	}
+	char fname[512];
+	if(!expand_template(fname, sizeof fname, out_template ? out_template : "equirect{ext}",
+				img_fname, "equirect", suffix)) {
+		destroy_faces(faces, &atlas);
+		return 1;
+	}
+	if(out_template) {
+		make_parent_dirs(fname);
+	}
+
+	Image dest;
+	if(!init_output(&dest, fname, size * 4, size * 2, faces[0].fmt)) {
+		destroy_faces(faces, &atlas);
+		return 1;
+	}
+
+	ThreadPool tpool(num_threads);
+
+	printf("rendering equirect %dx%d (cpu, %d threads)\n", dest.width, dest.height, tpool.get_num_threads());
+	double t0 = get_time_sec();
+	bool res;
+	if(use_remap) {
+		RemapKey key;
+		init_remap_key(&key, dest.width, dest.height, size, &conv_opt, true);
+
+		RemapTable *rmap = get_remap(&key, &tpool);
+		if((res = rmap != 0)) {
+			double t1 = get_time_sec();
+			printf("remap table ready in %.3f sec\n", t1 - t0);
+			t0 = t1;
+
+			convert_equirect_remap(faces, &dest, rmap, &tpool);
+		}
+	} else {
+		res = convert_equirect(faces, &dest, &conv_opt, &tpool);
+	}
+	if(res) {
+		double dt = get_time_sec() - t0;
+		printf("converted in %.3f sec (%.2f Mpixels/s)\n", dt, (double)dest.width * dest.height / dt * 1e-6);
+
+		res = dest.map ? true : save_image(&dest, fname);
+	}
+
+	destroy_image(&dest);
+	destroy_faces(faces, &atlas);
+	clear_remap_cache();
+	return res ? 0 : 1;
+}
+
+/* streaming conversion of a raw PPM/PFM panorama, in a window of at most
+ * mem_limit_mb megabytes
+ */
+static int batch_stream()
+{
+	if(conv_opt.filter == FILTER_AREA) {
+		printf("the %s filter isn't supported in streaming mode, using %s\n",
+				filter_name[FILTER_AREA], filter_name[FILTER_BILINEAR]);
+		conv_opt.filter = FILTER_BILINEAR;
+	}
+	if(use_remap) {
+		printf("remap tables aren't used in streaming mode\n");
+	}
+	if(layout != LAYOUT_SEPARATE) {
+		printf("the %s layout isn't supported in streaming mode, writing separate faces\n",
+				layout_name[layout]);
+	}
+
+	OutputNames names;
+	if(!init_output_names(&names, img_fname, false, &out_settings)) {
+		return 1;
+	}
+
+	const char *fnptr[6];
+	for(int i=0; i<6; i++) {
+		fnptr[i] = names.face[i];
+	}
+
+	ThreadPool tpool(num_threads);
+
+	ShProjection sh;
+	if(sh_order) {
+		init_sh(&sh, sh_order);
+	}
+
+	printf("streaming conversion (cpu, %d threads, %d MB memory limit)\n", tpool.get_num_threads(),
+			mem_limit_mb);
+	double t0 = get_time_sec();
+	bool res = convert_cubemap_stream(img_fname, fnptr, face_size, &conv_opt, load_flags,
+			(size_t)mem_limit_mb << 20, &tpool, sh_order ? &sh : 0);
+	if(res) {
+		printf("converted in %.3f sec\n", get_time_sec() - t0);
+		if(sh_order) {
+			res = save_sh(&sh, names.sh);
+		}
+	}
+	if(sh_order) {
+		destroy_sh(&sh);
+	}
+	return res ? 0 : 1;
+}
+
+// loads a previous output to update it, mapped in place if it's a raw file
+static bool load_output(Image *img, const char *fname, int width, int height, int fmt)
+{
+	if(fmt == PIXFMT_RGBH || !raw_image_suffix(fname, fmt) || !update_mapped_image(img, fname)) {
+		unsigned int flags = fmt == PIXFMT_RGB8 ? 0 : LOAD_FLOAT;
+		if(fmt == PIXFMT_RGBH) flags |= LOAD_HALF;
+		if(!load_image(img, fname, flags)) {
+			return false;
+		}
+	}
+	if(img->width != width || img->height != height || img->fmt != fmt) {
+		fprintf(stderr, "%s: %dx%d (%s) doesn't match the conversion: %dx%d (%s)\n", fname,
+				img->width, img->height, pixfmt_name(img->fmt), width, height, pixfmt_name(fmt));
+		destroy_image(img);
+		return false;
+	}
+	return true;
+}
+
+/* incremental re-conversion of a retouched panorama, into the outputs of its
+ * previous conversion (with the same options). Only the face tiles which read
+ * from the dirty rectangles, or from the regions that differ from the
+ * previous version of the panorama, are converted again. Raw outputs are
+ * updated in place, and other files are only rewritten if they changed.
+ */
+static int batch_update()
+{
+	OutputNames names;
+	if(!init_output_names(&names, img_fname, false, &out_settings)) {
+		return 1;
+	}
+	if(names.cubefile) {
+		fprintf(stderr, "%s cubemaps can't be updated, convert the image again in full\n",
+				cubefile_name[names.cubefile]);
+		return 1;
+	}
+
+	Image src;
+	if(!load_image(&src, img_fname, load_flags)) {
+		return 1;
+	}
+	printf("loaded image: %dx%d (%s)\n", src.width, src.height, pixfmt_name(src.fmt));
+
+	std::vector<DirtyRect> rects;
+	for(size_t i=0; i<dirty_rects.size(); i++) {
+		DirtyRect rect = dirty_rects[i];
+		if(rect.x < 0) {
+			rect.width += rect.x;
+			rect.x = 0;
+		}
+		if(rect.y < 0) {
+			rect.height += rect.y;
+			rect.y = 0;
+		}
+		if(rect.x + rect.width > src.width) rect.width = src.width - rect.x;
+		if(rect.y + rect.height > src.height) rect.height = src.height - rect.y;
+		if(rect.width > 0 && rect.height > 0) {
+			rects.push_back(rect);
+		}
+	}
+	if(diff_fname) {
+		Image prev;
+		if(!load_image(&prev, diff_fname, load_flags)) {
+			destroy_image(&src);
+			return 1;
+		}
+		bool res = diff_images(&src, &prev, &rects);
+		destroy_image(&prev);
+		if(!res) {
+			destroy_image(&src);
+			return 1;
+		}
+	}
+
+	int size = face_size > 0 ? face_size : src.height;
+	ConvOptions opt;
+	bool remap;		// remap tables give the same results, nothing to do with them here
+	job_options(&opt, &remap, src.height, size);
+
+	Image faces[6], atlas;
+	atlas.pixels = 0;
+	if(names.layout != LAYOUT_SEPARATE) {
+		int width, height;
+		layout_atlas_size(names.layout, size, &width, &height);
+		if(!load_output(&atlas, names.atlas, width, height, src.fmt)) {
+			destroy_image(&src);
+			return 1;
+		}
+		layout_faces(names.layout, &atlas, faces);
+	} else {
+		for(int i=0; i<6; i++) {
+			if(!load_output(faces + i, names.face[i], size, size, src.fmt)) {
+				for(int j=0; j<i; j++) {
+					destroy_image(faces + j);
+				}
+				destroy_image(&src);
+				return 1;
+			}
+		}
+	}
+
+	int num_tiles = cube_tile_count(size);
+	std::vector<unsigned char> tiles(num_tiles, TILE_CLEAN);
+	int num_dirty = mark_dirty_tiles(rects.data(), rects.size(), src.width, src.height, size,
+			&opt, tiles.data());
+	printf("%d dirty regions, %d of %d tiles to convert again\n", (int)rects.size(), num_dirty, num_tiles);
+
+	ThreadPool tpool(num_threads);
+
+	double t0 = get_time_sec();
+	int num_changed = update_cubemap(&src, faces, &opt, tiles.data(), &tpool);
+	destroy_image(&src);
+	if(num_changed == -1) {
+		destroy_faces(faces, &atlas);
+		return 1;
+	}
+	printf("converted in %.3f sec (cpu, %d threads), %d tiles changed\n", get_time_sec() - t0,
+			tpool.get_num_threads(), num_changed);
+
+	// mapped files have already been updated in place, the rest are saved if they changed
+	bool changed[6] = {false};
+	for(int i=0; i<num_tiles; i++) {
+		if(tiles[i] == TILE_CHANGED) {
+			changed[i / (num_tiles / 6)] = true;
+		}
+	}
+
+	bool res = true;
+	int num_written = 0;
+	if(atlas.pixels) {
+		if(num_changed) {
+			if(!atlas.map) res = save_image(&atlas, names.atlas);
+			num_written++;
+		}
+	} else {
+		for(int i=0; i<6; i++) {
+			if(changed[i]) {
+				if(!faces[i].map) res = save_image(faces + i, names.face[i]) && res;
+				num_written++;
+			}
+		}
+	}
+	printf("%d of %d output files updated\n", num_written, atlas.pixels ? 1 : 6);
+
+	destroy_faces(faces, &atlas);
+	return res ? 0 : 1;
+}
+
+#define BENCH_ITER	3
+
+/* maximum error of the equirect coordinates computed by dirmap_face_span
+ * against dirmap_face_span_ref, over the texel centers of all the faces.
+ * u wraps around, so its error is taken the short way around, and scaled by
+ * the radius of the parallel like the bound in dirmap.h.
+ */
+static void dirmap_error(int size, float *max_du, float *max_dv)
+{
+	std::vector<float> buf(size * 4);
+	float *u = &buf[0], *v = u + size, *ref_u = v + size, *ref_v = ref_u + size;
+
+	*max_du = *max_dv = 0.0f;
+	for(int i=0; i<6; i++) {
+		for(int j=0; j<size; j++) {
+			dirmap_face_span(i, size, j, 0, size, u, v);
+			dirmap_face_span_ref(i, size, j, 0, size, ref_u, ref_v);
+
+			for(int k=0; k<size; k++) {
+				float du = fabs(u[k] - ref_u[k]);
+				du = std::min(du, 1.0f - du) * sin(ref_v[k] * M_PI);
+				*max_du = std::max(*max_du, du);
+				*max_dv = std::max(*max_dv, (float)fabs(v[k] - ref_v[k]));
+			}
+		}
+	}
+}
+
+/* converts the image with every filter, both directly and through a remap
+ * table, and reports the best throughput out of BENCH_ITER runs of each.
+ * Also checks the accuracy of the direction mapping, see dirmap_face_span.
+ */
+static void run_benchmark(const Image *src, Image *faces, ThreadPool *tpool)
+{
+	double mpix = 6.0 * faces[0].width * faces[0].height * 1e-6;
+
+	printf("benchmark: %dx%d -> 6x %dx%d, %d threads\n", src->width, src->height,
+			faces[0].width, faces[0].height, tpool->get_num_threads());
+
+	float max_du, max_dv;
+	dirmap_error(faces[0].width, &max_du, &max_dv);
+	printf("dirmap (%d wide): max error u %.2g, v %.2g (%s 7e-7)\n", dirmap_simd_width,
+			max_du, max_dv, max_du < 7e-7f && max_dv < 7e-7f ? "within" : "above");
+	printf("%-10s %16s %16s\n", "filter", "direct (Mpix/s)", "remap (Mpix/s)");
+
+	ConvOptions opt = conv_opt;
+	for(int i=0; i<NUM_FILTERS; i++) {
+		opt.filter = i;
+
+		RemapTable *rmap = 0;
+		if(i != FILTER_AREA) {
+			RemapKey key;
+			init_remap_key(&key, src->width, src->height, faces[0].width, &opt);
+			rmap = create_remap(&key, tpool);
+		}
+
+		double best_direct = 0.0, best_remap = 0.0;
+		for(int j=0; j<BENCH_ITER; j++) {
+			double t0 = get_time_sec();
+			convert_cubemap(src, faces, &opt, tpool);
+			double t1 = get_time_sec();
+			if(rmap) {
+				convert_cubemap_remap(src, faces, rmap, tpool);
+			}
+			double t2 = get_time_sec();
+
+			if(mpix / (t1 - t0) > best_direct) best_direct = mpix / (t1 - t0);
+			if(mpix / (t2 - t1) > best_remap) best_remap = mpix / (t2 - t1);
+		}
+		if(rmap) {
+			printf("%-10s %16.2f %16.2f\n", filter_name[i], best_direct, best_remap);
+		} else {
+			printf("%-10s %16.2f %16s\n", filter_name[i], best_direct, "-");
+		}
+
+		free_remap(rmap);
+	}
+}
+
+/* outputs which can be written as raw image files are mapped, and the
+ * conversion writes straight into them. The rest are saved afterwards.
+ */
+static bool init_output(Image *img, const char *fname, int width, int height, int fmt,
+		BufferPool *pool)
+{
+	if(fmt == PIXFMT_RGBH || !raw_image_suffix(fname, fmt)) {
+		return get_buffer(pool, img, width, height, fmt);
+	}
+	// don't truncate an input, if it's mapped it's still needed
+	for(int i=0; i<num_inputs; i++) {
+		if(strcmp(fname, img_fnames[i]) == 0) {
+			return get_buffer(pool, img, width, height, fmt);
+		}
+	}
+	return create_mapped_image(img, fname, width, height, fmt);
+}
+
+// takes a buffer of the same size and format from the pool, or allocates one
+static bool get_buffer(BufferPool *pool, Image *img, int width, int height, int fmt)
+{
+	if(pool) {
+		std::lock_guard<std::mutex> guard(pool->lock);
+		for(size_t i=0; i<pool->free_imgs.size(); i++) {
+			Image *buf = &pool->free_imgs[i];
+			if(buf->width == width && buf->height == height && buf->fmt == fmt) {
+				*img = *buf;
+				pool->free_imgs.erase(pool->free_imgs.begin() + i);
+				return true;
+			}
+		}
+	}
+	return init_image(img, width, height, fmt);
+}
+
+// returns a buffer to the pool, mapped images are destroyed
+static void put_buffer(BufferPool *pool, Image *img)
+{
+	if(pool && !img->map) {
+		std::lock_guard<std::mutex> guard(pool->lock);
+		pool->free_imgs.push_back(*img);
+		img->pixels = 0;
+		return;
+	}
+	destroy_image(img);
+}
+
+// destroys the pooled buffers except the last keep returned
+static void trim_buffers(BufferPool *pool, size_t keep)
+{
+	std::lock_guard<std::mutex> guard(pool->lock);
+	if(pool->free_imgs.size() <= keep) return;
+
+	size_t num = pool->free_imgs.size() - keep;
+	for(size_t i=0; i<num; i++) {
+		destroy_image(&pool->free_imgs[i]);
+	}
+	pool->free_imgs.erase(pool->free_imgs.begin(), pool->free_imgs.begin() + num);
+}
+
+/* expands an output filename template for the given input: {dir} is the
+ * directory of the input (with a trailing slash, or empty), {name} its
+ * filename without the suffix, {frame} the number at the end of the name,
+ * {face} the face name and {ext} the suffix
+ */
+static bool expand_template(char *buf, int bufsz, const char *tmpl, const char *in_fname,
+		const char *face, const char *suffix)
+{
+	const char *tmpl_start = tmpl;
+	const char *name = strrchr(in_fname, '/');
+	name = name ? name + 1 : in_fname;
+	const char *name_end = strrchr(name, '.');
+	if(!name_end) name_end = name + strlen(name);
+	const char *frame = name_end;
+	while(frame > name && isdigit(frame[-1])) frame--;
+
+	char *dest = buf;
+	char *end = buf + bufsz - 1;
+	while(*tmpl) {
+		const char *str = tmpl;
+		int len = 1;
+
+		if(*tmpl == '{') {
+			const char *close = strchr(tmpl, '}');
+			int keylen = close ? close - tmpl + 1 : 0;
+
+			if(keylen == 5 && memcmp(tmpl, "{dir}", 5) == 0) {
+				str = in_fname;
+				len = name - in_fname;
+			} else if(keylen == 6 && memcmp(tmpl, "{name}", 6) == 0) {
+				str = name;
+				len = name_end - name;
+			} else if(keylen == 7 && memcmp(tmpl, "{frame}", 7) == 0) {
+				if(frame == name_end) {
+					fprintf(stderr, "{frame} in output filename template, but no frame number in: %s\n", in_fname);
+					return false;
+				}
+				str = frame;
+				len = name_end - frame;
+			} else if(keylen == 6 && memcmp(tmpl, "{face}", 6) == 0) {
+				str = face;
+				len = strlen(face);
+			} else if(keylen == 5 && memcmp(tmpl, "{ext}", 5) == 0) {
+				str = suffix;
+				len = strlen(suffix);
+			} else {
+				fprintf(stderr, "invalid output filename template: %s\n", tmpl_start);
+				return false;
+			}
+			tmpl += keylen;
+		} else {
+			tmpl++;
+		}
+
+		if(dest + len > end) {
+			fprintf(stderr, "output filename too long for input: %s\n", in_fname);
+			return false;
+		}
+		memcpy(dest, str, len);
+		dest += len;
+	}
+	*dest = 0;
+	return true;
+}
+
+// creates the missing parent directories of fname
+static void make_parent_dirs(const char *fname)
+{
+	char path[512];
+	snprintf(path, sizeof path, "%s", fname);
+
+	char *ptr = path;
+	while((ptr = strchr(ptr + 1, '/'))) {
+		*ptr = 0;
+		mkdir(path, 0777);
+		*ptr = '/';
+	}
+}
+
+/* output filenames are made from the template, with {face} being "cubemap"
+ * for atlases and cubemap files. The default is cubemap_{face}{ext}, or
+ * {name}_cubemap_{face}{ext} with multiple inputs, and the atlas is
+ * cubemap{ext} or {name}_cubemap{ext}. The suffix is the one in the settings,
+ * or the suffix of the input.
+ */
+static bool init_output_names(OutputNames *names, const char *in_fname, bool multi,
+		const OutputSettings *set)
+{
+	const char *name = strrchr(in_fname, '/');
+	const char *suffix = set->suffix;
+	if(!*suffix && !(suffix = strrchr(name ? name : in_fname, '.'))) {
+		suffix = ".jpg";
+	}
+	names->cubefile = cubefile_type(suffix);
+	if(set->compress && !names->cubefile) {
+		fprintf(stderr, "block compressed cubemaps can only be saved as ktx, ktx2 or dds files\n");
+		return false;
+	}
+	names->layout = names->cubefile ? LAYOUT_SEPARATE : set->layout;
+
+	const char *tmpl = set->tmpl;
+	if(tmpl && !strstr(tmpl, "{face}") && (names->layout == LAYOUT_SEPARATE || stream_mode) &&
+			!names->cubefile) {
+		fprintf(stderr, "the output filename template must contain {face} for separate faces\n");
+		return false;
+	}
+
+	const char *face_tmpl = tmpl, *atlas_tmpl = tmpl;
+	if(!tmpl) {
+		face_tmpl = multi ? "{name}_cubemap_{face}{ext}" : "cubemap_{face}{ext}";
+		atlas_tmpl = multi ? "{name}_cubemap{ext}" : "cubemap{ext}";
+	}
+
+	for(int i=0; i<6; i++) {
+		if(!expand_template(names->face[i], sizeof names->face[i], face_tmpl, in_fname,
+					cube_face_name[i], suffix)) {
+			return false;
+		}
+	}
+	if(!expand_template(names->atlas, sizeof names->atlas, atlas_tmpl, in_fname, "cubemap", suffix)) {
+		return false;
+	}
+	if(set->sh_order && !expand_template(names->sh, sizeof names->sh, face_tmpl, in_fname, "sh",
+				set->sh_binary ? ".bin" : ".json")) {
+		return false;
+	}
+	if(set->root) {
+		char *fnames[] = {names->face[0], names->face[1], names->face[2], names->face[3],
+			names->face[4], names->face[5], names->atlas, names->sh};
+		for(int i=0; i<(int)(sizeof fnames / sizeof *fnames); i++) {
+			char buf[sizeof names->atlas];
+			if(!*fnames[i] || fnames[i][0] == '/') continue;
+			if(snprintf(buf, sizeof buf, "%s/%s", set->root, fnames[i]) >= (int)sizeof buf) {
+				fprintf(stderr, "output filename too long: %s/%s\n", set->root, fnames[i]);
+				return false;
+			}
+			strcpy(fnames[i], buf);
+		}
+	}
+
+	if(tmpl) {
+		// the face can be part of the directory names
+		for(int i=0; i<6; i++) {
+			make_parent_dirs(names->face[i]);
+		}
+		make_parent_dirs(names->atlas);
+	}
+	return true;
+}
+
+/* with an atlas layout, the faces are views into a single atlas image, which
+ * the conversion fills in place and gets saved once
+ */
+static bool init_faces(Image *faces, Image *atlas, int size, int fmt, const OutputNames *names,
+		bool mapped, BufferPool *pool)
+{
+	int lay = names->layout;
+
+	atlas->pixels = 0;
+	if(lay != LAYOUT_SEPARATE) {
+		int width, height;
+		layout_atlas_size(lay, size, &width, &height);
+
+		bool res;
+		if(mapped) {
+			res = init_output(atlas, names->atlas, width, height, fmt, pool);
+		} else {
+			res = get_buffer(pool, atlas, width, height, fmt);
+		}
+		if(!res) {
+			return false;
+		}
+		if(!atlas->map) {
+			// leave the unused cells of the cross black (new mapped files are zeroed)
+			memset(atlas->pixels, 0, atlas->pitch * height);
+		}
+		layout_faces(lay, atlas, faces);
+		return true;
+	}
+
+	for(int i=0; i<6; i++) {
+		bool res;
+		if(mapped) {
+			res = init_output(faces + i, names->face[i], size, size, fmt, pool);
+		} else {
+			res = get_buffer(pool, faces + i, size, size, fmt);
+		}
+		if(!res) {
+			for(int j=0; j<i; j++) {
+				put_buffer(pool, faces + j);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+struct SaveJob {
+	const Image *faces;
+	const OutputNames *names;
+	bool res[6];
+};
+
+static void save_face_task(int idx, int thr, void *cls)
+{
+	SaveJob *job = (SaveJob*)cls;
+	const Image *face = job->faces + idx;
+
+	// mapped faces are written in place
+	job->res[idx] = face->map ? true : save_image(face, job->names->face[idx]);
+}
+
+/* separate faces are encoded and written concurrently, one face per task */
+static bool save_level(const Image *faces, const Image *atlas, const OutputNames *names, ThreadPool *tpool)
+{
+	if(atlas->pixels) {
+		if(atlas->map) return true;		// written in place
+		return save_image(atlas, names->atlas);
+	}
+
+	SaveJob job;
+	job.faces = faces;
+	job.names = names;
+	tpool->run(6, save_face_task, &job);
+
+	for(int i=0; i<6; i++) {
+		if(!job.res[i]) return false;
+	}
+	return true;
+}
+
+static bool save_cubefile(const Image *faces, const OutputNames *names, const Image *mips,
+		int levels)
+{
+	switch(names->cubefile) {
+	case CUBEFILE_KTX2:
+		return save_ktx2_cubemap(faces, names->atlas, mips, levels);
+	case CUBEFILE_DDS:
+		return save_dds_cubemap(faces, names->atlas, mips, levels);
+	default:
+		break;
+	}
+	return save_ktx_cubemap(faces, names->atlas, mips, levels);
+}
+
+static bool save_cubefile_compressed(const BlockImage *faces, const OutputNames *names,
+		int levels)
+{
+	switch(names->cubefile) {
+	case CUBEFILE_KTX2:
+		return save_ktx2_compressed(faces, names->atlas, levels);
+	case CUBEFILE_DDS:
+		return save_dds_compressed(faces, names->atlas, levels);
+	default:
+		break;
+	}
+	return save_ktx_compressed(faces, names->atlas, levels);
+}
+
+/* compresses the faces of all the levels together, into levels * 6 block images */
+static bool compress_cubemap(BlockImage *comp, const Image *faces, const MipChain *mips,
+		const OutputSettings *set, ThreadPool *tpool)
+{
+	Image imgs[PREFILTER_MAX_LEVELS * 6];
+	for(int i=0; i<mips->levels * 6; i++) {
+		imgs[i] = i < 6 ? faces[i] : mips->faces[i / 6 - 1][i % 6];
+	}
+	return compress_images(imgs, comp, mips->levels * 6, set->compress, set->comp_quality, tpool);
+}
+
+static bool save_faces(const Image *faces, const Image *atlas, const OutputNames *names,
+		ThreadPool *tpool, const MipChain *mips)
+{
+	int levels = mips ? mips->levels : 1;
+
+	if(names->cubefile) {
+		return save_cubefile(faces, names, levels > 1 ? mips->faces[0] : 0, levels);
+	}
+
+	if(!save_level(faces, atlas, names, tpool)) {
+		return false;
+	}
+	for(int i=1; i<levels; i++) {
+		OutputNames mnames;
+		mip_output_names(&mnames, names, i);
+		if(!save_level(mips->faces[i - 1], mips->atlas + i - 1, &mnames, tpool)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void destroy_faces(Image *faces, Image *atlas, BufferPool *pool)
+{
+	if(atlas->pixels) {
+		put_buffer(pool, atlas);	// the faces are views into it
+		return;
+	}
+	for(int i=0; i<6; i++) {
+		put_buffer(pool, faces + i);
+	}
+}
+
+// number of GGX prefiltered levels for faces of the given size, 1 for none
+static int mip_levels(const OutputSettings *set, int size)
+{
+	if(!set->mip_levels) return 1;
+
+	int levels = mip_level_count(size);
+	if(set->mip_levels > 0 && set->mip_levels < levels) {
+		levels = set->mip_levels;
+	}
+	return levels > PREFILTER_MAX_LEVELS ? PREFILTER_MAX_LEVELS : levels;
+}
+
+// mip levels are kept in memory, and saved after the base level
+static bool init_mips(MipChain *mips, int size, int fmt, const OutputNames *names)
+{
+	for(int i=1; i<mips->levels; i++) {
+		int lsize = size >> i > 0 ? size >> i : 1;
+		if(!init_faces(mips->faces[i - 1], mips->atlas + i - 1, lsize, fmt, names, false)) {
+			for(int j=1; j<i; j++) {
+				destroy_faces(mips->faces[j - 1], mips->atlas + j - 1);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+/* GGX prefiltered levels if requested, otherwise box filtered levels down to
+ * 1x1 for cubemap files, which hold the whole mip chain. On failure nothing
+ * is left to destroy.
+ */
+static bool make_mips(MipChain *mips, const Image *faces, int size, int fmt,
+		const OutputNames *names, const OutputSettings *set, ThreadPool *tpool)
+{
+	mips->levels = mip_levels(set, size);
+	mips->prefiltered = mips->levels > 1;
+	if(!mips->prefiltered && names->cubefile) {
+		int count = mip_level_count(size);
+		mips->levels = count > PREFILTER_MAX_LEVELS ? PREFILTER_MAX_LEVELS : count;
+	}
+	if(mips->levels <= 1) {
+		return true;
+	}
+
+	double t0 = get_time_sec();
+	if(!init_mips(mips, size, fmt, names)) {
+		mips->levels = 1;
+		return false;
+	}
+	bool res;
+	if(mips->prefiltered) {
+		res = prefilter_ggx(faces, mips->faces[0], mips->levels, ggx_samples, tpool);
+	} else {
+		res = box_mip_chain(faces, mips->faces[0], mips->levels, tpool);
+	}
+	if(!res || (set->seam_width && !fix_mip_seams(mips->faces[0], mips->levels, set->seam_width, tpool))) {
+		destroy_mips(mips);
+		mips->levels = 1;
+		return false;
+	}
+	mips->time = get_time_sec() - t0;
+
+	if(verbose) {
+		if(mips->prefiltered) {
+			printf("prefiltered %d GGX mip levels in %.3f sec\n", mips->levels, mips->time);
+		} else {
+			printf("generated %d mip levels in %.3f sec\n", mips->levels, mips->time);
+		}
+	}
+	return true;
+}
+
+// appends _m<level> to the output filenames, before the suffix
+static void mip_output_names(OutputNames *mnames, const OutputNames *names, int level)
+{
+	*mnames = *names;
+
+	for(int i=0; i<7; i++) {
+		const char *fname = i < 6 ? names->face[i] : names->atlas;
+		char *dest = i < 6 ? mnames->face[i] : mnames->atlas;
+
+		const char *name = strrchr(fname, '/');
+		const char *suffix = strrchr(name ? name : fname, '.');
+		int len = suffix ? suffix - fname : (int)strlen(fname);
+		snprintf(dest, sizeof names->atlas, "%.*s_m%d%s", len, fname, level, suffix ? suffix : "");
+	}
+}
+
+static void destroy_mips(MipChain *mips)
+{
+	for(int i=1; i<mips->levels; i++) {
+		destroy_faces(mips->faces[i - 1], mips->atlas + i - 1);
+	}
+}
+
+static const char *pixfmt_name(int fmt)
+{
+	switch(fmt) {
+	case PIXFMT_RGB8:
+		return "8bit";
+	case PIXFMT_RGBH:
+		return "half float";
+	default:
+		break;
+	}
+	return "float";
+}
+
+// CUBEFILE_NONE if the output suffix isn't one of a single file cubemap
+static int cubefile_type(const char *suffix)
+{
+	for(int i=1; i<(int)(sizeof cubefile_name / sizeof *cubefile_name); i++) {
+		if(suffix[0] == '.' && strcasecmp(suffix + 1, cubefile_name[i]) == 0) {
+			return i;
+		}
+	}
+	return CUBEFILE_NONE;
+}
+
+static double get_time_sec()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void draw_equilateral()
+{
+	tex->bind();
+	glEnable(GL_TEXTURE_2D);
+	mesh->draw();
+	glDisable(GL_TEXTURE_2D);
+}
+
+static void draw_cubemap()
+{
+	glPushAttrib(GL_ENABLE_BIT);
+
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cube_tex);
+	glEnable(GL_TEXTURE_CUBE_MAP);
+	glEnable(GL_TEXTURE_GEN_S);
+	glEnable(GL_TEXTURE_GEN_T);
+	glEnable(GL_TEXTURE_GEN_R);
+
+	mesh->draw();
+
+	glPopAttrib();
+}
+
+void app_reshape(int x, int y)
+{
+	glViewport(0, 0, x, y);
+
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	gluPerspective(50.0, (float)x / (float)y, 0.5, 500.0);
+
+	win_width = x;
+	win_height = y;
+}
+
+void app_keyboard(int key, bool press)
+{
+	if(press) {
+		switch(key) {
+		case 27:
+			app_quit();
+			break;
+
+		case ' ':
+			show_cubemap = !show_cubemap;
+			app_redisplay();
+			break;
+
+		case 'c':
+			render_cubemap();
+			show_cubemap = 1;
+			app_redisplay();
+			break;
+		}
+	}
+}
+
+static float prev_x, prev_y;
+static bool bnstate[16];
+
+void app_mouse_button(int bn, bool press, int x, int y)
+{
+	if(bn < (int)(sizeof bnstate / sizeof *bnstate)) {
+		bnstate[bn] = press;
+	}
+	prev_x = x;
+	prev_y = y;
+}
+
+void app_mouse_motion(int x, int y)
+{
+	float dx = x - prev_x;
+	float dy = y - prev_y;
+	prev_x = x;
+	prev_y = y;
+
+	if(!dx && !dy) return;
+
+	if(bnstate[0]) {
+		cam_theta += dx * 0.5;
+		cam_phi += dy * 0.5;
+
+		if(cam_phi < -90) cam_phi = -90;
+		if(cam_phi > 90) cam_phi = 90;
+		app_redisplay();
+	}
+}
+
+static void add_input(const char *fname)
+{
+	if(num_inputs >= max_inputs) {
+		max_inputs = max_inputs ? max_inputs * 2 : 16;
+		img_fnames = (const char**)realloc(img_fnames, max_inputs * sizeof *img_fnames);
+	}
+	img_fnames[num_inputs++] = fname;
+	img_fname = img_fnames[0];
+}
+
+// reads input images from a list file, one per line, skipping blank lines and # comments
+static bool read_input_list(const char *fname)
+{
+	FILE *fp = fopen(fname, "r");
+	if(!fp) {
+		fprintf(stderr, "failed to open input list: %s: %s\n", fname, strerror(errno));
+		return false;
+	}
+
+	char buf[512];
+	while(fgets(buf, sizeof buf, fp)) {
+		char *line = buf;
+		while(*line && isspace(*line)) line++;
+
+		char *end = line + strlen(line);
+		while(end > line && isspace(end[-1])) end--;
+		*end = 0;
+
+		if(*line && *line != '#') {
+			add_input(strdup(line));
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+// index of a name in a null terminated list of names, or -1
+static int find_name(const char **names, const char *name)
+{
+	for(int i=0; names[i]; i++) {
+		if(strcmp(names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// true for patterns with exactly one %d conversion (with an optional width), and no other
+static bool valid_frame_pattern(const char *pattern)
+{
+	int count = 0;
+	while((pattern = strchr(pattern, '%'))) {
+		pattern++;
+		if(*pattern == '%') {
+			pattern++;
+			continue;
+		}
+		while(isdigit(*pattern)) pattern++;
+		if(*pattern != 'd') {
+			return false;
+		}
+		count++;
+	}
+	return count == 1;
+}
+
+/* adds the frames of a sequence as inputs, from first to last. Without a
+ * first frame, the sequence starts at 0 or 1, and without a last frame it
+ * ends before the first missing frame.
+ */
+static bool add_sequence(const char *pattern, int first, int last)
+{
+	char fname[512];
+	if(first < 0) {
+		snprintf(fname, sizeof fname, pattern, 0);
+		first = access(fname, F_OK) == 0 ? 0 : 1;
+	}
+
+	for(int i=first; last < 0 || i <= last; i++) {
+		if(snprintf(fname, sizeof fname, pattern, i) >= (int)sizeof fname) {
+			fprintf(stderr, "frame filename too long: %s\n", pattern);
+			return false;
+		}
+		if(last < 0 && access(fname, F_OK) != 0) {
+			break;
+		}
+		add_input(strdup(fname));
+	}
+
+	if(!num_inputs) {
+		snprintf(fname, sizeof fname, pattern, first);
+		fprintf(stderr, "no frames found, first frame: %s\n", fname);
+		return false;
+	}
+	printf("sequence: %d frames (%d to %d)\n", num_inputs, first, first + num_inputs - 1);
+	return true;
+}
+
+static bool parse_args(int argc, char **argv)
+{
+	default_conv_options(&conv_opt);
+
+	for(int i=1; i<argc; i++) {
+		if(strcmp(argv[i], "--cpu") == 0) {
+			// handled by app_headless before app_batch gets called
+
+		} else if(strcmp(argv[i], "-j") == 0) {
+			if(!argv[++i] || (num_threads = atoi(argv[i])) <= 0) {
+				fprintf(stderr, "-j must be followed by the number of threads\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--yaw") == 0) {
+			char *endp;
+			if(!argv[++i] || (conv_opt.yaw = strtod(argv[i], &endp), endp == argv[i])) {
+				fprintf(stderr, "--yaw must be followed by an angle in degrees\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--filter") == 0) {
+			if(!argv[++i]) {
+				fprintf(stderr, "--filter must be followed by a filter name\n");
+				return false;
+			}
+			int j;
+			for(j=0; j<NUM_FILTERS; j++) {
+				if(strcmp(argv[i], filter_name[j]) == 0) {
+					conv_opt.filter = j;
+					break;
+				}
+			}
+			if(j >= NUM_FILTERS) {
+				fprintf(stderr, "unknown filter: %s\n", argv[i]);
+				return false;
+			}
+			filter_set = true;
+
+		} else if(strcmp(argv[i], "--face-size") == 0) {
+			if(!argv[++i] || (face_size = atoi(argv[i])) <= 0) {
+				fprintf(stderr, "--face-size must be followed by the cube face size in pixels\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--samples") == 0) {
+			if(!argv[++i] || (conv_opt.samples = atoi(argv[i])) <= 0 || conv_opt.samples > MAX_SAMPLES) {
+				fprintf(stderr, "--samples must be followed by the number of samples per texel (1-%d)\n", MAX_SAMPLES);
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--to-equirect") == 0) {
+			to_equirect = true;
+
+		} else if(strcmp(argv[i], "--float") == 0) {
+			load_flags |= LOAD_FLOAT;
+
+		} else if(strcmp(argv[i], "--half") == 0) {
+			load_flags |= LOAD_HALF;
+
+		} else if(strcmp(argv[i], "--format") == 0) {
+			if(!argv[++i] || strlen(argv[i]) >= sizeof out_suffix - 1) {
+				fprintf(stderr, "--format must be followed by an output file suffix (png, exr, ktx, ...)\n");
+				return false;
+			}
+			sprintf(out_suffix, "%s%s", argv[i][0] == '.' ? "" : ".", argv[i]);
+
+		} else if(strcmp(argv[i], "--stream") == 0) {
+			stream_mode = true;
+
+		} else if(strcmp(argv[i], "--mem-limit") == 0) {
+			if(!argv[++i] || (mem_limit_mb = atoi(argv[i])) <= 0) {
+				fprintf(stderr, "--mem-limit must be followed by the memory limit in megabytes\n");
+				return false;
+			}
+			stream_mode = true;
+
+		} else if(strcmp(argv[i], "--layout") == 0) {
+			if(!argv[++i] || (layout = find_layout(argv[i])) == -1) {
+				fprintf(stderr, "--layout must be followed by one of: cross, strip, 3x2, separate\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--queue-depth") == 0) {
+			int n = argv[++i] ? sscanf(argv[i], "%d,%d", queue_depth, queue_depth + 1) : 0;
+			if(n == 1) queue_depth[1] = queue_depth[0];
+			if(n < 1 || queue_depth[0] <= 0 || queue_depth[1] <= 0) {
+				fprintf(stderr, "--queue-depth must be followed by the number of images waiting for conversion, and optionally for saving (n[,m])\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--list") == 0) {
+			if(!argv[++i]) {
+				fprintf(stderr, "--list must be followed by a file with one input image per line\n");
+				return false;
+			}
+			if(!read_input_list(argv[i])) {
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--output") == 0 || strcmp(argv[i], "-o") == 0) {
+			if(!argv[++i]) {
+				fprintf(stderr, "%s must be followed by an output filename template\n", argv[i - 1]);
+				return false;
+			}
+			out_template = argv[i];
+
+		} else if(strcmp(argv[i], "--watch") == 0) {
+			if(!argv[++i]) {
+				fprintf(stderr, "--watch must be followed by the directory to watch for new images\n");
+				return false;
+			}
+			watch_path = argv[i];
+
+		} else if(strcmp(argv[i], "--serve") == 0) {
+			if(!argv[++i]) {
+				fprintf(stderr, "--serve must be followed by the path of the socket to listen on\n");
+				return false;
+			}
+			serve_path = argv[i];
+
+		} else if(strcmp(argv[i], "--serve-root") == 0) {
+			if(!argv[++i]) {
+				fprintf(stderr, "--serve-root must be followed by the directory request paths are relative to\n");
+				return false;
+			}
+			serve_root = argv[i];
+
+		} else if(strcmp(argv[i], "--max-upload") == 0) {
+			if(!argv[++i] || (max_upload_mb = atoi(argv[i])) <= 0) {
+				fprintf(stderr, "--max-upload must be followed by the maximum size of uploaded images in megabytes\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--max-face-size") == 0) {
+			if(!argv[++i] || (max_face_size = atoi(argv[i])) <= 0) {
+				fprintf(stderr, "--max-face-size must be followed by the largest face size requests can ask for\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--remap-cache-size") == 0) {
+			if(!argv[++i] || (remap_cache_mb = atoi(argv[i])) < 0) {
+				fprintf(stderr, "--remap-cache-size must be followed by the size of the remap table cache in megabytes\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--ggx") == 0) {
+			if(argv[++i] && strcmp(argv[i], "all") == 0) {
+				ggx_levels = -1;
+			} else if(!argv[i] || (ggx_levels = atoi(argv[i])) < 2) {
+				fprintf(stderr, "--ggx must be followed by the number of mip levels (2 or more), or \"all\"\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--ggx-samples") == 0) {
+			if(!argv[++i] || (ggx_samples = atoi(argv[i])) <= 0) {
+				fprintf(stderr, "--ggx-samples must be followed by the number of samples per texel\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--compress") == 0) {
+			if(!argv[++i] || (comp_format = find_name(comp_format_name, argv[i])) == -1) {
+				fprintf(stderr, "--compress must be followed by one of: none, bc1, bc7, bc6h\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--compress-quality") == 0) {
+			if(!argv[++i] || (comp_quality = find_name(comp_quality_name, argv[i])) == -1) {
+				fprintf(stderr, "--compress-quality must be followed by one of: fast, normal, best\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--seam-fix") == 0) {
+			if(!argv[++i] || (seam_width = atoi(argv[i])) < 0) {
+				fprintf(stderr, "--seam-fix must be followed by the width of the blended band in texels (1 only fixes the edge texels)\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--sh") == 0) {
+			if(!argv[++i] || ((sh_order = atoi(argv[i])) != 2 && sh_order != 3)) {
+				fprintf(stderr, "--sh must be followed by the spherical harmonics order (2 or 3)\n");
+				return false;
+			}
+
+		} else if(strcmp(argv[i], "--sh-format") == 0) {
+			if(!argv[++i] || (strcmp(argv[i], "json") != 0 && strcmp(argv[i], "bin") != 0)) {
+				fprintf(stderr, "--sh-format must be followed by json or bin\n");
+				return false;
+			}
+			sh_binary = strcmp(argv[i], "bin") == 0;
+
+		} else if(strcmp(argv[i], "--dirty") == 0) {
+			DirtyRect rect;
+			if(!argv[++i] || sscanf(argv[i], "%d,%d,%d,%d", &rect.x, &rect.y, &rect.width,
+						&rect.height) != 4 || rect.width <= 0 || rect.height <= 0) {
+				fprintf(stderr, "--dirty must be followed by the modified rectangle of the panorama (x,y,width,height)\n");
+				return false;
+			}
+			dirty_rects.push_back(rect);
+
+		} else if(strcmp(argv[i], "--diff") == 0) {
+			if(!argv[++i]) {
+				fprintf(stderr, "--diff must be followed by the previous version of the panorama\n");
+				return false;
+			}
+			diff_fname = argv[i];
+
+		} else if(strcmp(argv[i], "--sequence") == 0) {
+			if(!argv[++i] || !valid_frame_pattern(argv[i])) {
+				fprintf(stderr, "--sequence must be followed by a filename pattern with a %%d for the frame number (e.g. frame%%04d.png)\n");
+				return false;
+			}
+			seq_pattern = argv[i];
+
+		} else if(strcmp(argv[i], "--frames") == 0) {
+			int n = argv[++i] ? sscanf(argv[i], "%d-%d", &seq_first, &seq_last) : 0;
+			if(n < 1 || seq_first < 0 || (n == 2 && seq_last < seq_first)) {
+				fprintf(stderr, "--frames must be followed by the first frame number, and optionally the last (n[-m])\n");
+				return false;
+			}
+			if(n == 1) seq_last = -1;
+
+		} else if(strcmp(argv[i], "--no-remap") == 0) {
+			no_remap = true;
+
+		} else if(strcmp(argv[i], "--bench") == 0) {
+			bench_mode = true;
+
+		} else if(strcmp(argv[i], "--remap") == 0) {
+			use_remap = true;
+
+		} else if(strcmp(argv[i], "--remap-cache") == 0) {
+			if(!argv[++i]) {
+				fprintf(stderr, "--remap-cache must be followed by a directory\n");
+				return false;
+			}
+			set_remap_cache_dir(argv[i]);
+			use_remap = true;
+
+		} else if(argv[i][0] == '-') {
+			fprintf(stderr, "invalid option: %s\n", argv[i]);
+			return false;
+		} else {
+			add_input(argv[i]);
+		}
+	}
+
+	if(seq_pattern) {
+		if(num_inputs) {
+			fprintf(stderr, "input images can't be passed with --sequence\n");
+			return false;
+		}
+		if(!add_sequence(seq_pattern, seq_first, seq_last)) {
+			return false;
+		}
+		// the remap table is computed once and reused by every frame
+		use_remap = true;
+	}
+	if(watch_path) {
+		// and by every image of the same size arriving in the watched directory
+		use_remap = true;
+	}
+	if(no_remap) {
+		use_remap = false;
+	}
+
+	if(layout != LAYOUT_SEPARATE && cubefile_type(out_suffix)) {
+		printf("%s files hold separate cubemap faces, ignoring the %s layout\n",
+				cubefile_name[cubefile_type(out_suffix)], layout_name[layout]);
+	}
+
+	out_settings.face_size = face_size;
+	out_settings.layout = layout;
+	strcpy(out_settings.suffix, out_suffix);
+	out_settings.tmpl = out_template;
+	out_settings.mip_levels = ggx_levels;
+	out_settings.sh_order = sh_order;
+	out_settings.sh_binary = sh_binary;
+	out_settings.compress = comp_format;
+	out_settings.comp_quality = comp_quality;
+	out_settings.seam_width = seam_width;
 	return true;
 }
@@ -21,6 +21,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 bool app_init(int argc, char **argv);
 void app_cleanup();
 
+// headless conversion modes, which don't need a window or OpenGL
+bool app_headless(int argc, char **argv);
+int app_batch(int argc, char **argv);
+
 void app_draw();
 
 void app_reshape(int x, int y);
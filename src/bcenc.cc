@@ -0,0 +1,733 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BCENC_SSE
+#endif
+#include "bcenc.h"
+#include "convert.h"
+#include "threadpool.h"
+
+const char *comp_format_name[] = {"none", "bc1", "bc7", "bc6h", 0};
+const char *comp_quality_name[] = {"fast", "normal", "best", 0};
+
+/* texels of a block, structure of arrays: 0-255 RGBA for BC1 and BC7, and
+ * for BC6H, the bit patterns of the RGB half floats, which is the space BC6H
+ * interpolates in
+ */
+struct Block {
+	float ch[4][16];
+};
+
+struct CompRow {
+	int img, y;
+};
+
+struct CompJob {
+	const Image *imgs;
+	BlockImage *res;
+	int format, quality;
+	std::vector<CompRow> rows;
+};
+
+// BC6H and BC7 4bit index weights, out of 64
+static const int weights4[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+static const float index_weights4[16] = {
+	0 / 64.0f, 4 / 64.0f, 9 / 64.0f, 13 / 64.0f, 17 / 64.0f, 21 / 64.0f, 26 / 64.0f, 30 / 64.0f,
+	34 / 64.0f, 38 / 64.0f, 43 / 64.0f, 47 / 64.0f, 51 / 64.0f, 55 / 64.0f, 60 / 64.0f, 64 / 64.0f
+};
+static const float bc1_weights[4] = {0.0f, 1.0f / 3.0f, 2.0f / 3.0f, 1.0f};
+
+// BC1 index of each palette entry, the palette being ordered from c0 to c1
+static const int bc1_code[4] = {0, 2, 3, 1};
+
+int comp_block_size(int format)
+{
+	return format == COMP_BC1 ? 8 : 16;
+}
+
+static inline float clampf(float x, float lo, float hi)
+{
+	return x < lo ? lo : (x > hi ? hi : x);
+}
+
+/* picks the closest palette entry for each texel, over the first num_ch
+ * channels, and returns the total squared error
+ */
+static float fit_indices(const Block *blk, const float (*pal)[4], int num_pal, int num_ch,
+		unsigned char *idx)
+{
+#ifdef BCENC_SSE
+	__m128 total = _mm_setzero_ps();
+	for(int i=0; i<16; i+=4) {
+		__m128 col[4];
+		for(int k=0; k<num_ch; k++) {
+			col[k] = _mm_loadu_ps(blk->ch[k] + i);
+		}
+
+		__m128 best = _mm_set1_ps(FLT_MAX);
+		__m128i best_idx = _mm_setzero_si128();
+		for(int j=0; j<num_pal; j++) {
+			__m128 dist = _mm_setzero_ps();
+			for(int k=0; k<num_ch; k++) {
+				__m128 d = _mm_sub_ps(col[k], _mm_set1_ps(pal[j][k]));
+				dist = _mm_add_ps(dist, _mm_mul_ps(d, d));
+			}
+			__m128i closer = _mm_castps_si128(_mm_cmplt_ps(dist, best));
+			best = _mm_min_ps(dist, best);
+			best_idx = _mm_or_si128(_mm_andnot_si128(closer, best_idx),
+					_mm_and_si128(closer, _mm_set1_epi32(j)));
+		}
+		total = _mm_add_ps(total, best);
+
+		int res[4];
+		_mm_storeu_si128((__m128i*)res, best_idx);
+		for(int j=0; j<4; j++) {
+			idx[i + j] = res[j];
+		}
+	}
+	float sum[4];
+	_mm_storeu_ps(sum, total);
+	return sum[0] + sum[1] + sum[2] + sum[3];
+#else
+	float total = 0.0f;
+	for(int i=0; i<16; i++) {
+		float best = FLT_MAX;
+		for(int j=0; j<num_pal; j++) {
+			float dist = 0.0f;
+			for(int k=0; k<num_ch; k++) {
+				float d = blk->ch[k][i] - pal[j][k];
+				dist += d * d;
+			}
+			if(dist < best) {
+				best = dist;
+				idx[i] = j;
+			}
+		}
+		total += best;
+	}
+	return total;
+#endif
+}
+
+// mean and principal axis (unit length, or zero for flat blocks) of the texels
+static void principal_axis(const Block *blk, int num_ch, float *mean, float *axis)
+{
+	for(int k=0; k<num_ch; k++) {
+		mean[k] = 0.0f;
+		for(int i=0; i<16; i++) {
+			mean[k] += blk->ch[k][i];
+		}
+		mean[k] /= 16.0f;
+	}
+
+	float cov[4][4] = {{0}};
+	for(int i=0; i<16; i++) {
+		float d[4];
+		for(int k=0; k<num_ch; k++) {
+			d[k] = blk->ch[k][i] - mean[k];
+		}
+		for(int j=0; j<num_ch; j++) {
+			for(int k=0; k<num_ch; k++) {
+				cov[j][k] += d[j] * d[k];
+			}
+		}
+	}
+
+	// power iteration, starting from the row of the channel with the largest variance
+	int start = 0;
+	for(int k=1; k<num_ch; k++) {
+		if(cov[k][k] > cov[start][start]) start = k;
+	}
+	float v[4];
+	memcpy(v, cov[start], sizeof v);
+
+	for(int iter=0; iter<8; iter++) {
+		float w[4], len = 0.0f;
+		for(int j=0; j<num_ch; j++) {
+			w[j] = 0.0f;
+			for(int k=0; k<num_ch; k++) {
+				w[j] += cov[j][k] * v[k];
+			}
+			len += w[j] * w[j];
+		}
+		if(len < 1e-12f) break;
+
+		len = 1.0f / sqrt(len);
+		for(int k=0; k<num_ch; k++) {
+			v[k] = w[k] * len;
+		}
+	}
+
+	float len = 0.0f;
+	for(int k=0; k<num_ch; k++) {
+		len += v[k] * v[k];
+	}
+	len = len > 1e-12f ? 1.0f / sqrt(len) : 0.0f;
+	for(int k=0; k<num_ch; k++) {
+		axis[k] = v[k] * len;
+	}
+}
+
+// endpoints at the extremes of the texels projected on the axis
+static void axis_endpoints(const Block *blk, int num_ch, const float *mean, const float *axis,
+		float *e0, float *e1)
+{
+	float tmin = FLT_MAX, tmax = -FLT_MAX;
+	for(int i=0; i<16; i++) {
+		float t = 0.0f;
+		for(int k=0; k<num_ch; k++) {
+			t += (blk->ch[k][i] - mean[k]) * axis[k];
+		}
+		if(t < tmin) tmin = t;
+		if(t > tmax) tmax = t;
+	}
+	for(int k=0; k<num_ch; k++) {
+		e0[k] = mean[k] + axis[k] * tmin;
+		e1[k] = mean[k] + axis[k] * tmax;
+	}
+}
+
+/* least squares endpoints for the chosen indices, given the interpolation
+ * weight of each index. Returns false if all texels use the same weight.
+ */
+static bool refine_endpoints(const Block *blk, int num_ch, const unsigned char *idx,
+		const float *weights, float *e0, float *e1)
+{
+	float a00 = 0.0f, a01 = 0.0f, a11 = 0.0f;
+	float b0[4] = {0}, b1[4] = {0};
+
+	for(int i=0; i<16; i++) {
+		float w = weights[idx[i]];
+		float iw = 1.0f - w;
+		a00 += iw * iw;
+		a01 += iw * w;
+		a11 += w * w;
+		for(int k=0; k<num_ch; k++) {
+			b0[k] += iw * blk->ch[k][i];
+			b1[k] += w * blk->ch[k][i];
+		}
+	}
+
+	float det = a00 * a11 - a01 * a01;
+	if(fabs(det) < 1e-6f) {
+		return false;
+	}
+	det = 1.0f / det;
+	for(int k=0; k<num_ch; k++) {
+		e0[k] = (a11 * b0[k] - a01 * b1[k]) * det;
+		e1[k] = (a00 * b1[k] - a01 * b0[k]) * det;
+	}
+	return true;
+}
+
+static inline void put_bits(unsigned char *out, int *pos, unsigned int val, int count)
+{
+	for(int i=0; i<count; i++) {
+		if(val >> i & 1) {
+			out[*pos >> 3] |= 1 << (*pos & 7);
+		}
+		(*pos)++;
+	}
+}
+
+static int refine_passes(int quality)
+{
+	static const int passes[] = {0, 1, 4};
+	return passes[quality];
+}
+
+
+// ---- BC1 ----
+
+struct Bc1Ends {
+	int c[2][3];	// 5:6:5 endpoints
+};
+
+static void bc1_palette(const Bc1Ends *ends, float (*pal)[4])
+{
+	float col[2][3];
+	for(int i=0; i<2; i++) {
+		col[i][0] = (ends->c[i][0] << 3) | (ends->c[i][0] >> 2);
+		col[i][1] = (ends->c[i][1] << 2) | (ends->c[i][1] >> 4);
+		col[i][2] = (ends->c[i][2] << 3) | (ends->c[i][2] >> 2);
+	}
+	for(int i=0; i<4; i++) {
+		for(int k=0; k<3; k++) {
+			pal[i][k] = col[0][k] + (col[1][k] - col[0][k]) * bc1_weights[i];
+		}
+	}
+}
+
+static void bc1_quantize(const float *e0, const float *e1, Bc1Ends *ends)
+{
+	static const int maxval[3] = {31, 63, 31};
+	for(int k=0; k<3; k++) {
+		ends->c[0][k] = (int)(clampf(e0[k], 0.0f, 255.0f) * maxval[k] / 255.0f + 0.5f);
+		ends->c[1][k] = (int)(clampf(e1[k], 0.0f, 255.0f) * maxval[k] / 255.0f + 0.5f);
+	}
+}
+
+static float bc1_eval(const Block *blk, const Bc1Ends *ends, unsigned char *idx)
+{
+	float pal[4][4];
+	bc1_palette(ends, pal);
+	return fit_indices(blk, pal, 4, 3, idx);
+}
+
+static void encode_bc1(const Block *blk, int quality, unsigned char *out)
+{
+	float mean[4], axis[4], e0[4], e1[4];
+	principal_axis(blk, 3, mean, axis);
+	axis_endpoints(blk, 3, mean, axis, e0, e1);
+
+	Bc1Ends ends, best;
+	unsigned char idx[16], best_idx[16];
+	float best_err = FLT_MAX;
+
+	int passes = refine_passes(quality);
+	for(int i=0; i<=passes; i++) {
+		bc1_quantize(e0, e1, &ends);
+		float err = bc1_eval(blk, &ends, idx);
+		if(err < best_err) {
+			best_err = err;
+			best = ends;
+			memcpy(best_idx, idx, sizeof idx);
+		}
+		if(i == passes || !refine_endpoints(blk, 3, idx, bc1_weights, e0, e1)) break;
+	}
+
+	if(quality == COMP_BEST) {
+		// nudge each endpoint channel by one step while it helps
+		static const int maxval[3] = {31, 63, 31};
+		bool improved = true;
+		for(int pass=0; pass<4 && improved; pass++) {
+			improved = false;
+			for(int j=0; j<6; j++) {
+				for(int step=-1; step<=1; step+=2) {
+					ends = best;
+					int *c = &ends.c[j / 3][j % 3];
+					*c += step;
+					if(*c < 0 || *c > maxval[j % 3]) continue;
+
+					float err = bc1_eval(blk, &ends, idx);
+					if(err < best_err) {
+						best_err = err;
+						best = ends;
+						memcpy(best_idx, idx, sizeof idx);
+						improved = true;
+					}
+				}
+			}
+		}
+	}
+
+	unsigned int c0 = (best.c[0][0] << 11) | (best.c[0][1] << 5) | best.c[0][2];
+	unsigned int c1 = (best.c[1][0] << 11) | (best.c[1][1] << 5) | best.c[1][2];
+
+	// four color blocks need c0 > c1, equal endpoints only use index 0
+	if(c0 < c1) {
+		unsigned int tmp = c0;
+		c0 = c1;
+		c1 = tmp;
+		for(int i=0; i<16; i++) {
+			best_idx[i] = 3 - best_idx[i];
+		}
+	} else if(c0 == c1) {
+		memset(best_idx, 0, sizeof best_idx);
+	}
+
+	unsigned int bits = 0;
+	for(int i=0; i<16; i++) {
+		bits |= bc1_code[best_idx[i]] << (i * 2);
+	}
+	out[0] = c0;
+	out[1] = c0 >> 8;
+	out[2] = c1;
+	out[3] = c1 >> 8;
+	for(int i=0; i<4; i++) {
+		out[4 + i] = bits >> (i * 8);
+	}
+}
+
+
+// ---- BC7 (mode 6) ----
+
+struct Bc7Ends {
+	int c[2][4];	// 7bit RGBA endpoints
+	int p[2];		// p-bits, the low bit of the 8bit endpoints
+};
+
+static void bc7_palette(const Bc7Ends *ends, float (*pal)[4])
+{
+	int col[2][4];
+	for(int i=0; i<2; i++) {
+		for(int k=0; k<4; k++) {
+			col[i][k] = (ends->c[i][k] << 1) | ends->p[i];
+		}
+	}
+	for(int i=0; i<16; i++) {
+		for(int k=0; k<4; k++) {
+			pal[i][k] = ((64 - weights4[i]) * col[0][k] + weights4[i] * col[1][k] + 32) >> 6;
+		}
+	}
+}
+
+static void bc7_quantize_end(const float *e, int p, int *c)
+{
+	for(int k=0; k<4; k++) {
+		int q = (int)((clampf(e[k], 0.0f, 255.0f) - p) * 0.5f + 0.5f);
+		c[k] = q < 0 ? 0 : (q > 127 ? 127 : q);
+	}
+}
+
+// picks the p-bit which quantizes the endpoint best
+static int bc7_best_pbit(const float *e)
+{
+	float err[2] = {0, 0};
+	for(int p=0; p<2; p++) {
+		int c[4];
+		bc7_quantize_end(e, p, c);
+		for(int k=0; k<4; k++) {
+			float d = ((c[k] << 1) | p) - clampf(e[k], 0.0f, 255.0f);
+			err[p] += d * d;
+		}
+	}
+	return err[1] <= err[0] ? 1 : 0;
+}
+
+static float bc7_eval(const Block *blk, const Bc7Ends *ends, unsigned char *idx)
+{
+	float pal[16][4];
+	bc7_palette(ends, pal);
+	return fit_indices(blk, pal, 16, 4, idx);
+}
+
+static void encode_bc7(const Block *blk, int quality, unsigned char *out)
+{
+	float mean[4], axis[4], e0[4], e1[4];
+	principal_axis(blk, 4, mean, axis);
+	axis_endpoints(blk, 4, mean, axis, e0, e1);
+
+	Bc7Ends ends, best;
+	unsigned char idx[16], best_idx[16];
+	float best_err = FLT_MAX;
+
+	int passes = refine_passes(quality);
+	for(int i=0; i<=passes; i++) {
+		// the best quality tries every p-bit combination
+		int first = quality == COMP_BEST ? 0 : -1;
+		for(int pb=first; pb<(first < 0 ? 0 : 4); pb++) {
+			ends.p[0] = pb < 0 ? bc7_best_pbit(e0) : pb & 1;
+			ends.p[1] = pb < 0 ? bc7_best_pbit(e1) : pb >> 1;
+			bc7_quantize_end(e0, ends.p[0], ends.c[0]);
+			bc7_quantize_end(e1, ends.p[1], ends.c[1]);
+
+			float err = bc7_eval(blk, &ends, idx);
+			if(err < best_err) {
+				best_err = err;
+				best = ends;
+				memcpy(best_idx, idx, sizeof idx);
+			}
+		}
+		if(i == passes || !refine_endpoints(blk, 4, best_idx, index_weights4, e0, e1)) break;
+	}
+
+	if(quality == COMP_BEST) {
+		// nudge each RGB endpoint channel by one step while it helps
+		bool improved = true;
+		for(int pass=0; pass<2 && improved; pass++) {
+			improved = false;
+			for(int j=0; j<6; j++) {
+				for(int step=-1; step<=1; step+=2) {
+					ends = best;
+					int *c = &ends.c[j / 3][j % 3];
+					*c += step;
+					if(*c < 0 || *c > 127) continue;
+
+					float err = bc7_eval(blk, &ends, idx);
+					if(err < best_err) {
+						best_err = err;
+						best = ends;
+						memcpy(best_idx, idx, sizeof idx);
+						improved = true;
+					}
+				}
+			}
+		}
+	}
+
+	// the high bit of the first index is implied to be 0
+	if(best_idx[0] & 8) {
+		Bc7Ends tmp = best;
+		memcpy(best.c[0], tmp.c[1], sizeof best.c[0]);
+		memcpy(best.c[1], tmp.c[0], sizeof best.c[1]);
+		best.p[0] = tmp.p[1];
+		best.p[1] = tmp.p[0];
+		for(int i=0; i<16; i++) {
+			best_idx[i] = 15 - best_idx[i];
+		}
+	}
+
+	memset(out, 0, 16);
+	int pos = 0;
+	put_bits(out, &pos, 1 << 6, 7);		// mode 6
+	for(int k=0; k<4; k++) {
+		put_bits(out, &pos, best.c[0][k], 7);
+		put_bits(out, &pos, best.c[1][k], 7);
+	}
+	put_bits(out, &pos, best.p[0], 1);
+	put_bits(out, &pos, best.p[1], 1);
+	put_bits(out, &pos, best_idx[0], 3);
+	for(int i=1; i<16; i++) {
+		put_bits(out, &pos, best_idx[i], 4);
+	}
+}
+
+
+// ---- BC6H (mode 11, unsigned) ----
+
+#define HALF_MAX_BITS	0x7bff
+
+// 10bit endpoint to the 16bit value BC6H interpolates
+static inline int bc6h_unquantize(int c)
+{
+	if(c == 0) return 0;
+	if(c == 1023) return 0xffff;
+	return ((c << 16) + 0x8000) >> 10;
+}
+
+static int bc6h_quantize(float h)
+{
+	// unquantized values are scaled by 64/31 from half bit patterns
+	float u = clampf(h, 0.0f, HALF_MAX_BITS) * (64.0f / 31.0f);
+	int c = (int)(u * (1024.0f / 65536.0f));
+	if(c > 1023) c = 1023;
+
+	int best = c;
+	float best_err = FLT_MAX;
+	for(int i=c-1; i<=c+1; i++) {
+		if(i < 0 || i > 1023) continue;
+		float err = fabs(bc6h_unquantize(i) - u);
+		if(err < best_err) {
+			best_err = err;
+			best = i;
+		}
+	}
+	return best;
+}
+
+struct Bc6hEnds {
+	int c[2][3];	// 10bit RGB endpoints
+};
+
+static void bc6h_palette(const Bc6hEnds *ends, float (*pal)[4])
+{
+	int col[2][3];
+	for(int i=0; i<2; i++) {
+		for(int k=0; k<3; k++) {
+			col[i][k] = bc6h_unquantize(ends->c[i][k]);
+		}
+	}
+	for(int i=0; i<16; i++) {
+		for(int k=0; k<3; k++) {
+			int val = ((64 - weights4[i]) * col[0][k] + weights4[i] * col[1][k] + 32) >> 6;
+			pal[i][k] = (val * 31) >> 6;	// back to half bit patterns
+		}
+	}
+}
+
+static void encode_bc6h(const Block *blk, int quality, unsigned char *out)
+{
+	float mean[4], axis[4], e0[4], e1[4];
+	principal_axis(blk, 3, mean, axis);
+	axis_endpoints(blk, 3, mean, axis, e0, e1);
+
+	Bc6hEnds ends, best;
+	unsigned char idx[16], best_idx[16];
+	float best_err = FLT_MAX;
+
+	int passes = refine_passes(quality);
+	for(int i=0; i<=passes; i++) {
+		for(int k=0; k<3; k++) {
+			ends.c[0][k] = bc6h_quantize(e0[k]);
+			ends.c[1][k] = bc6h_quantize(e1[k]);
+		}
+		float pal[16][4];
+		bc6h_palette(&ends, pal);
+		float err = fit_indices(blk, pal, 16, 3, idx);
+		if(err < best_err) {
+			best_err = err;
+			best = ends;
+			memcpy(best_idx, idx, sizeof idx);
+		}
+		if(i == passes || !refine_endpoints(blk, 3, idx, index_weights4, e0, e1)) break;
+	}
+
+	// the high bit of the first index is implied to be 0
+	if(best_idx[0] & 8) {
+		Bc6hEnds tmp = best;
+		memcpy(best.c[0], tmp.c[1], sizeof best.c[0]);
+		memcpy(best.c[1], tmp.c[0], sizeof best.c[1]);
+		for(int i=0; i<16; i++) {
+			best_idx[i] = 15 - best_idx[i];
+		}
+	}
+
+	memset(out, 0, 16);
+	int pos = 0;
+	put_bits(out, &pos, 0x03, 5);		// mode 11
+	for(int i=0; i<2; i++) {
+		for(int k=0; k<3; k++) {
+			put_bits(out, &pos, best.c[i][k], 10);
+		}
+	}
+	put_bits(out, &pos, best_idx[0], 3);
+	for(int i=1; i<16; i++) {
+		put_bits(out, &pos, best_idx[i], 4);
+	}
+}
+
+
+template <typename T>
+static void load_block(const Image *img, int x, int y, bool hdr, Block *blk)
+{
+	// 8bit texels are in [0, 255], and taken as [0, 1] for HDR
+	const bool ldr_texels = sizeof(T) == 1;
+
+	for(int i=0; i<4; i++) {
+		int sy = y + i < img->height ? y + i : img->height - 1;
+		const T *row = (const T*)image_row(img, sy);
+
+		for(int j=0; j<4; j++) {
+			int sx = x + j < img->width ? x + j : img->width - 1;
+			const T *texel = row + sx * 3;
+			int dest = i * 4 + j;
+
+			for(int k=0; k<3; k++) {
+				float val = PixelOps<T>::to_float(texel[k]);
+				if(hdr) {
+					if(ldr_texels) val /= 255.0f;
+					int h = val > 0.0f ? float_to_half(val) : 0;
+					blk->ch[k][dest] = h > HALF_MAX_BITS ? HALF_MAX_BITS : h;
+				} else {
+					blk->ch[k][dest] = clampf(ldr_texels ? val : val * 255.0f, 0.0f, 255.0f);
+				}
+			}
+			blk->ch[3][dest] = hdr ? 0.0f : 255.0f;
+		}
+	}
+}
+
+template <typename T>
+static void compress_row(const Image *img, BlockImage *bimg, int by, int format, int quality)
+{
+	int bsize = comp_block_size(format);
+	int num_blocks = (img->width + 3) / 4;
+	unsigned char *out = bimg->data + (size_t)by * num_blocks * bsize;
+
+	Block blk;
+	for(int i=0; i<num_blocks; i++) {
+		load_block<T>(img, i * 4, by * 4, format == COMP_BC6H, &blk);
+
+		switch(format) {
+		case COMP_BC1:
+			encode_bc1(&blk, quality, out);
+			break;
+		case COMP_BC7:
+			encode_bc7(&blk, quality, out);
+			break;
+		default:
+			encode_bc6h(&blk, quality, out);
+		}
+		out += bsize;
+	}
+}
+
+static void compress_row_task(int idx, int thread, void *cls)
+{
+	CompJob *job = (CompJob*)cls;
+	const CompRow *row = &job->rows[idx];
+	const Image *img = job->imgs + row->img;
+	BlockImage *bimg = job->res + row->img;
+
+	switch(img->fmt) {
+	case PIXFMT_RGB8:
+		compress_row<unsigned char>(img, bimg, row->y, job->format, job->quality);
+		break;
+	case PIXFMT_RGBH:
+		compress_row<half>(img, bimg, row->y, job->format, job->quality);
+		break;
+	default:
+		compress_row<float>(img, bimg, row->y, job->format, job->quality);
+	}
+}
+
+bool compress_images(const Image *imgs, BlockImage *res, int count, int format, int quality,
+		ThreadPool *tpool)
+{
+	CompJob job;
+	job.imgs = imgs;
+	job.res = res;
+	job.format = format;
+	job.quality = quality;
+
+	for(int i=0; i<count; i++) {
+		int blocks_x = (imgs[i].width + 3) / 4;
+		int blocks_y = (imgs[i].height + 3) / 4;
+
+		res[i].format = format;
+		res[i].width = imgs[i].width;
+		res[i].height = imgs[i].height;
+		res[i].size = (size_t)blocks_x * blocks_y * comp_block_size(format);
+		if(!(res[i].data = (unsigned char*)malloc(res[i].size))) {
+			fprintf(stderr, "failed to allocate %dx%d compressed image\n", imgs[i].width, imgs[i].height);
+			for(int j=0; j<i; j++) {
+				destroy_block_image(res + j);
+			}
+			return false;
+		}
+
+		for(int j=0; j<blocks_y; j++) {
+			CompRow row = {i, j};
+			job.rows.push_back(row);
+		}
+	}
+
+	if(tpool) {
+		tpool->run(job.rows.size(), compress_row_task, &job);
+	} else {
+		for(size_t i=0; i<job.rows.size(); i++) {
+			compress_row_task(i, 0, &job);
+		}
+	}
+	return true;
+}
+
+void destroy_block_image(BlockImage *bimg)
+{
+	free(bimg->data);
+	bimg->data = 0;
+}
@@ -0,0 +1,74 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BCENC_H_
+#define BCENC_H_
+
+#include <stddef.h>
+
+struct Image;
+class ThreadPool;
+
+/* GPU block compression of the faces, into 4x4 texel blocks: BC1 (8 bytes
+ * per block) and BC7 (16 bytes) for LDR faces, and unsigned BC6H (16 bytes)
+ * for HDR faces. Floating point faces are clamped to [0, 1] for BC1 and BC7,
+ * and 8bit faces are scaled to [0, 1] for BC6H.
+ *
+ * Every block is fitted to the principal axis of its colors, and the
+ * endpoints are refined by least squares, more times for better quality. BC7
+ * blocks are all encoded in mode 6 (a single RGBA line, 4bit indices), and
+ * BC6H blocks in mode 11 (a single line with 10bit endpoints).
+ */
+enum {
+	COMP_NONE,
+	COMP_BC1,
+	COMP_BC7,
+	COMP_BC6H,
+
+	NUM_COMP_FORMATS
+};
+
+enum {
+	COMP_FAST,		// endpoints from the principal axis only
+	COMP_NORMAL,	// one least squares refinement
+	COMP_BEST,		// more refinements, and a search around the BC1 and BC7 endpoints
+
+	NUM_COMP_QUALITIES
+};
+
+extern const char *comp_format_name[];	// none, bc1, bc7, bc6h
+extern const char *comp_quality_name[];	// fast, normal, best
+
+struct BlockImage {
+	int format;
+	int width, height;		// in texels
+	unsigned char *data;	// blocks, row by row
+	size_t size;
+};
+
+// bytes per block
+int comp_block_size(int format);
+
+/* compresses count images, of any size (partial blocks at the right and bottom
+ * edges repeat the last texels). The blocks of all the images are encoded in
+ * parallel, row by row.
+ */
+bool compress_images(const Image *imgs, BlockImage *res, int count, int format, int quality,
+		ThreadPool *tpool = 0);
+void destroy_block_image(BlockImage *bimg);
+
+#endif	// BCENC_H_
@@ -0,0 +1,1121 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <limits.h>
+#include <assert.h>
+#include <mutex>
+#include <imago2.h>
+#include "convert.h"
+#include "threadpool.h"
+#include "remap.h"
+#include "sumtab.h"
+#include "sh.h"
+#include "exr.h"
+#include "rawimg.h"
+
+const char *filter_name[NUM_FILTERS] = {"bilinear", "bicubic", "lanczos3", "area"};
+
+/* separable filter weights, precomputed for FILTER_PHASES subtexel offsets.
+ * The geometry of the mapping isn't separable (every cube texel lands on an
+ * arbitrary subtexel offset), but the filter kernels are, so each lookup
+ * needs just one row and one column of weights from these tables.
+ */
+#define FILTER_PHASES	128
+#define MAX_TAPS		6
+
+/* fixed point filter weights for 8bit images. Horizontal sums keep
+ * FILTER_HFRAC_BITS fractional bits for the vertical pass, which keeps the
+ * worst case sum of the lanczos lobes well within 32 bits.
+ */
+#define FILTER_FRAC_BITS	14
+#define FILTER_HFRAC_BITS	7
+
+static const int filter_taps[NUM_FILTERS] = {2, 4, 6, 2};
+static float filter_weights[NUM_FILTERS][FILTER_PHASES + 1][MAX_TAPS];
+static int filter_weights_fx[NUM_FILTERS][FILTER_PHASES + 1][MAX_TAPS];
+static std::once_flag filter_init_flag;
+
+static void init_filters();
+
+int get_filter_taps(int filter)
+{
+	return filter_taps[filter];
+}
+
+void default_conv_options(ConvOptions *opt)
+{
+	opt->filter = FILTER_BILINEAR;
+	opt->yaw = 0.0f;
+	opt->samples = 1;
+}
+
+/* rows of the samples in each column, for up to 16 samples: n-rooks patterns
+ * without three samples on a line, searched for the largest minimum
+ * distance between samples, including the samples of neighbouring texels.
+ * 4 samples are the classic rotated grid.
+ */
+#define MAX_SAMPLE_TAB	16
+
+static const unsigned char sample_rows_2[] = {1, 0};
+static const unsigned char sample_rows_3[] = {2, 0, 1};
+static const unsigned char sample_rows_4[] = {1, 3, 0, 2};
+static const unsigned char sample_rows_5[] = {3, 2, 4, 1, 0};
+static const unsigned char sample_rows_6[] = {2, 4, 1, 5, 3, 0};
+static const unsigned char sample_rows_7[] = {4, 0, 5, 1, 3, 6, 2};
+static const unsigned char sample_rows_8[] = {5, 7, 3, 1, 6, 4, 0, 2};
+static const unsigned char sample_rows_9[] = {8, 4, 1, 6, 3, 7, 0, 5, 2};
+static const unsigned char sample_rows_10[] = {7, 0, 3, 8, 1, 4, 6, 9, 2, 5};
+static const unsigned char sample_rows_11[] = {6, 9, 1, 5, 8, 2, 10, 4, 7, 0, 3};
+static const unsigned char sample_rows_12[] = {6, 10, 1, 5, 8, 2, 11, 7, 4, 0, 9, 3};
+static const unsigned char sample_rows_13[] = {7, 2, 10, 5, 1, 11, 6, 9, 3, 0, 8, 4, 12};
+static const unsigned char sample_rows_14[] = {5, 10, 0, 7, 4, 12, 1, 9, 6, 13, 3, 8, 11, 2};
+static const unsigned char sample_rows_15[] = {1, 13, 9, 6, 2, 11, 7, 0, 4, 12, 8, 3, 14, 10, 5};
+static const unsigned char sample_rows_16[] = {4, 12, 0, 9, 5, 14, 2, 7, 11, 3, 15, 6, 10, 1, 13, 8};
+
+static const unsigned char *sample_rows[MAX_SAMPLE_TAB + 1] = {
+	0, 0, sample_rows_2, sample_rows_3, sample_rows_4, sample_rows_5, sample_rows_6,
+	sample_rows_7, sample_rows_8, sample_rows_9, sample_rows_10, sample_rows_11,
+	sample_rows_12, sample_rows_13, sample_rows_14, sample_rows_15, sample_rows_16
+};
+
+static int gcd(int a, int b)
+{
+	while(b) {
+		int tmp = a % b;
+		a = b;
+		b = tmp;
+	}
+	return a;
+}
+
+// squared distance between the closest samples, wrapping around the texel
+static int min_sample_dist(const int *rows, int num)
+{
+	int min_dist = INT_MAX;
+	for(int i=0; i<num; i++) {
+		for(int j=i+1; j<num; j++) {
+			int dx = j - i;
+			int dy = abs(rows[j] - rows[i]);
+			if(num - dx < dx) dx = num - dx;
+			if(num - dy < dy) dy = num - dy;
+			if(dx * dx + dy * dy < min_dist) {
+				min_dist = dx * dx + dy * dy;
+			}
+		}
+	}
+	return min_dist;
+}
+
+static bool collinear_samples(const int *rows, int num)
+{
+	for(int i=0; i<num; i++) {
+		for(int j=i+1; j<num; j++) {
+			for(int k=j+1; k<num; k++) {
+				if((j - i) * (rows[k] - rows[i]) == (rows[j] - rows[i]) * (k - i)) {
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+void calc_sample_offsets(int num, float *offs)
+{
+	if(num <= 1) {
+		offs[0] = offs[1] = 0.0f;
+		return;
+	}
+
+	int rows[MAX_SAMPLES];
+	if(num <= MAX_SAMPLE_TAB) {
+		for(int i=0; i<num; i++) {
+			rows[i] = sample_rows[num][i];
+		}
+		assert(!collinear_samples(rows, num));
+	} else {
+		/* row of sample i is (i * step) mod num, with the step coprime to num
+		 * that keeps the samples farthest apart
+		 */
+		int best_dist = -1;
+		int best_step = 1;
+		for(int step=1; step<num; step++) {
+			if(gcd(step, num) != 1) continue;
+			for(int i=0; i<num; i++) {
+				rows[i] = i * step % num;
+			}
+			int dist = min_sample_dist(rows, num);
+			if(dist > best_dist) {
+				best_dist = dist;
+				best_step = step;
+			}
+		}
+		for(int i=0; i<num; i++) {
+			rows[i] = i * best_step % num;
+		}
+	}
+
+	for(int i=0; i<num; i++) {
+		*offs++ = ((float)i + 0.5f) / (float)num - 0.5f;
+		*offs++ = ((float)rows[i] + 0.5f) / (float)num - 0.5f;
+	}
+}
+
+size_t pixel_size(int fmt)
+{
+	switch(fmt) {
+	case PIXFMT_RGB8:
+		return 3;
+	case PIXFMT_RGBH:
+		return 3 * sizeof(half);
+	default:
+		break;
+	}
+	return 3 * sizeof(float);
+}
+
+bool init_image(Image *img, int width, int height, int fmt)
+{
+	if(!(img->pixels = malloc((size_t)width * height * pixel_size(fmt)))) {
+		fprintf(stderr, "failed to allocate %dx%d image\n", width, height);
+		return false;
+	}
+	img->width = width;
+	img->height = height;
+	img->fmt = fmt;
+	img->pitch = width * pixel_size(fmt);
+	img->first_row = 0;
+	img->map = 0;
+	img->map_size = 0;
+	return true;
+}
+
+void destroy_image(Image *img)
+{
+	if(img->map) {
+		unmap_raw_image(img);
+	} else {
+		free(img->pixels);
+	}
+	img->pixels = 0;
+	img->width = img->height = 0;
+}
+
+void image_view(Image *view, const Image *img, int x, int y, int w, int h)
+{
+	view->width = w;
+	view->height = h;
+	view->fmt = img->fmt;
+	view->pixels = (char*)image_row(img, y) + x * pixel_size(img->fmt);
+	view->pitch = img->pitch;
+	view->first_row = 0;
+	view->map = 0;
+	view->map_size = 0;
+}
+
+bool load_image(Image *img, const char *fname, unsigned int flags)
+{
+	// uncompressed files which need no conversion are used in place
+	if(!(flags & (LOAD_FLOAT | LOAD_HALF)) && map_raw_image(img, fname)) {
+		return true;
+	}
+
+	img_pixmap pixmap;
+	img_init(&pixmap);
+	if(img_load(&pixmap, fname) == -1) {
+		fprintf(stderr, "failed to load image: %s\n", fname);
+		img_destroy(&pixmap);
+		return false;
+	}
+
+	int fmt = PIXFMT_RGB8;
+	if((flags & LOAD_FLOAT) || img_is_float(&pixmap)) {
+		fmt = (flags & LOAD_HALF) ? PIXFMT_RGBH : PIXFMT_RGBF;
+	}
+	if(img_convert(&pixmap, fmt == PIXFMT_RGB8 ? IMG_FMT_RGB24 : IMG_FMT_RGBF) == -1) {
+		fprintf(stderr, "failed to convert image to RGB: %s\n", fname);
+		img_destroy(&pixmap);
+		return false;
+	}
+
+	img->width = pixmap.width;
+	img->height = pixmap.height;
+	img->fmt = fmt;
+	img->pitch = pixmap.width * pixel_size(fmt);
+	img->first_row = 0;
+	img->map = 0;
+	img->map_size = 0;
+
+	if(fmt == PIXFMT_RGBH) {
+		size_t count = (size_t)pixmap.width * pixmap.height * 3;
+		if(!(img->pixels = malloc(count * sizeof(half)))) {
+			fprintf(stderr, "failed to allocate %dx%d image\n", pixmap.width, pixmap.height);
+			img_destroy(&pixmap);
+			return false;
+		}
+		float_to_half_array((half*)img->pixels, (float*)pixmap.pixels, count);
+		img_destroy(&pixmap);
+		return true;
+	}
+
+	// steal the pixel buffer, imago allocates it with malloc too
+	img->pixels = pixmap.pixels;
+	pixmap.pixels = 0;
+	img_destroy(&pixmap);
+	return true;
+}
+
+bool save_image(const Image *img, const char *fname)
+{
+	const char *suffix = strrchr(fname, '.');
+	if(suffix && strcasecmp(suffix, ".exr") == 0) {
+		return save_exr(img, fname);
+	}
+
+	// imago needs contiguous top-down rows, and doesn't know about half floats
+	void *pixels = img->pixels;
+	size_t row_size = img->width * pixel_size(img->fmt);
+	if(img->fmt == PIXFMT_RGBH || img->pitch != (long)row_size) {
+		size_t count = (size_t)img->width * 3;
+		size_t out_row_size = img->fmt == PIXFMT_RGBH ? count * sizeof(float) : row_size;
+
+		if(!(pixels = malloc(out_row_size * img->height))) {
+			fprintf(stderr, "failed to allocate %dx%d image\n", img->width, img->height);
+			return false;
+		}
+		for(int i=0; i<img->height; i++) {
+			char *dest = (char*)pixels + i * out_row_size;
+			if(img->fmt == PIXFMT_RGBH) {
+				half_to_float_array((float*)dest, (half*)image_row(img, i), count);
+			} else {
+				memcpy(dest, image_row(img, i), row_size);
+			}
+		}
+	}
+
+	bool res = true;
+	img_fmt fmt = img->fmt == PIXFMT_RGB8 ? IMG_FMT_RGB24 : IMG_FMT_RGBF;
+	if(img_save_pixels(fname, pixels, img->width, img->height, fmt) == -1) {
+		fprintf(stderr, "failed to save %dx%d image: %s\n", img->width, img->height, fname);
+		res = false;
+	}
+
+	if(pixels != img->pixels) {
+		free(pixels);
+	}
+	return res;
+}
+
+// Catmull-Rom spline
+static float bicubic(float x)
+{
+	x = fabs(x);
+	if(x < 1.0f) {
+		return (1.5f * x - 2.5f) * x * x + 1.0f;
+	}
+	if(x < 2.0f) {
+		return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+	}
+	return 0.0f;
+}
+
+static float lanczos3(float x)
+{
+	x = fabs(x);
+	if(x < 1e-6f) return 1.0f;
+	if(x >= 3.0f) return 0.0f;
+
+	float px = M_PI * x;
+	return 3.0f * sin(px) * sin(px / 3.0f) / (px * px);
+}
+
+static void init_filters()
+{
+	for(int i=0; i<NUM_FILTERS; i++) {
+		int taps = filter_taps[i];
+
+		for(int j=0; j<=FILTER_PHASES; j++) {
+			float t = (float)j / (float)FILTER_PHASES;
+			float *w = filter_weights[i][j];
+			float sum = 0.0f;
+
+			for(int k=0; k<taps; k++) {
+				// distance of tap k from the sampling point
+				float x = (float)(k - taps / 2 + 1) - t;
+
+				switch(i) {
+				case FILTER_BILINEAR:
+				case FILTER_AREA:
+					w[k] = 1.0f - fabs(x);
+					break;
+				case FILTER_BICUBIC:
+					w[k] = bicubic(x);
+					break;
+				case FILTER_LANCZOS3:
+					w[k] = lanczos3(x);
+					break;
+				}
+				sum += w[k];
+			}
+			for(int k=0; k<taps; k++) {
+				w[k] /= sum;
+			}
+
+			// round to fixed point, and put the rounding error on the
+			// largest tap so that the weights add up to exactly one
+			int *wfx = filter_weights_fx[i][j];
+			int isum = 0, maxtap = 0;
+			for(int k=0; k<taps; k++) {
+				wfx[k] = (int)floor(w[k] * (1 << FILTER_FRAC_BITS) + 0.5f);
+				isum += wfx[k];
+				if(w[k] > w[maxtap]) maxtap = k;
+			}
+			wfx[maxtap] += (1 << FILTER_FRAC_BITS) - isum;
+		}
+	}
+}
+
+void calc_footprint(int width, int height, float u, float v, RemapEntry *res)
+{
+	float fx = u * width - 0.5f;
+	float fy = v * height - 0.5f;
+	float x0f = floor(fx);
+	float y0f = floor(fy);
+	res->tx = fx - x0f;
+	res->ty = fy - y0f;
+
+	int x0 = (int)x0f % width;
+	if(x0 < 0) x0 += width;
+
+	// collapse the vertical footprint to a single row past the poles
+	int y0 = (int)y0f;
+	if(y0 < 0) {
+		y0 = 0;
+		res->ty = 0.0f;
+	} else if(y0 >= height - 1) {
+		y0 = height - 1;
+		res->ty = 0.0f;
+	}
+
+	res->x = x0;
+	res->y = y0;
+}
+
+template <typename S>
+static inline void fetch_bilinear_src(const Image *img, const RemapEntry *ent, float *res)
+{
+	int x1 = ent->x + 1 >= img->width ? 0 : ent->x + 1;
+	int y1 = ent->y + 1 >= img->height ? ent->y : ent->y + 1;
+
+	const S *row0 = (const S*)image_row(img, ent->y);
+	const S *row1 = (const S*)image_row(img, y1);
+	const S *p00 = row0 + ent->x * 3;
+	const S *p01 = row0 + x1 * 3;
+	const S *p10 = row1 + ent->x * 3;
+	const S *p11 = row1 + x1 * 3;
+
+	float tx = ent->tx;
+	float ty = ent->ty;
+
+	for(int i=0; i<3; i++) {
+		float c00 = PixelOps<S>::to_float(p00[i]);
+		float c01 = PixelOps<S>::to_float(p01[i]);
+		float c10 = PixelOps<S>::to_float(p10[i]);
+		float c11 = PixelOps<S>::to_float(p11[i]);
+		float top = c00 + (c01 - c00) * tx;
+		float bot = c10 + (c11 - c10) * tx;
+		res[i] = top + (bot - top) * ty;
+	}
+}
+
+void fetch_bilinear(const Image *img, const RemapEntry *ent, float *res)
+{
+	fetch_bilinear_src<float>(img, ent, res);
+}
+
+void fetch_bilinearh(const Image *img, const RemapEntry *ent, half *res)
+{
+	float col[3];
+	fetch_bilinear_src<half>(img, ent, col);
+	PixelOps<half>::from_float(res, col);
+}
+
+void fetch_bilinear8(const Image *img, const RemapEntry *ent, unsigned char *res)
+{
+	int x1 = ent->x + 1 >= img->width ? 0 : ent->x + 1;
+	int y1 = ent->y + 1 >= img->height ? ent->y : ent->y + 1;
+
+	const unsigned char *row0 = (const unsigned char*)image_row(img, ent->y);
+	const unsigned char *row1 = (const unsigned char*)image_row(img, y1);
+	const unsigned char *p00 = row0 + ent->x * 3;
+	const unsigned char *p01 = row0 + x1 * 3;
+	const unsigned char *p10 = row1 + ent->x * 3;
+	const unsigned char *p11 = row1 + x1 * 3;
+
+	// 8 bit fractions, the result has 16 fractional bits before rounding
+	int tx = (int)(ent->tx * 256.0f + 0.5f);
+	int ty = (int)(ent->ty * 256.0f + 0.5f);
+
+	for(int i=0; i<3; i++) {
+		int top = (p00[i] << 8) + (p01[i] - p00[i]) * tx;
+		int bot = (p10[i] << 8) + (p11[i] - p10[i]) * tx;
+		res[i] = ((top << 8) + (bot - top) * ty + 0x8000) >> 16;
+	}
+}
+
+template <typename S, int TAPS, bool WRAP>
+static inline void fetch_separable(const Image *img, const RemapEntry *ent,
+		float (*wtab)[MAX_TAPS], float *res)
+{
+	const float *wx = wtab[(int)(ent->tx * FILTER_PHASES + 0.5f)];
+	const float *wy = wtab[(int)(ent->ty * FILTER_PHASES + 0.5f)];
+
+	int width = img->width;
+	int height = img->height;
+
+	int xoffs[TAPS];
+	int x = ent->x - (TAPS / 2 - 1);
+	for(int i=0; i<TAPS; i++) {
+		int xx = x + i;
+		if(WRAP) {
+			if(xx < 0) xx += width;
+			if(xx >= width) xx -= width;
+		} else {
+			if(xx < 0) xx = 0;
+			if(xx >= width) xx = width - 1;
+		}
+		xoffs[i] = xx * 3;
+	}
+
+	float r = 0.0f, g = 0.0f, b = 0.0f;
+	int y = ent->y - (TAPS / 2 - 1);
+
+	for(int i=0; i<TAPS; i++) {
+		int yy = y + i;
+		if(yy < 0) yy = 0;
+		if(yy >= height) yy = height - 1;
+		const S *row = (const S*)image_row(img, yy);
+
+		float hr = 0.0f, hg = 0.0f, hb = 0.0f;
+		for(int j=0; j<TAPS; j++) {
+			const S *pix = row + xoffs[j];
+			hr += PixelOps<S>::to_float(pix[0]) * wx[j];
+			hg += PixelOps<S>::to_float(pix[1]) * wx[j];
+			hb += PixelOps<S>::to_float(pix[2]) * wx[j];
+		}
+		r += hr * wy[i];
+		g += hg * wy[i];
+		b += hb * wy[i];
+	}
+
+	// negative lobes can overshoot below zero, which makes no sense for radiance
+	res[0] = r > 0.0f ? r : 0.0f;
+	res[1] = g > 0.0f ? g : 0.0f;
+	res[2] = b > 0.0f ? b : 0.0f;
+}
+
+void fetch_bicubic(const Image *img, const RemapEntry *ent, float *res)
+{
+	fetch_separable<float, 4, true>(img, ent, filter_weights[FILTER_BICUBIC], res);
+}
+
+void fetch_lanczos3(const Image *img, const RemapEntry *ent, float *res)
+{
+	fetch_separable<float, 6, true>(img, ent, filter_weights[FILTER_LANCZOS3], res);
+}
+
+static void fetch_bicubic_clamp(const Image *img, const RemapEntry *ent, float *res)
+{
+	fetch_separable<float, 4, false>(img, ent, filter_weights[FILTER_BICUBIC], res);
+}
+
+static void fetch_lanczos3_clamp(const Image *img, const RemapEntry *ent, float *res)
+{
+	fetch_separable<float, 6, false>(img, ent, filter_weights[FILTER_LANCZOS3], res);
+}
+
+template <int TAPS, bool WRAP>
+static void fetch_separableh(const Image *img, const RemapEntry *ent, float (*wtab)[MAX_TAPS], half *res)
+{
+	float col[3];
+	fetch_separable<half, TAPS, WRAP>(img, ent, wtab, col);
+	PixelOps<half>::from_float(res, col);
+}
+
+void fetch_bicubich(const Image *img, const RemapEntry *ent, half *res)
+{
+	fetch_separableh<4, true>(img, ent, filter_weights[FILTER_BICUBIC], res);
+}
+
+void fetch_lanczos3h(const Image *img, const RemapEntry *ent, half *res)
+{
+	fetch_separableh<6, true>(img, ent, filter_weights[FILTER_LANCZOS3], res);
+}
+
+static void fetch_bicubich_clamp(const Image *img, const RemapEntry *ent, half *res)
+{
+	fetch_separableh<4, false>(img, ent, filter_weights[FILTER_BICUBIC], res);
+}
+
+static void fetch_lanczos3h_clamp(const Image *img, const RemapEntry *ent, half *res)
+{
+	fetch_separableh<6, false>(img, ent, filter_weights[FILTER_LANCZOS3], res);
+}
+
+template <int TAPS, bool WRAP>
+static inline void fetch_separable8(const Image *img, const RemapEntry *ent,
+		int (*wtab)[MAX_TAPS], unsigned char *res)
+{
+	const int *wx = wtab[(int)(ent->tx * FILTER_PHASES + 0.5f)];
+	const int *wy = wtab[(int)(ent->ty * FILTER_PHASES + 0.5f)];
+
+	int width = img->width;
+	int height = img->height;
+
+	int xoffs[TAPS];
+	int x = ent->x - (TAPS / 2 - 1);
+	for(int i=0; i<TAPS; i++) {
+		int xx = x + i;
+		if(WRAP) {
+			if(xx < 0) xx += width;
+			if(xx >= width) xx -= width;
+		} else {
+			if(xx < 0) xx = 0;
+			if(xx >= width) xx = width - 1;
+		}
+		xoffs[i] = xx * 3;
+	}
+
+	static const int hshift = FILTER_FRAC_BITS - FILTER_HFRAC_BITS;
+	static const int vshift = FILTER_FRAC_BITS + FILTER_HFRAC_BITS;
+
+	int r = 0, g = 0, b = 0;
+	int y = ent->y - (TAPS / 2 - 1);
+
+	for(int i=0; i<TAPS; i++) {
+		int yy = y + i;
+		if(yy < 0) yy = 0;
+		if(yy >= height) yy = height - 1;
+		const unsigned char *row = (const unsigned char*)image_row(img, yy);
+
+		int hr = 0, hg = 0, hb = 0;
+		for(int j=0; j<TAPS; j++) {
+			const unsigned char *pix = row + xoffs[j];
+			hr += pix[0] * wx[j];
+			hg += pix[1] * wx[j];
+			hb += pix[2] * wx[j];
+		}
+		r += (hr >> hshift) * wy[i];
+		g += (hg >> hshift) * wy[i];
+		b += (hb >> hshift) * wy[i];
+	}
+
+	// the lobes can overshoot in both directions
+	r = (r + (1 << (vshift - 1))) >> vshift;
+	g = (g + (1 << (vshift - 1))) >> vshift;
+	b = (b + (1 << (vshift - 1))) >> vshift;
+	res[0] = r < 0 ? 0 : (r > 255 ? 255 : r);
+	res[1] = g < 0 ? 0 : (g > 255 ? 255 : g);
+	res[2] = b < 0 ? 0 : (b > 255 ? 255 : b);
+}
+
+void fetch_bicubic8(const Image *img, const RemapEntry *ent, unsigned char *res)
+{
+	fetch_separable8<4, true>(img, ent, filter_weights_fx[FILTER_BICUBIC], res);
+}
+
+void fetch_lanczos38(const Image *img, const RemapEntry *ent, unsigned char *res)
+{
+	fetch_separable8<6, true>(img, ent, filter_weights_fx[FILTER_LANCZOS3], res);
+}
+
+static void fetch_bicubic8_clamp(const Image *img, const RemapEntry *ent, unsigned char *res)
+{
+	fetch_separable8<4, false>(img, ent, filter_weights_fx[FILTER_BICUBIC], res);
+}
+
+static void fetch_lanczos38_clamp(const Image *img, const RemapEntry *ent, unsigned char *res)
+{
+	fetch_separable8<6, false>(img, ent, filter_weights_fx[FILTER_LANCZOS3], res);
+}
+
+FetchFunc fetch_func(int filter, bool wrap)
+{
+	std::call_once(filter_init_flag, init_filters);
+
+	switch(filter) {
+	case FILTER_BICUBIC:
+		return wrap ? fetch_bicubic : fetch_bicubic_clamp;
+	case FILTER_LANCZOS3:
+		return wrap ? fetch_lanczos3 : fetch_lanczos3_clamp;
+	default:
+		break;
+	}
+	// the bilinear footprint never extends past the edge without wrapping,
+	// calc_face_footprint collapses it like calc_footprint does vertically
+	return fetch_bilinear;
+}
+
+FetchFunc8 fetch_func8(int filter, bool wrap)
+{
+	std::call_once(filter_init_flag, init_filters);
+
+	switch(filter) {
+	case FILTER_BICUBIC:
+		return wrap ? fetch_bicubic8 : fetch_bicubic8_clamp;
+	case FILTER_LANCZOS3:
+		return wrap ? fetch_lanczos38 : fetch_lanczos38_clamp;
+	default:
+		break;
+	}
+	return fetch_bilinear8;
+}
+
+FetchFuncH fetch_funch(int filter, bool wrap)
+{
+	std::call_once(filter_init_flag, init_filters);
+
+	switch(filter) {
+	case FILTER_BICUBIC:
+		return wrap ? fetch_bicubich : fetch_bicubich_clamp;
+	case FILTER_LANCZOS3:
+		return wrap ? fetch_lanczos3h : fetch_lanczos3h_clamp;
+	default:
+		break;
+	}
+	return fetch_bilinearh;
+}
+
+void sample_equirect(const Image *img, float u, float v, int filter, float *res)
+{
+	RemapEntry ent;
+	calc_footprint(img->width, img->height, u, v, &ent);
+	fetch_func(filter)(img, &ent, res);
+}
+
+void calc_span_coords(int face, int size, int row, int x, int count, const ConvOptions *opt,
+		float *u, float *v, float xoffs, float yoffs)
+{
+	dirmap_face_span(face, size, row, x, count, u, v, xoffs, yoffs);
+
+	if(opt->yaw != 0.0f) {
+		float uoffs = opt->yaw / 360.0f;
+		for(int i=0; i<count; i++) {
+			u[i] += uoffs;
+		}
+	}
+}
+
+template <typename T>
+static void convert_tile_fmt(const Image *src, int face, int size, int x, int y, int width,
+		int height, const ConvOptions *opt, T *pixels, int pitch)
+{
+	float uarr[CONV_TILE_SIZE], varr[CONV_TILE_SIZE];
+	typename PixelOps<T>::Fetch fetch = PixelOps<T>::fetch(opt->filter, true);
+
+	if(opt->samples <= 1) {
+		for(int i=0; i<height; i++) {
+			T *pptr = pixels + (long)i * pitch * 3;
+
+			calc_span_coords(face, size, y + i, x, width, opt, uarr, varr);
+
+			for(int j=0; j<width; j++) {
+				RemapEntry ent;
+				calc_footprint(src->width, src->height, uarr[j], varr[j], &ent);
+				fetch(src, &ent, pptr);
+				pptr += 3;
+			}
+		}
+		return;
+	}
+
+	float offs[MAX_SAMPLES * 2];
+	int num_samples = opt->samples > MAX_SAMPLES ? MAX_SAMPLES : opt->samples;
+	calc_sample_offsets(num_samples, offs);
+
+	typename PixelOps<T>::Accum acc[CONV_TILE_SIZE * 3];
+
+	for(int i=0; i<height; i++) {
+		memset(acc, 0, width * 3 * sizeof *acc);
+
+		for(int k=0; k<num_samples; k++) {
+			calc_span_coords(face, size, y + i, x, width, opt, uarr, varr,
+					offs[k * 2], offs[k * 2 + 1]);
+
+			for(int j=0; j<width; j++) {
+				RemapEntry ent;
+				T col[3];
+				calc_footprint(src->width, src->height, uarr[j], varr[j], &ent);
+				fetch(src, &ent, col);
+				PixelOps<T>::accum(acc + j * 3, col);
+			}
+		}
+
+		PixelOps<T>::resolve(pixels + (long)i * pitch * 3, acc, width, num_samples);
+	}
+}
+
+void convert_tile(const Image *src, int face, Image *dest, int x, int y, int width,
+		int height, const ConvOptions *opt)
+{
+	size_t texel_size = pixel_size(dest->fmt);
+	convert_tile_buf(src, face, dest->width, x, y, width, height, opt,
+			(char*)image_row(dest, y) + x * texel_size, dest->pitch / (long)texel_size);
+}
+
+void convert_tile_buf(const Image *src, int face, int size, int x, int y, int width,
+		int height, const ConvOptions *opt, void *pixels, int pitch)
+{
+	if(src->fmt == PIXFMT_RGB8) {
+		convert_tile_fmt(src, face, size, x, y, width, height, opt, (unsigned char*)pixels, pitch);
+	} else if(src->fmt == PIXFMT_RGBH) {
+		convert_tile_fmt(src, face, size, x, y, width, height, opt, (half*)pixels, pitch);
+	} else {
+		convert_tile_fmt(src, face, size, x, y, width, height, opt, (float*)pixels, pitch);
+	}
+}
+
+void convert_face(const Image *src, int face, Image *dest, const ConvOptions *opt)
+{
+	int size = dest->width;
+
+	for(int y=0; y<size; y+=CONV_TILE_SIZE) {
+		int h = size - y < CONV_TILE_SIZE ? size - y : CONV_TILE_SIZE;
+		for(int x=0; x<size; x+=CONV_TILE_SIZE) {
+			int w = size - x < CONV_TILE_SIZE ? size - x : CONV_TILE_SIZE;
+			convert_tile(src, face, dest, x, y, w, h, opt);
+		}
+	}
+}
+
+static inline float wrap_delta(float d)
+{
+	if(d > 0.5f) return d - 1.0f;
+	if(d < -0.5f) return d + 1.0f;
+	return d;
+}
+
+// coordinates of one extra row and column, to get the footprint of the last ones
+#define AREA_SPAN_PITCH	(CONV_TILE_SIZE + 1)
+
+static void calc_area_coords(int face, int size, int x, int y, int width, int height,
+		const ConvOptions *opt, float *uarr, float *varr)
+{
+	for(int i=0; i<=height; i++) {
+		calc_span_coords(face, size, y + i, x, width + 1, opt, uarr + i * AREA_SPAN_PITCH,
+				varr + i * AREA_SPAN_PITCH);
+	}
+}
+
+/* the footprint of texel j is the bounding box of the parallelogram spanned
+ * by the coordinate differentials along the face x and y axes. Returns the
+ * half extents in source texels.
+ */
+static inline void area_footprint(const float *u, const float *v, int j, float src_width,
+		float src_height, float *ex, float *ey)
+{
+	static const int pitch = AREA_SPAN_PITCH;
+
+	float dudx = wrap_delta(u[j + 1] - u[j]);
+	float dudy = wrap_delta(u[j + pitch] - u[j]);
+	float dvdx = v[j + 1] - v[j];
+	float dvdy = v[j + pitch] - v[j];
+
+	*ex = 0.5f * (fabs(dudx) + fabs(dudy)) * src_width;
+	*ey = 0.5f * (fabs(dvdx) + fabs(dvdy)) * src_height;
+	if(*ex < 0.5f) *ex = 0.5f;
+	if(*ey < 0.5f) *ey = 0.5f;
+}
+
+template <typename T>
+static void convert_tile_area_fmt(const SumTable *sat, int face, int size, int x, int y, int width,
+		int height, const ConvOptions *opt, T *pixels, int pitch)
+{
+	float uarr[AREA_SPAN_PITCH * AREA_SPAN_PITCH], varr[AREA_SPAN_PITCH * AREA_SPAN_PITCH];
+	calc_area_coords(face, size, x, y, width, height, opt, uarr, varr);
+
+	float src_width = sat->width;
+	float src_height = sat->height;
+
+	for(int i=0; i<height; i++) {
+		T *pptr = pixels + (long)i * pitch * 3;
+		const float *u = uarr + i * AREA_SPAN_PITCH;
+		const float *v = varr + i * AREA_SPAN_PITCH;
+
+		for(int j=0; j<width; j++) {
+			float ex, ey;
+			area_footprint(u, v, j, src_width, src_height, &ex, &ey);
+
+			float cx = u[j] * src_width;
+			float cy = v[j] * src_height;
+
+			float col[3];
+			sumtab_box_avg(sat, cx - ex, cy - ey, cx + ex, cy + ey, col);
+			PixelOps<T>::from_float(pptr, col);
+			pptr += 3;
+		}
+	}
+}
+
+void convert_tile_area(const SumTable *sat, int face, Image *dest, int x, int y, int width,
+		int height, const ConvOptions *opt)
+{
+	size_t texel_size = pixel_size(dest->fmt);
+	convert_tile_area_buf(sat, face, dest->width, x, y, width, height, opt, dest->fmt,
+			(char*)image_row(dest, y) + x * texel_size, dest->pitch / (long)texel_size);
+}
+
+void convert_tile_area_buf(const SumTable *sat, int face, int size, int x, int y, int width,
+		int height, const ConvOptions *opt, int fmt, void *pixels, int pitch)
+{
+	if(fmt == PIXFMT_RGB8) {
+		convert_tile_area_fmt(sat, face, size, x, y, width, height, opt, (unsigned char*)pixels, pitch);
+	} else if(fmt == PIXFMT_RGBH) {
+		convert_tile_area_fmt(sat, face, size, x, y, width, height, opt, (half*)pixels, pitch);
+	} else {
+		convert_tile_area_fmt(sat, face, size, x, y, width, height, opt, (float*)pixels, pitch);
+	}
+}
+
+void area_tile_rows(int src_width, int src_height, int face, int size, int x, int y, int width,
+		int height, const ConvOptions *opt, int *row0, int *row1)
+{
+	float uarr[AREA_SPAN_PITCH * AREA_SPAN_PITCH], varr[AREA_SPAN_PITCH * AREA_SPAN_PITCH];
+	calc_area_coords(face, size, x, y, width, height, opt, uarr, varr);
+
+	float ymin = src_height, ymax = 0.0f;
+	for(int i=0; i<height; i++) {
+		const float *u = uarr + i * AREA_SPAN_PITCH;
+		const float *v = varr + i * AREA_SPAN_PITCH;
+
+		for(int j=0; j<width; j++) {
+			float ex, ey;
+			area_footprint(u, v, j, src_width, src_height, &ex, &ey);
+
+			float cy = v[j] * src_height;
+			if(cy - ey < ymin) ymin = cy - ey;
+			if(cy + ey > ymax) ymax = cy + ey;
+		}
+	}
+
+	// with a row of slack for rounding, and the sliver sumtab_box_avg keeps at the edges
+	*row0 = (int)floor(ymin) - 1;
+	*row1 = (int)ceil(ymax) + 1;
+	if(*row0 < 0) *row0 = 0;
+	if(*row1 > src_height) *row1 = src_height;
+	if(*row0 >= *row1) *row0 = *row1 - 1;
+}
+
+int auto_filter(int src_height, int cube_size)
+{
+	// a cube texel near the center of a face spans src_height / (2 * cube_size)
+	// equirect texels, and more further from the center
+	return src_height >= cube_size * 4 ? FILTER_AREA : FILTER_BILINEAR;
+}
+
+struct ConvJob {
+	const Image *src;
+	const SumTable *sat;
+	Image *faces;
+	const ConvOptions *opt;
+	const RemapTable *rmap;
+	ShProjection *sh;
+	int tiles_per_row, tiles_per_face;
+};
+
+static void calc_tile_rect(const ConvJob *job, int idx, int *face, int *x, int *y, int *w, int *h)
+{
+	int size = job->faces[0].width;
+	int tile = idx % job->tiles_per_face;
+
+	*face = idx / job->tiles_per_face;
+	*x = (tile % job->tiles_per_row) * CONV_TILE_SIZE;
+	*y = (tile / job->tiles_per_row) * CONV_TILE_SIZE;
+	*w = size - *x < CONV_TILE_SIZE ? size - *x : CONV_TILE_SIZE;
+	*h = size - *y < CONV_TILE_SIZE ? size - *y : CONV_TILE_SIZE;
+}
+
+// adds a tile which was just converted to the SH projection, while it's in the cache
+static void accum_sh_tile(ConvJob *job, int thread, int face, int x, int y, int w, int h)
+{
+	const Image *dest = job->faces + face;
+	size_t texel_size = pixel_size(dest->fmt);
+	sh_accum_tile(job->sh, thread, face, x, y, w, h, dest->fmt,
+			(char*)image_row(dest, y) + x * texel_size, dest->pitch / (long)texel_size);
+}
+
+static void conv_tile_task(int idx, int thread, void *cls)
+{
+	ConvJob *job = (ConvJob*)cls;
+	int face, x, y, w, h;
+
+	calc_tile_rect(job, idx, &face, &x, &y, &w, &h);
+	convert_tile(job->src, face, job->faces + face, x, y, w, h, job->opt);
+	if(job->sh) {
+		accum_sh_tile(job, thread, face, x, y, w, h);
+	}
+}
+
+static void conv_area_tile_task(int idx, int thread, void *cls)
+{
+	ConvJob *job = (ConvJob*)cls;
+	int face, x, y, w, h;
+
+	calc_tile_rect(job, idx, &face, &x, &y, &w, &h);
+	convert_tile_area(job->sat, face, job->faces + face, x, y, w, h, job->opt);
+	if(job->sh) {
+		accum_sh_tile(job, thread, face, x, y, w, h);
+	}
+}
+
+template <typename T>
+static void remap_tile(const ConvJob *job, int face, int x, int y, int w, int h)
+{
+	Image *dest = job->faces + face;
+	int size = dest->width;
+	typename PixelOps<T>::Fetch fetch = PixelOps<T>::fetch(job->opt->filter, true);
+
+	int num_samples = job->rmap->key.opt.samples;
+
+	if(num_samples <= 1) {
+		for(int i=0; i<h; i++) {
+			const RemapEntry *ent = remap_face_entries(job->rmap, face) + (y + i) * size + x;
+			T *pptr = (T*)image_row(dest, y + i) + x * 3;
+
+			for(int j=0; j<w; j++) {
+				fetch(job->src, ent++, pptr);
+				pptr += 3;
+			}
+		}
+		return;
+	}
+
+	// entries are sample-major within each row, see create_remap
+	typename PixelOps<T>::Accum acc[CONV_TILE_SIZE * 3];
+
+	for(int i=0; i<h; i++) {
+		const RemapEntry *rowent = remap_face_entries(job->rmap, face) + (size_t)(y + i) * size * num_samples;
+		memset(acc, 0, w * 3 * sizeof *acc);
+
+		for(int k=0; k<num_samples; k++) {
+			const RemapEntry *ent = rowent + k * size + x;
+
+			for(int j=0; j<w; j++) {
+				T col[3];
+				fetch(job->src, ent++, col);
+				PixelOps<T>::accum(acc + j * 3, col);
+			}
+		}
+
+		T *rowpix = (T*)image_row(dest, y + i) + x * 3;
+		PixelOps<T>::resolve(rowpix, acc, w, num_samples);
+	}
+}
+
+static void remap_tile_task(int idx, int thread, void *cls)
+{
+	ConvJob *job = (ConvJob*)cls;
+	int face, x, y, w, h;
+
+	calc_tile_rect(job, idx, &face, &x, &y, &w, &h);
+
+	if(job->faces[face].fmt == PIXFMT_RGB8) {
+		remap_tile<unsigned char>(job, face, x, y, w, h);
+	} else if(job->faces[face].fmt == PIXFMT_RGBH) {
+		remap_tile<half>(job, face, x, y, w, h);
+	} else {
+		remap_tile<float>(job, face, x, y, w, h);
+	}
+	if(job->sh) {
+		accum_sh_tile(job, thread, face, x, y, w, h);
+	}
+}
+
+static void run_tiles(ConvJob *job, TaskFunc func, ThreadPool *tpool)
+{
+	job->tiles_per_row = (job->faces[0].width + CONV_TILE_SIZE - 1) / CONV_TILE_SIZE;
+	job->tiles_per_face = job->tiles_per_row * job->tiles_per_row;
+	int num_tiles = job->tiles_per_face * 6;
+
+	if(job->sh) {
+		sh_begin(job->sh, job->faces[0].width, tpool ? tpool->get_num_threads() : 1);
+	}
+
+	if(tpool) {
+		tpool->run(num_tiles, func, job);
+	} else {
+		for(int i=0; i<num_tiles; i++) {
+			func(i, 0, job);
+		}
+	}
+
+	if(job->sh) {
+		sh_end(job->sh);
+	}
+}
+
+bool convert_cubemap(const Image *src, Image *faces, const ConvOptions *opt, ThreadPool *tpool,
+		ShProjection *sh)
+{
+	ConvJob job;
+	job.src = src;
+	job.faces = faces;
+	job.opt = opt;
+	job.rmap = 0;
+	job.sat = 0;
+	job.sh = sh;
+
+	for(int i=0; i<6; i++) {
+		if(faces[i].fmt != src->fmt) {
+			fprintf(stderr, "convert_cubemap: faces must have the same pixel format as the source\n");
+			return false;
+		}
+	}
+
+	if(opt->filter == FILTER_AREA) {
+		SumTable sat;
+		if(!build_sumtab(&sat, src, tpool)) {
+			return false;
+		}
+		job.sat = &sat;
+		run_tiles(&job, conv_area_tile_task, tpool);
+		destroy_sumtab(&sat);
+		return true;
+	}
+
+	run_tiles(&job, conv_tile_task, tpool);
+	return true;
+}
+
+void convert_cubemap_remap(const Image *src, Image *faces, const RemapTable *rmap, ThreadPool *tpool,
+		ShProjection *sh)
+{
+	ConvJob job;
+	job.src = src;
+	job.faces = faces;
+	job.opt = &rmap->key.opt;
+	job.rmap = rmap;
+	job.sat = 0;
+	job.sh = sh;
+
+	run_tiles(&job, remap_tile_task, tpool);
+}
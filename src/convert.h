@@ -0,0 +1,312 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CONVERT_H_
+#define CONVERT_H_
+
+#include <stddef.h>
+#include "dirmap.h"
+#include "half.h"
+
+class ThreadPool;
+struct RemapTable;
+struct RemapEntry;
+struct SumTable;
+struct ShProjection;
+
+/* size of the square tiles the faces are split into for conversion. 64x64
+ * RGB float texels fit in L2 along with their source footprint, and it's a
+ * multiple of the SIMD width so that the dirmap kernel never processes a
+ * partial batch except for the last tile of each row.
+ */
+#define CONV_TILE_SIZE	64
+
+// reconstruction filters
+enum {
+	FILTER_BILINEAR,
+	FILTER_BICUBIC,		// Catmull-Rom
+	FILTER_LANCZOS3,
+	FILTER_AREA,		// box filter over the texel footprint, for downsampling
+
+	NUM_FILTERS
+};
+
+extern const char *filter_name[NUM_FILTERS];
+
+// number of source texels along each axis which a filter lookup reads
+int get_filter_taps(int filter);
+
+// parameters which affect the mapping from cube texels to equirect texels
+struct ConvOptions {
+	int filter;
+	float yaw;		// horizontal rotation of the panorama in degrees
+	int samples;	// samples per cube texel (ignored by FILTER_AREA)
+};
+
+#define MAX_SAMPLES		64
+
+/* subtexel sample offsets in [-0.5, 0.5), xy pairs. The samples are spread
+ * over an n-rooks pattern: every sample falls in a different row and column
+ * of an n x n subgrid. For 4 samples it's the classic rotated grid, and up to
+ * 16 samples no three samples lie on a line. Always the same for the same
+ * number of samples.
+ */
+void calc_sample_offsets(int num, float *offs);
+
+void default_conv_options(ConvOptions *opt);
+
+// pixel formats of Image, all RGB
+enum {
+	PIXFMT_RGBF,	// 32bit float per channel, for HDR images
+	PIXFMT_RGB8,	// 8bit per channel, for LDR images
+	PIXFMT_RGBH		// 16bit half float per channel, for HDR images (see half.h)
+};
+
+/* image allocated with malloc, or mapped from a raw image file (see
+ * rawimg.h). Pixels are in the format specified by fmt.
+ */
+struct Image {
+	int width, height;
+	int fmt;
+	void *pixels;		// start of the top row held in memory
+	long pitch;			// bytes from one row to the next, negative for bottom-up files
+	int first_row;		// row at pixels, 0 unless only a band of rows is held (see stream.cc)
+	void *map;			// start of the file mapping, for mapped images
+	size_t map_size;
+};
+
+static inline void *image_row(const Image *img, int y)
+{
+	return (char*)img->pixels + (long)(y - img->first_row) * img->pitch;
+}
+
+bool init_image(Image *img, int width, int height, int fmt);
+void destroy_image(Image *img);
+
+/* makes view a w x h subimage of img at (x, y), sharing its pixels. Views
+ * must not be destroyed, and are only valid while img is.
+ */
+void image_view(Image *view, const Image *img, int x, int y, int w, int h);
+
+size_t pixel_size(int fmt);
+
+// load_image flags
+enum {
+	LOAD_FLOAT	= 1,	// load LDR images as floating point too
+	LOAD_HALF	= 2		// store floating point images as PIXFMT_RGBH
+};
+
+/* LDR images are loaded as PIXFMT_RGB8 and HDR images as PIXFMT_RGBF, unless
+ * changed by the flags above
+ */
+bool load_image(Image *img, const char *fname, unsigned int flags = 0);
+
+/* .exr files are written directly in the pixel format of the image (see
+ * exr.h), everything else goes through imago, which half float images have
+ * to be widened for.
+ */
+bool save_image(const Image *img, const char *fname);
+
+/* filtered lookup, wrapping horizontally and clamping vertically. It's split
+ * in two steps: calc_footprint calculates the source texel and subtexel
+ * offsets, which are the same for all filters, and the fetch functions read
+ * and blend the source texels around it. This allows the first step to be
+ * precomputed in a remap table. fetch_func with wrap = false returns fetch
+ * functions which clamp horizontally too, for sampling cube faces.
+ *
+ * FetchFunc reads PIXFMT_RGBF images, FetchFunc8 reads PIXFMT_RGB8 images
+ * and blends them with fixed point weights, without going through floats.
+ * FetchFuncH reads PIXFMT_RGBH images, and blends them in floating point.
+ */
+typedef void (*FetchFunc)(const Image*, const RemapEntry*, float*);
+typedef void (*FetchFunc8)(const Image*, const RemapEntry*, unsigned char*);
+typedef void (*FetchFuncH)(const Image*, const RemapEntry*, half*);
+
+void calc_footprint(int width, int height, float u, float v, RemapEntry *res);
+void fetch_bilinear(const Image *img, const RemapEntry *ent, float *res);
+void fetch_bicubic(const Image *img, const RemapEntry *ent, float *res);
+void fetch_lanczos3(const Image *img, const RemapEntry *ent, float *res);
+FetchFunc fetch_func(int filter, bool wrap = true);
+
+void fetch_bilinear8(const Image *img, const RemapEntry *ent, unsigned char *res);
+void fetch_bicubic8(const Image *img, const RemapEntry *ent, unsigned char *res);
+void fetch_lanczos38(const Image *img, const RemapEntry *ent, unsigned char *res);
+FetchFunc8 fetch_func8(int filter, bool wrap = true);
+
+void fetch_bilinearh(const Image *img, const RemapEntry *ent, half *res);
+void fetch_bicubich(const Image *img, const RemapEntry *ent, half *res);
+void fetch_lanczos3h(const Image *img, const RemapEntry *ent, half *res);
+FetchFuncH fetch_funch(int filter, bool wrap = true);
+
+/* per pixel type operations for the conversion loops, which are templates
+ * over the channel type. Supersamples are summed in Accum and averaged by
+ * resolve, 8bit channels in integers, with rounding. to_float returns the
+ * channel value in the units of the format (0-255 for 8bit channels).
+ */
+template <typename T> struct PixelOps;
+
+template <> struct PixelOps<float> {
+	typedef float Accum;
+	typedef FetchFunc Fetch;
+
+	static Fetch fetch(int filter, bool wrap) { return fetch_func(filter, wrap); }
+	static float to_float(float x) { return x; }
+
+	static void accum(float *acc, const float *col)
+	{
+		acc[0] += col[0];
+		acc[1] += col[1];
+		acc[2] += col[2];
+	}
+
+	static void resolve(float *dest, const float *acc, int count, int num_samples)
+	{
+		float s = 1.0f / (float)num_samples;
+		for(int i=0; i<count * 3; i++) {
+			dest[i] = acc[i] * s;
+		}
+	}
+
+	static void from_float(float *dest, const float *col)
+	{
+		dest[0] = col[0];
+		dest[1] = col[1];
+		dest[2] = col[2];
+	}
+};
+
+template <> struct PixelOps<unsigned char> {
+	typedef int Accum;
+	typedef FetchFunc8 Fetch;
+
+	static Fetch fetch(int filter, bool wrap) { return fetch_func8(filter, wrap); }
+	static float to_float(unsigned char x) { return x; }
+
+	static void accum(int *acc, const unsigned char *col)
+	{
+		acc[0] += col[0];
+		acc[1] += col[1];
+		acc[2] += col[2];
+	}
+
+	static void resolve(unsigned char *dest, const int *acc, int count, int num_samples)
+	{
+		int half = num_samples / 2;
+		for(int i=0; i<count * 3; i++) {
+			dest[i] = (acc[i] + half) / num_samples;
+		}
+	}
+
+	static void from_float(unsigned char *dest, const float *col)
+	{
+		for(int i=0; i<3; i++) {
+			float x = col[i] + 0.5f;
+			dest[i] = x <= 0.0f ? 0 : (x >= 255.0f ? 255 : (int)x);
+		}
+	}
+};
+
+template <> struct PixelOps<half> {
+	typedef float Accum;
+	typedef FetchFuncH Fetch;
+
+	static Fetch fetch(int filter, bool wrap) { return fetch_funch(filter, wrap); }
+	static float to_float(half x) { return half_to_float(x); }
+
+	static void accum(float *acc, const half *col)
+	{
+		acc[0] += half_to_float(col[0]);
+		acc[1] += half_to_float(col[1]);
+		acc[2] += half_to_float(col[2]);
+	}
+
+	static void resolve(half *dest, const float *acc, int count, int num_samples)
+	{
+		float s = 1.0f / (float)num_samples;
+		for(int i=0; i<count * 3; i++) {
+			dest[i] = float_to_half(acc[i] * s);
+		}
+	}
+
+	static void from_float(half *dest, const float *col)
+	{
+		dest[0] = float_to_half(col[0]);
+		dest[1] = float_to_half(col[1]);
+		dest[2] = float_to_half(col[2]);
+	}
+};
+
+// PIXFMT_RGBF images only
+void sample_equirect(const Image *img, float u, float v, int filter, float *res);
+
+// equirect coordinates of a span of face texels (see dirmap_face_span), rotated by opt->yaw
+void calc_span_coords(int face, int size, int row, int x, int count, const ConvOptions *opt,
+		float *u, float *v, float xoffs = 0.0f, float yoffs = 0.0f);
+
+/* CPU equirect -> cubemap conversion, doesn't need an OpenGL context.
+ * faces must already be initialized to the desired cube face size, and the
+ * same pixel format as src.
+ * The output doesn't depend on the number of threads in the pool, each texel
+ * is always computed the same way.
+ */
+void convert_tile(const Image *src, int face, Image *dest, int x, int y, int width,
+		int height, const ConvOptions *opt);
+void convert_face(const Image *src, int face, Image *dest, const ConvOptions *opt);
+
+/* like convert_tile, but for a face of the given size, and writes the tile to
+ * a separate buffer in the pixel format of src, with rows pitch texels apart
+ * (negative for bottom-up buffers)
+ */
+void convert_tile_buf(const Image *src, int face, int size, int x, int y, int width,
+		int height, const ConvOptions *opt, void *pixels, int pitch);
+
+/* FILTER_AREA conversion of a tile: averages the source over the footprint
+ * of each cube texel, by integrating it with a summed-area table
+ */
+void convert_tile_area(const SumTable *sat, int face, Image *dest, int x, int y, int width,
+		int height, const ConvOptions *opt);
+
+// like convert_tile_buf for convert_tile_area, writing pixels of format fmt
+void convert_tile_area_buf(const SumTable *sat, int face, int size, int x, int y, int width,
+		int height, const ConvOptions *opt, int fmt, void *pixels, int pitch);
+
+/* the rows [row0, row1) of a src_width x src_height panorama which
+ * convert_tile_area reads for a tile, to build a summed-area table of just
+ * those rows (see build_sumtab_rows)
+ */
+void area_tile_rows(int src_width, int src_height, int face, int size, int x, int y, int width,
+		int height, const ConvOptions *opt, int *row0, int *row1);
+
+/* returns FILTER_AREA when the cube texels are large enough compared to the
+ * source texels that point-sampling filters would alias, otherwise FILTER_BILINEAR
+ */
+int auto_filter(int src_height, int cube_size);
+
+/* sh, if not null, also accumulates the spherical harmonics projection of
+ * the faces, tile by tile as they are converted (see sh.h)
+ */
+bool convert_cubemap(const Image *src, Image *faces, const ConvOptions *opt, ThreadPool *tpool = 0,
+		ShProjection *sh = 0);
+
+/* same as convert_cubemap, but only gathers source texels according to a
+ * precomputed remap table, which must match the source and face sizes.
+ * Produces identical results. Remap tables don't support FILTER_AREA.
+ */
+void convert_cubemap_remap(const Image *src, Image *faces, const RemapTable *rmap,
+		ThreadPool *tpool = 0, ShProjection *sh = 0);
+
+#endif	// CONVERT_H_
@@ -0,0 +1,205 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "dds.h"
+#include "convert.h"
+#include "bcenc.h"
+
+#define DDS_MAGIC			0x20534444	// "DDS "
+#define DDS_FOURCC_DX10		0x30315844	// "DX10"
+
+#define DDSD_CAPS			0x1
+#define DDSD_HEIGHT			0x2
+#define DDSD_WIDTH			0x4
+#define DDSD_PITCH			0x8
+#define DDSD_PIXELFORMAT	0x1000
+#define DDSD_MIPMAPCOUNT	0x20000
+#define DDSD_LINEARSIZE		0x80000
+#define DDPF_FOURCC			0x4
+#define DDSCAPS_COMPLEX		0x8
+#define DDSCAPS_TEXTURE		0x1000
+#define DDSCAPS_MIPMAP		0x400000
+#define DDSCAPS2_CUBEMAP	0xfe00		// cubemap with all six faces
+
+#define DXGI_R32G32B32_FLOAT		6
+#define DXGI_R16G16B16A16_FLOAT		10
+#define DXGI_R8G8B8A8_UNORM			28
+#define DXGI_BC1_UNORM				71
+#define DXGI_BC6H_UF16				95
+#define DXGI_BC7_UNORM				98
+
+#define D3D10_TEXTURE2D				3
+#define D3D10_MISC_TEXTURECUBE		0x4
+
+static bool write_header(FILE *fp, int size, int levels, unsigned int dxgi_fmt, bool compressed,
+		unsigned int pitch_or_size)
+{
+	unsigned int hdr[32];
+	memset(hdr, 0, sizeof hdr);
+
+	hdr[0] = DDS_MAGIC;
+	hdr[1] = 124;		// header size
+	hdr[2] = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT |
+		(compressed ? DDSD_LINEARSIZE : DDSD_PITCH);
+	hdr[3] = size;
+	hdr[4] = size;
+	hdr[5] = pitch_or_size;
+	hdr[7] = levels;
+	// pixel format
+	hdr[19] = 32;
+	hdr[20] = DDPF_FOURCC;
+	hdr[21] = DDS_FOURCC_DX10;
+	// caps
+	hdr[27] = DDSCAPS_TEXTURE | DDSCAPS_COMPLEX | (levels > 1 ? DDSCAPS_MIPMAP : 0);
+	hdr[28] = DDSCAPS2_CUBEMAP;
+
+	unsigned int dx10[5];
+	dx10[0] = dxgi_fmt;
+	dx10[1] = D3D10_TEXTURE2D;
+	dx10[2] = D3D10_MISC_TEXTURECUBE;
+	dx10[3] = 1;		// one cube
+	dx10[4] = 0;
+
+	return fwrite(hdr, sizeof hdr, 1, fp) == 1 && fwrite(dx10, sizeof dx10, 1, fp) == 1;
+}
+
+// writes a face row, adding an opaque alpha channel to 8bit and half float texels
+static bool write_row(FILE *fp, const Image *img, int y, std::vector<unsigned char> *buf)
+{
+	const void *row = image_row(img, y);
+	int width = img->width;
+
+	switch(img->fmt) {
+	case PIXFMT_RGB8:
+		{
+			buf->resize(width * 4);
+			const unsigned char *src = (const unsigned char*)row;
+			unsigned char *dest = buf->data();
+			for(int i=0; i<width; i++) {
+				dest[0] = src[0];
+				dest[1] = src[1];
+				dest[2] = src[2];
+				dest[3] = 255;
+				src += 3;
+				dest += 4;
+			}
+		}
+		break;
+
+	case PIXFMT_RGBH:
+		{
+			buf->resize(width * 8);
+			const half *src = (const half*)row;
+			half *dest = (half*)buf->data();
+			for(int i=0; i<width; i++) {
+				dest[0] = src[0];
+				dest[1] = src[1];
+				dest[2] = src[2];
+				dest[3] = 0x3c00;	// 1.0
+				src += 3;
+				dest += 4;
+			}
+		}
+		break;
+
+	default:
+		return fwrite(row, width * 12, 1, fp) == 1;
+	}
+	return fwrite(buf->data(), 1, buf->size(), fp) == buf->size();
+}
+
+bool save_dds_cubemap(const Image *faces, const char *fname, const Image *mips, int levels)
+{
+	unsigned int dxgi_fmt, texel_size;
+	switch(faces[0].fmt) {
+	case PIXFMT_RGB8:
+		dxgi_fmt = DXGI_R8G8B8A8_UNORM;
+		texel_size = 4;
+		break;
+	case PIXFMT_RGBH:
+		dxgi_fmt = DXGI_R16G16B16A16_FLOAT;
+		texel_size = 8;
+		break;
+	default:
+		dxgi_fmt = DXGI_R32G32B32_FLOAT;
+		texel_size = 12;
+	}
+
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	int size = faces[0].width;
+	bool res = write_header(fp, size, levels, dxgi_fmt, false, size * texel_size);
+
+	std::vector<unsigned char> buf;
+	for(int i=0; i<6 && res; i++) {
+		for(int j=0; j<levels && res; j++) {
+			const Image *face = j ? mips + (j - 1) * 6 + i : faces + i;
+			for(int k=0; k<face->height && res; k++) {
+				res = write_row(fp, face, k, &buf);
+			}
+		}
+	}
+
+	if(!res) {
+		fprintf(stderr, "failed to write %s\n", fname);
+	}
+	fclose(fp);
+	return res;
+}
+
+bool save_dds_compressed(const BlockImage *faces, const char *fname, int levels)
+{
+	unsigned int dxgi_fmt;
+	switch(faces[0].format) {
+	case COMP_BC1:
+		dxgi_fmt = DXGI_BC1_UNORM;
+		break;
+	case COMP_BC7:
+		dxgi_fmt = DXGI_BC7_UNORM;
+		break;
+	default:
+		dxgi_fmt = DXGI_BC6H_UF16;
+	}
+
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	bool res = write_header(fp, faces[0].width, levels, dxgi_fmt, true, faces[0].size);
+
+	for(int i=0; i<6 && res; i++) {
+		for(int j=0; j<levels && res; j++) {
+			const BlockImage *face = faces + j * 6 + i;
+			res = fwrite(face->data, 1, face->size, fp) == face->size;
+		}
+	}
+
+	if(!res) {
+		fprintf(stderr, "failed to write %s\n", fname);
+	}
+	fclose(fp);
+	return res;
+}
@@ -0,0 +1,36 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DDS_H_
+#define DDS_H_
+
+struct Image;
+struct BlockImage;
+
+/* writes the six faces, and optionally the mip levels (see save_ktx_cubemap),
+ * as a single DDS cubemap with a DX10 header. DXGI has no 3 channel 8bit or
+ * half float formats, so PIXFMT_RGB8 faces are written as R8G8B8A8_UNORM and
+ * PIXFMT_RGBH faces as R16G16B16A16_FLOAT, with opaque alpha. PIXFMT_RGBF
+ * faces are written as R32G32B32_FLOAT. As DDS requires, all the levels of a
+ * face are stored before the next face.
+ */
+bool save_dds_cubemap(const Image *faces, const char *fname, const Image *mips = 0, int levels = 1);
+
+// block compressed faces (see save_ktx_compressed), as BC1_UNORM, BC7_UNORM or BC6H_UF16
+bool save_dds_compressed(const BlockImage *faces, const char *fname, int levels = 1);
+
+#endif	// DDS_H_
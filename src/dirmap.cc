@@ -0,0 +1,264 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <math.h>
+#include <float.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH	8
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_WIDTH	4
+#else
+#define SIMD_WIDTH	1
+#endif
+#include "dirmap.h"
+
+const char *cube_face_name[6] = {"px", "nx", "py", "ny", "pz", "nz"};
+
+const int dirmap_simd_width = SIMD_WIDTH;
+
+/* atan(x) for x in [0, 1]: odd polynomial of degree 11, max error 1.7e-6 rad,
+ * or 2.7e-7 after scaling to texture coordinates.
+ */
+#define ATAN_C0		0.99997726f
+#define ATAN_C1		-0.33262347f
+#define ATAN_C2		0.19354346f
+#define ATAN_C3		-0.11643287f
+#define ATAN_C4		0.05265332f
+#define ATAN_C5		-0.01172120f
+
+#define HALF_PI		1.57079632679f
+#define PI			3.14159265359f
+#define INV_PI		0.31830988618f
+#define INV_TWO_PI	0.15915494309f
+
+void cube_face_dir(int face, float s, float t, float *dir)
+{
+	float sc = s * 2.0f - 1.0f;
+	float tc = t * 2.0f - 1.0f;
+
+	switch(face) {
+	case CUBE_PX:
+		dir[0] = 1.0f;
+		dir[1] = -tc;
+		dir[2] = -sc;
+		break;
+	case CUBE_NX:
+		dir[0] = -1.0f;
+		dir[1] = -tc;
+		dir[2] = sc;
+		break;
+	case CUBE_PY:
+		dir[0] = sc;
+		dir[1] = 1.0f;
+		dir[2] = tc;
+		break;
+	case CUBE_NY:
+		dir[0] = sc;
+		dir[1] = -1.0f;
+		dir[2] = -tc;
+		break;
+	case CUBE_PZ:
+		dir[0] = sc;
+		dir[1] = -tc;
+		dir[2] = 1.0f;
+		break;
+	case CUBE_NZ:
+	default:
+		dir[0] = -sc;
+		dir[1] = -tc;
+		dir[2] = -1.0f;
+	}
+}
+
+void dir_to_equirect(const float *dir, float *u, float *v)
+{
+	// same as the sphere texcoords in gen_geosphere, after the -90deg
+	// rotation and horizontal texcoord flip applied in app_init. phi is
+	// computed with atan2 because acos(y) loses most of its precision near
+	// the poles.
+	double xz = sqrt((double)dir[0] * dir[0] + (double)dir[2] * dir[2]);
+	*u = atan2((double)dir[2], (double)dir[0]) / (2.0 * M_PI) + 0.5;
+	*v = atan2(xz, (double)dir[1]) / M_PI;
+}
+
+static inline float atan2_approx(float y, float x)
+{
+	float ax = fabs(x);
+	float ay = fabs(y);
+	float mx = ax > ay ? ax : ay;
+	float mn = ax > ay ? ay : ax;
+	float a = mn / (mx > FLT_MIN ? mx : FLT_MIN);
+	float s = a * a;
+
+	float r = ((((ATAN_C5 * s + ATAN_C4) * s + ATAN_C3) * s + ATAN_C2) * s + ATAN_C1) * s + ATAN_C0;
+	r *= a;
+
+	if(ay > ax) r = HALF_PI - r;
+	if(x < 0.0f) r = PI - r;
+	return y < 0.0f ? -r : r;
+}
+
+#if SIMD_WIDTH == 8
+static inline __m256 atan2_simd(__m256 y, __m256 x)
+{
+	const __m256 signmask = _mm256_set1_ps(-0.0f);
+
+	__m256 ax = _mm256_andnot_ps(signmask, x);
+	__m256 ay = _mm256_andnot_ps(signmask, y);
+	__m256 mx = _mm256_max_ps(ax, ay);
+	__m256 mn = _mm256_min_ps(ax, ay);
+	__m256 a = _mm256_div_ps(mn, _mm256_max_ps(mx, _mm256_set1_ps(FLT_MIN)));
+	__m256 s = _mm256_mul_ps(a, a);
+
+	__m256 r = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(ATAN_C5), s), _mm256_set1_ps(ATAN_C4));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(ATAN_C3));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(ATAN_C2));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(ATAN_C1));
+	r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(ATAN_C0));
+	r = _mm256_mul_ps(r, a);
+
+	__m256 mask = _mm256_cmp_ps(ay, ax, _CMP_GT_OQ);
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(HALF_PI), r), mask);
+	mask = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ);
+	r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI), r), mask);
+	mask = _mm256_cmp_ps(y, _mm256_setzero_ps(), _CMP_LT_OQ);
+	return _mm256_or_ps(r, _mm256_and_ps(mask, signmask));
+}
+
+#define VEC				__m256
+#define VSET1(x)		_mm256_set1_ps(x)
+#define VADD(a, b)		_mm256_add_ps(a, b)
+#define VMUL(a, b)		_mm256_mul_ps(a, b)
+#define VSQRT(a)		_mm256_sqrt_ps(a)
+#define VSTORE(p, a)	_mm256_storeu_ps(p, a)
+#define VINDEX			_mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0)
+
+#elif SIMD_WIDTH == 4
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 atan2_simd(__m128 y, __m128 x)
+{
+	const __m128 signmask = _mm_set1_ps(-0.0f);
+
+	__m128 ax = _mm_andnot_ps(signmask, x);
+	__m128 ay = _mm_andnot_ps(signmask, y);
+	__m128 mx = _mm_max_ps(ax, ay);
+	__m128 mn = _mm_min_ps(ax, ay);
+	__m128 a = _mm_div_ps(mn, _mm_max_ps(mx, _mm_set1_ps(FLT_MIN)));
+	__m128 s = _mm_mul_ps(a, a);
+
+	__m128 r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ATAN_C5), s), _mm_set1_ps(ATAN_C4));
+	r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(ATAN_C3));
+	r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(ATAN_C2));
+	r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(ATAN_C1));
+	r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(ATAN_C0));
+	r = _mm_mul_ps(r, a);
+
+	r = select_ps(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(_mm_set1_ps(HALF_PI), r), r);
+	r = select_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(PI), r), r);
+	return _mm_or_ps(r, _mm_and_ps(_mm_cmplt_ps(y, _mm_setzero_ps()), signmask));
+}
+
+#define VEC				__m128
+#define VSET1(x)		_mm_set1_ps(x)
+#define VADD(a, b)		_mm_add_ps(a, b)
+#define VMUL(a, b)		_mm_mul_ps(a, b)
+#define VSQRT(a)		_mm_sqrt_ps(a)
+#define VSTORE(p, a)	_mm_storeu_ps(p, a)
+#define VINDEX			_mm_set_ps(3, 2, 1, 0)
+#endif
+
+/* Along a face row the direction is linear in the s coordinate: dir = A*s + B
+ * which lets the same inner loop handle all faces without branching.
+ * Neither atan2 needs a normalized direction, phi is computed as
+ * atan2(sqrt(x^2 + z^2), y) instead of acos(y), so no normalization is
+ * performed either.
+ */
+void dirmap_face_span(int face, int size, int row, int x, int count, float *u, float *v,
+		float xoffs, float yoffs)
+{
+	float t = ((float)row + 0.5f + yoffs) / (float)size;
+	float dir_a[3], dir_b[3];
+	cube_face_dir(face, 0.5f, t, dir_b);
+	cube_face_dir(face, 1.0f, t, dir_a);
+	for(int i=0; i<3; i++) {
+		dir_a[i] -= dir_b[i];
+	}
+
+	float ds = 2.0f / (float)size;
+	float s0 = ds * (0.5f + xoffs) - 1.0f;
+
+	int end = x + count;
+
+#if SIMD_WIDTH > 1
+	VEC ax = VSET1(dir_a[0]), ay = VSET1(dir_a[1]), az = VSET1(dir_a[2]);
+	VEC bx = VSET1(dir_b[0]), by = VSET1(dir_b[1]), bz = VSET1(dir_b[2]);
+	VEC vds = VSET1(ds), vs0 = VSET1(s0);
+	VEC inv_two_pi = VSET1(INV_TWO_PI), inv_pi = VSET1(INV_PI), half = VSET1(0.5f);
+	VEC idx = VINDEX;
+
+	while(x + SIMD_WIDTH <= end) {
+		VEC s = VADD(VMUL(VADD(VSET1((float)x), idx), vds), vs0);
+		VEC dx = VADD(VMUL(ax, s), bx);
+		VEC dy = VADD(VMUL(ay, s), by);
+		VEC dz = VADD(VMUL(az, s), bz);
+
+		VEC theta = atan2_simd(dz, dx);
+		VEC phi = atan2_simd(VSQRT(VADD(VMUL(dx, dx), VMUL(dz, dz))), dy);
+
+		VSTORE(u, VADD(VMUL(theta, inv_two_pi), half));
+		VSTORE(v, VMUL(phi, inv_pi));
+
+		x += SIMD_WIDTH;
+		u += SIMD_WIDTH;
+		v += SIMD_WIDTH;
+	}
+#endif
+
+	while(x < end) {
+		float s = (float)x * ds + s0;
+		float dx = dir_a[0] * s + dir_b[0];
+		float dy = dir_a[1] * s + dir_b[1];
+		float dz = dir_a[2] * s + dir_b[2];
+
+		float theta = atan2_approx(dz, dx);
+		float phi = atan2_approx(sqrt(dx * dx + dz * dz), dy);
+
+		*u++ = theta * INV_TWO_PI + 0.5f;
+		*v++ = phi * INV_PI;
+		x++;
+	}
+}
+
+void dirmap_face_span_ref(int face, int size, int row, int x, int count, float *u, float *v,
+		float xoffs, float yoffs)
+{
+	float t = ((float)row + 0.5f + yoffs) / (float)size;
+
+	for(int i=0; i<count; i++) {
+		float s = ((float)(x + i) + 0.5f + xoffs) / (float)size;
+		float dir[3];
+
+		cube_face_dir(face, s, t, dir);
+		dir_to_equirect(dir, u + i, v + i);
+	}
+}
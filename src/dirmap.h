@@ -0,0 +1,63 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DIRMAP_H_
+#define DIRMAP_H_
+
+// cube faces, in the same order as the GL_TEXTURE_CUBE_MAP_* targets
+enum {
+	CUBE_PX,
+	CUBE_NX,
+	CUBE_PY,
+	CUBE_NY,
+	CUBE_PZ,
+	CUBE_NZ
+};
+
+extern const char *cube_face_name[6];
+
+/* direction (not normalized) through point s,t [0, 1] of a cubemap face,
+ * following the OpenGL cubemap face orientation conventions
+ */
+void cube_face_dir(int face, float s, float t, float *dir);
+
+/* equirectangular texture coordinates of a direction (doesn't need to be
+ * normalized), matching the texture mapping of the sphere used by the OpenGL
+ * renderer. Computed in double precision.
+ */
+void dir_to_equirect(const float *dir, float *u, float *v);
+
+/* equirect texture coordinates for count consecutive texels of a cube face
+ * row, starting at texel x. xoffs/yoffs move the sampling point away from the
+ * texel centers, in texels (for supersampling). Processes dirmap_simd_width
+ * texels at a time, using polynomial atan2 approximations instead of
+ * atan2/acos. The maximum absolute error against dirmap_face_span_ref is
+ * below 7e-7 for both u and v (less than 0.01 texels even for a 16k wide
+ * equirect), with the error of u scaled by sin(v * pi): near the poles u
+ * depends on tiny differences of the direction, but the parallels there are
+ * as short. --bench checks it for the face size it converts to.
+ */
+void dirmap_face_span(int face, int size, int row, int x, int count, float *u, float *v,
+		float xoffs = 0.0f, float yoffs = 0.0f);
+
+// scalar reference implementation of the above, using cube_face_dir and dir_to_equirect
+void dirmap_face_span_ref(int face, int size, int row, int x, int count, float *u, float *v,
+		float xoffs = 0.0f, float yoffs = 0.0f);
+
+extern const int dirmap_simd_width;
+
+#endif	// DIRMAP_H_
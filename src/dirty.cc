@@ -0,0 +1,364 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include "dirty.h"
+#include "reverse.h"
+#include "sumtab.h"
+#include "threadpool.h"
+
+#define DIFF_BLOCK	32
+
+struct TileGrid {
+	int size;
+	int tiles_per_row, tiles_per_face;
+	unsigned char *tiles;
+	int num_dirty;
+};
+
+struct UpdateJob {
+	const Image *src;
+	const SumTable *sat;
+	Image *faces;
+	const ConvOptions *opt;
+	unsigned char *tiles;
+	std::vector<int> dirty;		// indices of the dirty tiles
+	int tiles_per_row, tiles_per_face;
+	char *tilebuf;				// one tile per thread
+	size_t tilebuf_size;
+	std::atomic<int> num_changed;
+	std::vector<int> rows;		// panorama rows each dirty tile reads with FILTER_AREA (2 per tile)
+};
+
+int cube_tile_count(int size)
+{
+	int tiles_per_row = (size + CONV_TILE_SIZE - 1) / CONV_TILE_SIZE;
+	return tiles_per_row * tiles_per_row * 6;
+}
+
+bool diff_images(const Image *img, const Image *prev, std::vector<DirtyRect> *rects)
+{
+	if(img->width != prev->width || img->height != prev->height || img->fmt != prev->fmt) {
+		fprintf(stderr, "diff_images: the previous image must have the same size and pixel format\n");
+		return false;
+	}
+
+	size_t texel_size = pixel_size(img->fmt);
+	size_t row_size = img->width * texel_size;
+	int num_blocks = (img->width + DIFF_BLOCK - 1) / DIFF_BLOCK;
+	std::vector<bool> dirty;
+
+	for(int y=0; y<img->height; y+=DIFF_BLOCK) {
+		int h = img->height - y < DIFF_BLOCK ? img->height - y : DIFF_BLOCK;
+		dirty.assign(num_blocks, false);
+
+		for(int i=0; i<h; i++) {
+			const char *row = (const char*)image_row(img, y + i);
+			const char *prev_row = (const char*)image_row(prev, y + i);
+			if(memcmp(row, prev_row, row_size) == 0) continue;
+
+			for(int j=0; j<num_blocks; j++) {
+				if(dirty[j]) continue;
+				int x = j * DIFF_BLOCK;
+				int w = img->width - x < DIFF_BLOCK ? img->width - x : DIFF_BLOCK;
+				if(memcmp(row + x * texel_size, prev_row + x * texel_size, w * texel_size) != 0) {
+					dirty[j] = true;
+				}
+			}
+		}
+
+		// runs of dirty blocks become one rectangle
+		int i = 0;
+		while(i < num_blocks) {
+			if(!dirty[i]) {
+				i++;
+				continue;
+			}
+			int start = i;
+			while(i < num_blocks && dirty[i]) i++;
+
+			DirtyRect rect;
+			rect.x = start * DIFF_BLOCK;
+			rect.y = y;
+			rect.width = (i * DIFF_BLOCK < img->width ? i * DIFF_BLOCK : img->width) - rect.x;
+			rect.height = h;
+			rects->push_back(rect);
+		}
+	}
+	return true;
+}
+
+// marks the tiles within a texel of face coordinates s, t
+static void mark_texel(TileGrid *grid, int face, float s, float t)
+{
+	int size = grid->size;
+	int x0 = (int)floor(s * size - 1.0f);
+	int y0 = (int)floor(t * size - 1.0f);
+	int x1 = (int)floor(s * size + 1.0f);
+	int y1 = (int)floor(t * size + 1.0f);
+	x0 = x0 < 0 ? 0 : x0 / CONV_TILE_SIZE;
+	y0 = y0 < 0 ? 0 : y0 / CONV_TILE_SIZE;
+	x1 = (x1 >= size ? size - 1 : x1) / CONV_TILE_SIZE;
+	y1 = (y1 >= size ? size - 1 : y1) / CONV_TILE_SIZE;
+
+	for(int i=y0; i<=y1; i++) {
+		for(int j=x0; j<=x1; j++) {
+			unsigned char *tile = grid->tiles + face * grid->tiles_per_face + i * grid->tiles_per_row + j;
+			if(*tile == TILE_CLEAN) {
+				*tile = TILE_DIRTY;
+				grid->num_dirty++;
+			}
+		}
+	}
+}
+
+// marks the tiles around the point at panorama texel coordinates sx, sy
+static void mark_point(TileGrid *grid, int src_width, int src_height, float uoffs, double sx, double sy)
+{
+	double theta = (sx / src_width - uoffs - 0.5) * 2.0 * M_PI;
+	float cos_theta = cos(theta);
+	float sin_theta = sin(theta);
+
+	unsigned char face;
+	float s, t;
+	equirect_span_to_cube(src_height, 0, 0, 1, &cos_theta, &sin_theta, &face, &s, &t, sy - 0.5);
+	mark_texel(grid, face, s, t);
+}
+
+int mark_dirty_tiles(const DirtyRect *rects, int count, int src_width, int src_height, int size,
+		const ConvOptions *opt, unsigned char *tiles)
+{
+	TileGrid grid;
+	grid.size = size;
+	grid.tiles_per_row = (size + CONV_TILE_SIZE - 1) / CONV_TILE_SIZE;
+	grid.tiles_per_face = grid.tiles_per_row * grid.tiles_per_row;
+	grid.tiles = tiles;
+	grid.num_dirty = 0;
+
+	int num_tiles = grid.tiles_per_face * 6;
+	float uoffs = opt->yaw / 360.0f;
+
+	// panorama coordinates of the tile centers
+	std::vector<float> center_x(num_tiles), center_y(num_tiles);
+	for(int i=0; i<num_tiles; i++) {
+		int face = i / grid.tiles_per_face;
+		int tile = i % grid.tiles_per_face;
+		int x = (tile % grid.tiles_per_row) * CONV_TILE_SIZE + CONV_TILE_SIZE / 2;
+		int y = (tile / grid.tiles_per_row) * CONV_TILE_SIZE + CONV_TILE_SIZE / 2;
+		if(x >= size) x = size - 1;
+		if(y >= size) y = size - 1;
+
+		float u, v;
+		calc_span_coords(face, size, y, x, 1, opt, &u, &v);
+		center_x[i] = (u - floor(u)) * src_width;
+		center_y[i] = v * src_height;
+	}
+
+	/* reach of the filter in panorama texels. A face texel spans at most
+	 * 2 / size radians (at the center of the face), which is texel_rows rows,
+	 * and the area filter averages over that, and over texel_rows / sin(phi)
+	 * columns, which grows towards the poles.
+	 */
+	bool area = opt->filter == FILTER_AREA;
+	double reach = get_filter_taps(opt->filter) / 2 + 1;
+	double texel_rows = 2.0 * src_height / (M_PI * size);
+
+	// edge points are sampled closer than the smallest face texel, at the corners
+	double texel_angle = 2.0 / (3.0 * size);
+	double src_angle = M_PI / src_height > 2.0 * M_PI / src_width ? M_PI / src_height : 2.0 * M_PI / src_width;
+	double step = texel_angle < src_angle ? texel_angle / src_angle : 1.0;
+
+	for(int i=0; i<count; i++) {
+		const DirtyRect *rect = rects + i;
+
+		double margin_y = reach + (area ? texel_rows + 1.0 : 0.0);
+		double y0 = rect->y - margin_y;
+		double y1 = rect->y + rect->height + margin_y;
+		if(y0 < 0.0) y0 = 0.0;
+		if(y1 > src_height) y1 = src_height;
+
+		double margin_x = reach;
+		if(area) {
+			double sin_phi = fmin(sin(y0 / src_height * M_PI), sin(y1 / src_height * M_PI));
+			margin_x += sin_phi > 0.0 ? texel_rows * src_width / (2.0 * src_height) / sin_phi + 1.0 : src_width;
+		}
+		bool full_width = rect->width + 2.0 * margin_x >= src_width;
+		double x0 = full_width ? 0.0 : rect->x - margin_x;
+		double x1 = full_width ? src_width : rect->x + rect->width + margin_x;
+
+		int nx = (int)ceil((x1 - x0) / step);
+		for(int j=0; j<=nx; j++) {
+			double x = x0 + (x1 - x0) * j / nx;
+			mark_point(&grid, src_width, src_height, uoffs, x, y0);
+			mark_point(&grid, src_width, src_height, uoffs, x, y1);
+		}
+		if(!full_width) {
+			int ny = (int)ceil((y1 - y0) / step);
+			for(int j=0; j<=ny; j++) {
+				double y = y0 + (y1 - y0) * j / ny;
+				mark_point(&grid, src_width, src_height, uoffs, x0, y);
+				mark_point(&grid, src_width, src_height, uoffs, x1, y);
+			}
+		}
+
+		// tiles entirely inside the rectangle
+		for(int j=0; j<num_tiles; j++) {
+			if(tiles[j] != TILE_CLEAN || center_y[j] < y0 || center_y[j] > y1) {
+				continue;
+			}
+			double dx = fmod(center_x[j] - x0, (double)src_width);
+			if(dx < 0.0) dx += src_width;
+			if(full_width || dx <= x1 - x0) {
+				tiles[j] = TILE_DIRTY;
+				grid.num_dirty++;
+			}
+		}
+	}
+	return grid.num_dirty;
+}
+
+static void calc_tile_rect(const UpdateJob *job, int tile, int *face, int *x, int *y, int *w, int *h)
+{
+	int size = job->faces[0].width;
+
+	*face = tile / job->tiles_per_face;
+	*x = (tile % job->tiles_per_face % job->tiles_per_row) * CONV_TILE_SIZE;
+	*y = (tile % job->tiles_per_face / job->tiles_per_row) * CONV_TILE_SIZE;
+	*w = size - *x < CONV_TILE_SIZE ? size - *x : CONV_TILE_SIZE;
+	*h = size - *y < CONV_TILE_SIZE ? size - *y : CONV_TILE_SIZE;
+}
+
+static void tile_rows_task(int idx, int thread, void *cls)
+{
+	UpdateJob *job = (UpdateJob*)cls;
+	int face, x, y, w, h;
+
+	calc_tile_rect(job, job->dirty[idx], &face, &x, &y, &w, &h);
+	area_tile_rows(job->src->width, job->src->height, face, job->faces[0].width, x, y, w, h,
+			job->opt, &job->rows[idx * 2], &job->rows[idx * 2 + 1]);
+}
+
+static void update_tile_task(int idx, int thread, void *cls)
+{
+	UpdateJob *job = (UpdateJob*)cls;
+	int tile = job->dirty[idx];
+	int face, x, y, w, h;
+
+	calc_tile_rect(job, tile, &face, &x, &y, &w, &h);
+	Image *dest = job->faces + face;
+	int size = dest->width;
+
+	size_t texel_size = pixel_size(dest->fmt);
+	char *buf = job->tilebuf + thread * job->tilebuf_size;
+
+	if(job->sat) {
+		convert_tile_area_buf(job->sat, face, size, x, y, w, h, job->opt, dest->fmt, buf, w);
+	} else {
+		convert_tile_buf(job->src, face, size, x, y, w, h, job->opt, buf, w);
+	}
+
+	bool changed = false;
+	for(int i=0; i<h; i++) {
+		char *row = (char*)image_row(dest, y + i) + x * texel_size;
+		const char *new_row = buf + i * w * texel_size;
+		if(memcmp(row, new_row, w * texel_size) != 0) {
+			memcpy(row, new_row, w * texel_size);
+			changed = true;
+		}
+	}
+	if(changed) {
+		job->tiles[tile] = TILE_CHANGED;
+		job->num_changed++;
+	}
+}
+
+int update_cubemap(const Image *src, Image *faces, const ConvOptions *opt, unsigned char *tiles,
+		ThreadPool *tpool)
+{
+	for(int i=0; i<6; i++) {
+		if(faces[i].fmt != src->fmt) {
+			fprintf(stderr, "update_cubemap: faces must have the same pixel format as the source\n");
+			return -1;
+		}
+	}
+
+	UpdateJob job;
+	job.src = src;
+	job.sat = 0;
+	job.faces = faces;
+	job.opt = opt;
+	job.tiles = tiles;
+	job.tiles_per_row = (faces[0].width + CONV_TILE_SIZE - 1) / CONV_TILE_SIZE;
+	job.tiles_per_face = job.tiles_per_row * job.tiles_per_row;
+	job.num_changed = 0;
+
+	int num_tiles = job.tiles_per_face * 6;
+	for(int i=0; i<num_tiles; i++) {
+		if(tiles[i] == TILE_DIRTY) {
+			job.dirty.push_back(i);
+		}
+	}
+	if(job.dirty.empty()) {
+		return 0;
+	}
+
+	/* the summed-area table only covers the rows the dirty tiles read, which
+	 * for a small retouch is a fraction of the panorama
+	 */
+	SumTable sat;
+	if(opt->filter == FILTER_AREA) {
+		job.rows.resize(job.dirty.size() * 2);
+		if(tpool) {
+			tpool->run(job.dirty.size(), tile_rows_task, &job);
+		} else {
+			for(size_t i=0; i<job.dirty.size(); i++) {
+				tile_rows_task(i, 0, &job);
+			}
+		}
+
+		int row0 = src->height, row1 = 0;
+		for(size_t i=0; i<job.dirty.size(); i++) {
+			if(job.rows[i * 2] < row0) row0 = job.rows[i * 2];
+			if(job.rows[i * 2 + 1] > row1) row1 = job.rows[i * 2 + 1];
+		}
+		if(!build_sumtab_rows(&sat, src, row0, row1 - row0, tpool)) {
+			return -1;
+		}
+		job.sat = &sat;
+	}
+
+	int num_threads = tpool ? tpool->get_num_threads() : 1;
+	job.tilebuf_size = CONV_TILE_SIZE * CONV_TILE_SIZE * pixel_size(src->fmt);
+	job.tilebuf = new char[job.tilebuf_size * num_threads];
+
+	if(tpool) {
+		tpool->run(job.dirty.size(), update_tile_task, &job);
+	} else {
+		for(size_t i=0; i<job.dirty.size(); i++) {
+			update_tile_task(i, 0, &job);
+		}
+	}
+
+	delete [] job.tilebuf;
+	if(job.sat) {
+		destroy_sumtab(&sat);
+	}
+	return job.num_changed;
+}
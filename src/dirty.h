@@ -0,0 +1,70 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DIRTY_H_
+#define DIRTY_H_
+
+#include <vector>
+#include "convert.h"
+
+/* incremental re-conversion: after a panorama is retouched, only the face
+ * tiles which read from the modified regions are converted again, into the
+ * faces of the previous conversion.
+ */
+
+// rectangle of modified panorama texels
+struct DirtyRect {
+	int x, y, width, height;
+};
+
+// per tile state, tiles being numbered like in convert_cubemap (by face, then row)
+enum {
+	TILE_CLEAN,
+	TILE_DIRTY,		// reads from a dirty rectangle, and must be converted again
+	TILE_CHANGED	// converted again, and different from before
+};
+
+// number of CONV_TILE_SIZE tiles of all six size x size faces
+int cube_tile_count(int size);
+
+/* finds the modified regions of a panorama by comparing it to its previous
+ * version, which must have the same size and pixel format. The regions are
+ * made of 32x32 blocks, merged horizontally.
+ */
+bool diff_images(const Image *img, const Image *prev, std::vector<DirtyRect> *rects);
+
+/* marks the tiles of size x size faces which read from the dirty rectangles
+ * of a src_width x src_height panorama, when converted with opt. The
+ * rectangles are grown by the reach of the filter, and mapped to the faces
+ * with the inverse mapping (see equirect_span_to_cube): points along their
+ * edges, closer than a face texel apart, mark the tiles they land in, and
+ * tiles whose center maps inside a rectangle are marked too, for regions
+ * larger than a tile. tiles has cube_tile_count entries, and isn't cleared.
+ * Returns the number of dirty tiles.
+ */
+int mark_dirty_tiles(const DirtyRect *rects, int count, int src_width, int src_height, int size,
+		const ConvOptions *opt, unsigned char *tiles);
+
+/* converts the dirty tiles again, with the same results as convert_cubemap.
+ * The faces are only written to where the new texels differ from the old
+ * ones, and the tiles that differ are marked TILE_CHANGED. Returns the
+ * number of changed tiles, or -1 on failure.
+ */
+int update_cubemap(const Image *src, Image *faces, const ConvOptions *opt, unsigned char *tiles,
+		ThreadPool *tpool = 0);
+
+#endif	// DIRTY_H_
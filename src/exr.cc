@@ -0,0 +1,184 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exr.h"
+#include "convert.h"
+
+enum { EXR_UINT, EXR_HALF, EXR_FLOAT };
+
+// EXR files are little endian, these append values to a byte buffer
+static unsigned char *put_u32(unsigned char *ptr, unsigned int x)
+{
+	ptr[0] = x & 0xff;
+	ptr[1] = (x >> 8) & 0xff;
+	ptr[2] = (x >> 16) & 0xff;
+	ptr[3] = x >> 24;
+	return ptr + 4;
+}
+
+static unsigned char *put_u64(unsigned char *ptr, unsigned long long x)
+{
+	ptr = put_u32(ptr, x & 0xffffffff);
+	return put_u32(ptr, x >> 32);
+}
+
+static unsigned char *put_float(unsigned char *ptr, float x)
+{
+	unsigned int bits;
+	memcpy(&bits, &x, 4);
+	return put_u32(ptr, bits);
+}
+
+static unsigned char *put_str(unsigned char *ptr, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	memcpy(ptr, s, len);
+	return ptr + len;
+}
+
+static unsigned char *put_attr(unsigned char *ptr, const char *name, const char *type, int size)
+{
+	ptr = put_str(ptr, name);
+	ptr = put_str(ptr, type);
+	return put_u32(ptr, size);
+}
+
+// half channel values, 8bit values are scaled to [0, 1]
+static inline half exr_half(half x) { return x; }
+static inline half exr_half(float x) { return float_to_half(x); }
+static inline half exr_half(unsigned char x) { return float_to_half(x / 255.0f); }
+
+// converts a scanline to the EXR layout: all B values, then all G, then all R
+template <typename T>
+static unsigned char *put_line(unsigned char *ptr, const T *pixels, int width, int pixtype)
+{
+	for(int c=2; c>=0; c--) {
+		const T *src = pixels + c;
+		for(int i=0; i<width; i++) {
+			if(pixtype == EXR_FLOAT) {
+				ptr = put_float(ptr, PixelOps<T>::to_float(*src));
+			} else {
+				half h = exr_half(*src);
+				*ptr++ = h & 0xff;
+				*ptr++ = h >> 8;
+			}
+			src += 3;
+		}
+	}
+	return ptr;
+}
+
+bool save_exr(const Image *img, const char *fname)
+{
+	int pixtype = img->fmt == PIXFMT_RGBF ? EXR_FLOAT : EXR_HALF;
+	int chan_size = pixtype == EXR_FLOAT ? 4 : 2;
+	size_t line_size = (size_t)img->width * 3 * chan_size;
+
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	unsigned char hdr[512];
+	unsigned char *ptr = hdr;
+
+	ptr = put_u32(ptr, 20000630);	// magic number
+	ptr = put_u32(ptr, 2);			// version 2, single part scanline file
+
+	ptr = put_attr(ptr, "channels", "chlist", 3 * 18 + 1);
+	static const char *chan_names[] = {"B", "G", "R"};
+	for(int i=0; i<3; i++) {
+		ptr = put_str(ptr, chan_names[i]);
+		ptr = put_u32(ptr, pixtype);
+		ptr = put_u32(ptr, 0);		// pLinear and reserved
+		ptr = put_u32(ptr, 1);		// x/y sampling
+		ptr = put_u32(ptr, 1);
+	}
+	*ptr++ = 0;
+
+	ptr = put_attr(ptr, "compression", "compression", 1);
+	*ptr++ = 0;		// NO_COMPRESSION, one scanline per block
+
+	for(int i=0; i<2; i++) {
+		ptr = put_attr(ptr, i == 0 ? "dataWindow" : "displayWindow", "box2i", 16);
+		ptr = put_u32(ptr, 0);
+		ptr = put_u32(ptr, 0);
+		ptr = put_u32(ptr, img->width - 1);
+		ptr = put_u32(ptr, img->height - 1);
+	}
+
+	ptr = put_attr(ptr, "lineOrder", "lineOrder", 1);
+	*ptr++ = 0;		// INCREASING_Y
+	ptr = put_attr(ptr, "pixelAspectRatio", "float", 4);
+	ptr = put_float(ptr, 1.0f);
+	ptr = put_attr(ptr, "screenWindowCenter", "v2f", 8);
+	ptr = put_float(ptr, 0.0f);
+	ptr = put_float(ptr, 0.0f);
+	ptr = put_attr(ptr, "screenWindowWidth", "float", 4);
+	ptr = put_float(ptr, 1.0f);
+	*ptr++ = 0;		// end of header
+
+	fwrite(hdr, 1, ptr - hdr, fp);
+
+	// line offset table, followed by the scanline blocks: y, size, data
+	unsigned long long offs = (ptr - hdr) + (unsigned long long)img->height * 8;
+	for(int i=0; i<img->height; i++) {
+		unsigned char entry[8];
+		put_u64(entry, offs);
+		fwrite(entry, 1, 8, fp);
+		offs += 8 + line_size;
+	}
+
+	unsigned char *line = (unsigned char*)malloc(8 + line_size);
+	if(!line) {
+		fprintf(stderr, "save_exr: failed to allocate scanline buffer\n");
+		fclose(fp);
+		return false;
+	}
+
+	bool res = true;
+	for(int i=0; i<img->height; i++) {
+		const void *row = image_row(img, i);
+		ptr = put_u32(line, i);
+		ptr = put_u32(ptr, line_size);
+
+		switch(img->fmt) {
+		case PIXFMT_RGB8:
+			put_line(ptr, (const unsigned char*)row, img->width, pixtype);
+			break;
+		case PIXFMT_RGBH:
+			put_line(ptr, (const half*)row, img->width, pixtype);
+			break;
+		default:
+			put_line(ptr, (const float*)row, img->width, pixtype);
+		}
+
+		if(fwrite(line, 1, 8 + line_size, fp) != 8 + line_size) {
+			fprintf(stderr, "failed to write %s\n", fname);
+			res = false;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	return res;
+}
@@ -0,0 +1,30 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef EXR_H_
+#define EXR_H_
+
+struct Image;
+
+/* writes an uncompressed scanline OpenEXR file. PIXFMT_RGBH images are
+ * written as half channels directly from the image, PIXFMT_RGBF images as
+ * float channels, and PIXFMT_RGB8 images are scaled to [0, 1] and written as
+ * half channels.
+ */
+bool save_exr(const Image *img, const char *fname);
+
+#endif	// EXR_H_
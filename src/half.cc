@@ -0,0 +1,50 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "half.h"
+
+void half_to_float_array(float *dest, const half *src, size_t count)
+{
+#ifdef __F16C__
+	while(count >= 4) {
+		__m128i h = _mm_loadl_epi64((const __m128i*)src);
+		_mm_storeu_ps(dest, _mm_cvtph_ps(h));
+		src += 4;
+		dest += 4;
+		count -= 4;
+	}
+#endif
+	for(size_t i=0; i<count; i++) {
+		dest[i] = half_to_float(src[i]);
+	}
+}
+
+void float_to_half_array(half *dest, const float *src, size_t count)
+{
+#ifdef __F16C__
+	while(count >= 4) {
+		__m128i h = _mm_cvtps_ph(_mm_loadu_ps(src), _MM_FROUND_TO_NEAREST_INT);
+		_mm_storel_epi64((__m128i*)dest, h);
+		src += 4;
+		dest += 4;
+		count -= 4;
+	}
+#endif
+	for(size_t i=0; i<count; i++) {
+		dest[i] = float_to_half(src[i]);
+	}
+}
@@ -0,0 +1,92 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HALF_H_
+#define HALF_H_
+
+#include <stddef.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+/* IEEE 754 half precision floats, stored as their bit patterns. Conversions
+ * use the F16C instructions when compiled for them (see the simd option in
+ * the Makefile), and round to nearest even either way, so both produce the
+ * same results.
+ */
+typedef unsigned short half;
+
+static inline float half_to_float(half h)
+{
+#ifdef __F16C__
+	return _cvtsh_ss(h);
+#else
+	static const union { unsigned int u; float f; } magic = {113 << 23};
+	static const unsigned int shifted_exp = 0x7c00 << 13;
+	union { unsigned int u; float f; } res;
+
+	res.u = (h & 0x7fff) << 13;
+	unsigned int exp = res.u & shifted_exp;
+	res.u += (127 - 15) << 23;
+
+	if(exp == shifted_exp) {
+		res.u += (128 - 16) << 23;		// inf/nan
+	} else if(exp == 0) {
+		res.u += 1 << 23;				// denormal, renormalize
+		res.f -= magic.f;
+	}
+	res.u |= (h & 0x8000) << 16;
+	return res.f;
+#endif
+}
+
+static inline half float_to_half(float x)
+{
+#ifdef __F16C__
+	return _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT);
+#else
+	static const unsigned int f32_inf = 255 << 23;
+	static const unsigned int f16_max = (127 + 16) << 23;
+	static const union { unsigned int u; float f; } denorm_magic = {((127 - 15) + (23 - 10) + 1) << 23};
+	union { unsigned int u; float f; } in;
+	half res;
+
+	in.f = x;
+	unsigned int sign = in.u & 0x80000000;
+	in.u ^= sign;
+
+	if(in.u >= f16_max) {
+		res = in.u > f32_inf ? 0x7e00 : 0x7c00;		// nan, or inf on overflow
+	} else if(in.u < (113 << 23)) {
+		// denormal result, let the float addition do the rounding
+		in.f += denorm_magic.f;
+		res = in.u - denorm_magic.u;
+	} else {
+		unsigned int mant_odd = (in.u >> 13) & 1;
+		in.u += ((unsigned int)(15 - 127) << 23) + 0xfff;
+		in.u += mant_odd;
+		res = in.u >> 13;
+	}
+	return res | (sign >> 16);
+#endif
+}
+
+// bulk conversions, 4 values at a time with F16C
+void half_to_float_array(float *dest, const half *src, size_t count);
+void float_to_half_array(half *dest, const float *src, size_t count);
+
+#endif	// HALF_H_
@@ -0,0 +1,416 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "ktx.h"
+#include "convert.h"
+#include "bcenc.h"
+#include "prefilter.h"
+
+// GL enums, without requiring the GL headers
+#define KTX_UNSIGNED_BYTE	0x1401
+#define KTX_FLOAT			0x1406
+#define KTX_HALF_FLOAT		0x140b
+#define KTX_RGB				0x1907
+#define KTX_RGB8			0x8051
+#define KTX_RGB32F			0x8815
+#define KTX_RGB16F			0x881b
+#define KTX_RGBA			0x1908
+#define KTX_BC1_RGB			0x83f0	// GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define KTX_BC7_RGBA		0x8e8c	// GL_COMPRESSED_RGBA_BPTC_UNORM
+#define KTX_BC6H_RGB_UF		0x8e8f	// GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT
+
+// Vulkan formats for KTX2
+#define VK_R8G8B8_UNORM			23
+#define VK_R16G16B16_SFLOAT		90
+#define VK_R32G32B32_SFLOAT		106
+#define VK_BC1_RGB_UNORM		131
+#define VK_BC6H_UFLOAT			143
+#define VK_BC7_UNORM			145
+
+// data format descriptor values (Khronos Data Format Specification)
+#define DF_MODEL_RGBSDA		1
+#define DF_MODEL_BC1A		128
+#define DF_MODEL_BC6H		133
+#define DF_MODEL_BC7		134
+#define DF_PRIMARIES_BT709	1
+#define DF_TRANSFER_LINEAR	1
+#define DF_SAMPLE_SIGNED	0x40
+#define DF_SAMPLE_FLOAT		0x80
+#define DF_FLOAT_ONE		0x3f800000
+#define DF_FLOAT_MINUS_ONE	0xbf800000
+
+static const unsigned char ktx_ident[12] = {
+	0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n'
+};
+
+static const unsigned char ktx2_ident[12] = {
+	0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+};
+
+// what a KTX2 file needs to know about the faces, compressed or not
+struct Ktx2Format {
+	unsigned int vkformat;
+	unsigned int type_size;
+	unsigned int block_size;	// bytes per texel, or per 4x4 block
+	bool compressed;
+	unsigned int model;
+	unsigned int channel_bits;	// per channel for uncompressed formats
+	bool is_float;
+};
+
+static FILE *open_ktx(const char *fname, unsigned int type, unsigned int type_size,
+		unsigned int format, unsigned int intfmt, unsigned int base_fmt, int size, int levels)
+{
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return 0;
+	}
+
+	unsigned int hdr[13];
+	hdr[0] = 0x04030201;	// endianness
+	hdr[1] = type;
+	hdr[2] = type_size;
+	hdr[3] = format;
+	hdr[4] = intfmt;
+	hdr[5] = base_fmt;
+	hdr[6] = size;
+	hdr[7] = size;
+	hdr[8] = 0;				// depth
+	hdr[9] = 0;				// array elements
+	hdr[10] = 6;			// faces
+	hdr[11] = levels;		// mip levels
+	hdr[12] = 0;			// key/value data
+
+	fwrite(ktx_ident, 1, sizeof ktx_ident, fp);
+	fwrite(hdr, sizeof hdr, 1, fp);
+	return fp;
+}
+
+static bool write_ktx_level(FILE *fp, const Image *faces)
+{
+	int size = faces[0].width;
+	size_t row_size = size * pixel_size(faces[0].fmt);
+	size_t row_pad = (4 - row_size % 4) % 4;	// rows are 4-byte aligned
+
+	// image size of a single face for non-array cubemaps
+	unsigned int face_size = (row_size + row_pad) * size;
+	if(fwrite(&face_size, sizeof face_size, 1, fp) != 1) {
+		return false;
+	}
+
+	static const unsigned char zeros[4] = {0};
+
+	for(int i=0; i<6; i++) {
+		if(!row_pad && faces[i].pitch == (long)row_size) {
+			if(fwrite(faces[i].pixels, 1, face_size, fp) != face_size) {
+				return false;
+			}
+			continue;
+		}
+		for(int j=0; j<size; j++) {
+			if(fwrite(image_row(faces + i, j), 1, row_size, fp) != row_size) {
+				return false;
+			}
+			fwrite(zeros, 1, row_pad, fp);
+		}
+		// face sizes are already a multiple of 4, no cube or mip padding needed
+	}
+	return true;
+}
+
+bool save_ktx_cubemap(const Image *faces, const char *fname, const Image *mips, int levels)
+{
+	unsigned int type, type_size, intfmt;
+
+	switch(faces[0].fmt) {
+	case PIXFMT_RGB8:
+		type = KTX_UNSIGNED_BYTE;
+		type_size = 1;
+		intfmt = KTX_RGB8;
+		break;
+	case PIXFMT_RGBH:
+		type = KTX_HALF_FLOAT;
+		type_size = 2;
+		intfmt = KTX_RGB16F;
+		break;
+	default:
+		type = KTX_FLOAT;
+		type_size = 4;
+		intfmt = KTX_RGB32F;
+	}
+
+	FILE *fp = open_ktx(fname, type, type_size, KTX_RGB, intfmt, KTX_RGB, faces[0].width, levels);
+	if(!fp) {
+		return false;
+	}
+
+	bool res = write_ktx_level(fp, faces);
+	for(int i=1; i<levels && res; i++) {
+		res = write_ktx_level(fp, mips + (i - 1) * 6);
+	}
+
+	if(!res) {
+		fprintf(stderr, "failed to write %s\n", fname);
+	}
+	fclose(fp);
+	return res;
+}
+
+bool save_ktx_compressed(const BlockImage *faces, const char *fname, int levels)
+{
+	unsigned int intfmt, base_fmt = KTX_RGB;
+
+	switch(faces[0].format) {
+	case COMP_BC1:
+		intfmt = KTX_BC1_RGB;
+		break;
+	case COMP_BC7:
+		intfmt = KTX_BC7_RGBA;
+		base_fmt = KTX_RGBA;
+		break;
+	default:
+		intfmt = KTX_BC6H_RGB_UF;
+	}
+
+	// compressed formats have no type and format
+	FILE *fp = open_ktx(fname, 0, 1, 0, intfmt, base_fmt, faces[0].width, levels);
+	if(!fp) {
+		return false;
+	}
+
+	bool res = true;
+	for(int i=0; i<levels && res; i++) {
+		// blocks are 8 or 16 bytes, no padding needed
+		const BlockImage *level = faces + i * 6;
+		unsigned int face_size = level->size;
+		res = fwrite(&face_size, sizeof face_size, 1, fp) == 1;
+
+		for(int j=0; j<6 && res; j++) {
+			res = fwrite(level[j].data, 1, level[j].size, fp) == level[j].size;
+		}
+	}
+
+	if(!res) {
+		fprintf(stderr, "failed to write %s\n", fname);
+	}
+	fclose(fp);
+	return res;
+}
+
+static void ktx2_format(Ktx2Format *kf, int pixfmt, int comp)
+{
+	memset(kf, 0, sizeof *kf);
+
+	switch(comp) {
+	case COMP_BC1:
+		kf->vkformat = VK_BC1_RGB_UNORM;
+		kf->block_size = 8;
+		kf->model = DF_MODEL_BC1A;
+		break;
+	case COMP_BC7:
+		kf->vkformat = VK_BC7_UNORM;
+		kf->block_size = 16;
+		kf->model = DF_MODEL_BC7;
+		break;
+	case COMP_BC6H:
+		kf->vkformat = VK_BC6H_UFLOAT;
+		kf->block_size = 16;
+		kf->model = DF_MODEL_BC6H;
+		kf->is_float = true;
+		break;
+	default:
+		break;
+	}
+	if(comp != COMP_NONE) {
+		kf->type_size = 1;
+		kf->compressed = true;
+		return;
+	}
+
+	kf->model = DF_MODEL_RGBSDA;
+	switch(pixfmt) {
+	case PIXFMT_RGB8:
+		kf->vkformat = VK_R8G8B8_UNORM;
+		kf->type_size = 1;
+		break;
+	case PIXFMT_RGBH:
+		kf->vkformat = VK_R16G16B16_SFLOAT;
+		kf->type_size = 2;
+		kf->is_float = true;
+		break;
+	default:
+		kf->vkformat = VK_R32G32B32_SFLOAT;
+		kf->type_size = 4;
+		kf->is_float = true;
+	}
+	kf->channel_bits = kf->type_size * 8;
+	kf->block_size = kf->type_size * 3;
+}
+
+/* basic data format descriptor: one sample per channel for RGB formats, and a
+ * single sample covering the block for compressed formats. Returns the size
+ * in 32bit words.
+ */
+static int ktx2_dfd(const Ktx2Format *kf, unsigned int *dfd)
+{
+	int num_samples = kf->compressed ? 1 : 3;
+	unsigned int block_words = 6 + num_samples * 4;
+
+	dfd[0] = (block_words + 1) * 4;		// total size
+	dfd[1] = 0;							// Khronos vendor, basic descriptor type
+	dfd[2] = 2 | (block_words * 4) << 16;	// version 1.3, block size
+	dfd[3] = kf->model | DF_PRIMARIES_BT709 << 8 | DF_TRANSFER_LINEAR << 16;
+	dfd[4] = kf->compressed ? 3 | 3 << 8 : 0;	// block dimensions - 1
+	dfd[5] = kf->block_size;			// bytes in plane 0
+	dfd[6] = 0;
+
+	unsigned int *sample = dfd + 7;
+	if(kf->compressed) {
+		unsigned int bits = kf->block_size * 8;
+		sample[0] = (bits - 1) << 16 | (kf->is_float ? DF_SAMPLE_FLOAT : 0) << 24;
+		sample[1] = 0;
+		sample[2] = kf->is_float ? DF_FLOAT_MINUS_ONE : 0;
+		sample[3] = kf->is_float ? DF_FLOAT_ONE : 0xffffffff;
+		return block_words + 1;
+	}
+
+	for(int i=0; i<3; i++) {
+		unsigned int type = i;		// R, G, B channels
+		if(kf->is_float) type |= DF_SAMPLE_FLOAT | DF_SAMPLE_SIGNED;
+
+		sample[0] = i * kf->channel_bits | (kf->channel_bits - 1) << 16 | type << 24;
+		sample[1] = 0;
+		sample[2] = kf->is_float ? DF_FLOAT_MINUS_ONE : 0;
+		sample[3] = kf->is_float ? DF_FLOAT_ONE : (1u << kf->channel_bits) - 1;
+		sample += 4;
+	}
+	return block_words + 1;
+}
+
+/* the faces of each level are either Images, or BlockImages if blocks is set,
+ * six per level. The whole file is written front to back: the level index
+ * points to the levels, which are stored from the smallest to the largest,
+ * each one aligned to its texel or block size (and 4 bytes).
+ */
+static bool write_ktx2(const char *fname, const Image *const *levels, const BlockImage *blocks,
+		int num_levels, const Ktx2Format *kf)
+{
+	int size = blocks ? blocks[0].width : levels[0][0].width;
+
+	unsigned int dfd[32];
+	int dfd_words = ktx2_dfd(kf, dfd);
+
+	unsigned int align = kf->block_size;
+	while(align % 4) align += kf->block_size;
+
+	// level offsets and sizes, levels are stored from the smallest
+	unsigned long long level_offs[PREFILTER_MAX_LEVELS], level_size[PREFILTER_MAX_LEVELS];
+	unsigned long long offs = 80 + 24 * num_levels + dfd_words * 4;
+	for(int i=num_levels-1; i>=0; i--) {
+		int lsize = size >> i > 0 ? size >> i : 1;
+		if(blocks) {
+			level_size[i] = blocks[i * 6].size * 6;
+		} else {
+			level_size[i] = (unsigned long long)lsize * lsize * kf->block_size * 6;
+		}
+		offs = (offs + align - 1) / align * align;
+		level_offs[i] = offs;
+		offs += level_size[i];
+	}
+
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	unsigned int hdr[17];
+	hdr[0] = kf->vkformat;
+	hdr[1] = kf->type_size;
+	hdr[2] = size;
+	hdr[3] = size;
+	hdr[4] = 0;						// depth
+	hdr[5] = 0;						// array layers
+	hdr[6] = 6;						// faces
+	hdr[7] = num_levels;
+	hdr[8] = 0;						// no supercompression
+	hdr[9] = 80 + 24 * num_levels;	// data format descriptor offset and size
+	hdr[10] = dfd_words * 4;
+	hdr[11] = 0;					// no key/value data
+	hdr[12] = 0;
+	memset(hdr + 13, 0, 16);		// no supercompression global data
+
+	fwrite(ktx2_ident, 1, sizeof ktx2_ident, fp);
+	fwrite(hdr, sizeof hdr, 1, fp);
+	for(int i=0; i<num_levels; i++) {
+		unsigned long long entry[3] = {level_offs[i], level_size[i], level_size[i]};
+		fwrite(entry, sizeof entry, 1, fp);
+	}
+	fwrite(dfd, 4, dfd_words, fp);
+
+	static const unsigned char zeros[16] = {0};
+	offs = 80 + 24 * num_levels + dfd_words * 4;
+
+	bool res = true;
+	for(int i=num_levels-1; i>=0 && res; i--) {
+		res = fwrite(zeros, 1, level_offs[i] - offs, fp) == level_offs[i] - offs;
+
+		for(int j=0; j<6 && res; j++) {
+			if(blocks) {
+				const BlockImage *face = blocks + i * 6 + j;
+				res = fwrite(face->data, 1, face->size, fp) == face->size;
+				continue;
+			}
+			// rows are tightly packed, without the padding of KTX 1
+			const Image *face = levels[i] + j;
+			size_t row_size = face->width * kf->block_size;
+			for(int k=0; k<face->height && res; k++) {
+				res = fwrite(image_row(face, k), 1, row_size, fp) == row_size;
+			}
+		}
+		offs = level_offs[i] + level_size[i];
+	}
+
+	if(!res) {
+		fprintf(stderr, "failed to write %s\n", fname);
+	}
+	fclose(fp);
+	return res;
+}
+
+bool save_ktx2_cubemap(const Image *faces, const char *fname, const Image *mips, int levels)
+{
+	Ktx2Format kf;
+	ktx2_format(&kf, faces[0].fmt, COMP_NONE);
+
+	const Image *level_faces[PREFILTER_MAX_LEVELS];
+	level_faces[0] = faces;
+	for(int i=1; i<levels; i++) {
+		level_faces[i] = mips + (i - 1) * 6;
+	}
+	return write_ktx2(fname, level_faces, 0, levels, &kf);
+}
+
+bool save_ktx2_compressed(const BlockImage *faces, const char *fname, int levels)
+{
+	Ktx2Format kf;
+	ktx2_format(&kf, 0, faces[0].format);
+	return write_ktx2(fname, 0, faces, levels, &kf);
+}
@@ -0,0 +1,49 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef KTX_H_
+#define KTX_H_
+
+struct Image;
+struct BlockImage;
+
+/* writes the six faces as a single KTX cubemap. The pixels are written as
+ * they are in memory, in native byte order (which KTX readers handle through
+ * the endianness field): PIXFMT_RGBH faces as GL_RGB16F/GL_HALF_FLOAT,
+ * PIXFMT_RGBF as GL_RGB32F/GL_FLOAT and PIXFMT_RGB8 as GL_RGB8/GL_UNSIGNED_BYTE.
+ * Faces are in GL order, top row first. mips are the faces of mip levels 1 to
+ * levels - 1, six per level (see prefilter.h), or null for a single level.
+ */
+bool save_ktx_cubemap(const Image *faces, const char *fname, const Image *mips = 0, int levels = 1);
+
+/* writes block compressed faces (see bcenc.h) as a single KTX cubemap, as
+ * GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGBA_BPTC_UNORM or
+ * GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT. faces are the six faces of every
+ * level, level by level.
+ */
+bool save_ktx_compressed(const BlockImage *faces, const char *fname, int levels = 1);
+
+/* KTX2 versions of the above, as VK_FORMAT_R8G8B8_UNORM, R16G16B16_SFLOAT,
+ * R32G32B32_SFLOAT, BC1_RGB_UNORM_BLOCK, BC7_UNORM_BLOCK or
+ * BC6H_UFLOAT_BLOCK, with tightly packed rows. The level index comes first,
+ * followed by the levels from the smallest to the largest, so the file is
+ * written front to back, and can be read in one go.
+ */
+bool save_ktx2_cubemap(const Image *faces, const char *fname, const Image *mips = 0, int levels = 1);
+bool save_ktx2_compressed(const BlockImage *faces, const char *fname, int levels = 1);
+
+#endif	// KTX_H_
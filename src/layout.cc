@@ -0,0 +1,67 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "layout.h"
+
+const char *layout_name[NUM_LAYOUTS] = {"separate", "cross", "strip", "3x2"};
+
+// atlas size in faces, and the cell of each face
+static const int layout_cols[NUM_LAYOUTS] = {1, 4, 6, 3};
+static const int layout_rows[NUM_LAYOUTS] = {1, 3, 1, 2};
+
+static const int face_cell[NUM_LAYOUTS][6][2] = {
+	{{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}},
+	{{2, 1}, {0, 1}, {1, 0}, {1, 2}, {1, 1}, {3, 1}},
+	{{0, 0}, {1, 0}, {2, 0}, {3, 0}, {4, 0}, {5, 0}},
+	{{0, 0}, {1, 0}, {2, 0}, {0, 1}, {1, 1}, {2, 1}}
+};
+
+int find_layout(const char *name)
+{
+	for(int i=0; i<NUM_LAYOUTS; i++) {
+		if(strcmp(name, layout_name[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void layout_atlas_size(int layout, int face_size, int *width, int *height)
+{
+	*width = face_size * layout_cols[layout];
+	*height = face_size * layout_rows[layout];
+}
+
+int layout_face_size(int layout, int width, int height)
+{
+	int size = width / layout_cols[layout];
+	if(size * layout_cols[layout] != width || size * layout_rows[layout] != height) {
+		return 0;
+	}
+	return size;
+}
+
+void layout_faces(int layout, const Image *atlas, Image *faces)
+{
+	int size = atlas->width / layout_cols[layout];
+
+	for(int i=0; i<6; i++) {
+		const int *cell = face_cell[layout][i];
+		image_view(faces + i, atlas, cell[0] * size, cell[1] * size, size, size);
+	}
+}
@@ -0,0 +1,55 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LAYOUT_H_
+#define LAYOUT_H_
+
+#include "convert.h"
+
+/* cubemap atlas layouts, all faces in a single image:
+ * - cross: horizontal cross, 4x3 faces, +Y above and -Y below +Z, with -X, +Z,
+ *   +X, -Z in the middle row. The unused cells are black.
+ * - strip: 6x1 faces, in the order +X, -X, +Y, -Y, +Z, -Z
+ * - 3x2: +X, -X, +Y in the top row and -Y, +Z, -Z in the bottom row
+ * Faces keep the orientation they have as separate images.
+ */
+enum {
+	LAYOUT_SEPARATE,	// six separate images
+	LAYOUT_CROSS,
+	LAYOUT_STRIP,
+	LAYOUT_3X2,
+
+	NUM_LAYOUTS
+};
+
+extern const char *layout_name[NUM_LAYOUTS];
+
+// returns the layout with the given name, or -1
+int find_layout(const char *name);
+
+// atlas size in texels, for the given face size
+void layout_atlas_size(int layout, int face_size, int *width, int *height);
+
+// face size of an atlas, or 0 if the atlas size doesn't match the layout
+int layout_face_size(int layout, int width, int height);
+
+/* initializes faces as views into their places in the atlas (see
+ * image_view), so converting into them writes the atlas directly
+ */
+void layout_faces(int layout, const Image *atlas, Image *faces);
+
+#endif	// LAYOUT_H_
@@ -33,6 +33,10 @@ static int win_width, win_height;
 
 int main(int argc, char **argv)
 {
+	if(app_headless(argc, argv)) {
+		return app_batch(argc, argv);
+	}
+
 	glutInitWindowSize(1024, 768);
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_MULTISAMPLE);
@@ -0,0 +1,142 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "pipeline.h"
+
+struct StageQueue {
+	std::deque<int> jobs;
+	int depth;
+	bool closed;	// the previous stage is done
+	std::condition_variable cond_push, cond_pop;
+};
+
+struct Pipeline {
+	PipelineStage *stages;
+	int num_stages;
+	void *cls;
+
+	std::mutex mutex;
+	StageQueue *queues;		// queues[i] feeds stage i, queues[0] is unused
+};
+
+static double get_time_sec()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void push_job(Pipeline *pl, int qidx, int job)
+{
+	StageQueue *q = pl->queues + qidx;
+
+	std::unique_lock<std::mutex> lock(pl->mutex);
+	while((int)q->jobs.size() >= q->depth) {
+		q->cond_push.wait(lock);
+	}
+	q->jobs.push_back(job);
+	q->cond_pop.notify_one();
+}
+
+// returns -1 when the queue is closed and empty
+static int pop_job(Pipeline *pl, int qidx)
+{
+	StageQueue *q = pl->queues + qidx;
+
+	std::unique_lock<std::mutex> lock(pl->mutex);
+	while(q->jobs.empty() && !q->closed) {
+		q->cond_pop.wait(lock);
+	}
+	if(q->jobs.empty()) {
+		return -1;
+	}
+	int job = q->jobs.front();
+	q->jobs.pop_front();
+	q->cond_push.notify_one();
+	return job;
+}
+
+static void close_queue(Pipeline *pl, int qidx)
+{
+	StageQueue *q = pl->queues + qidx;
+
+	std::lock_guard<std::mutex> lock(pl->mutex);
+	q->closed = true;
+	q->cond_pop.notify_all();
+}
+
+static void run_job(Pipeline *pl, int sidx, int job)
+{
+	PipelineStage *stage = pl->stages + sidx;
+
+	double t0 = get_time_sec();
+	bool res = stage->func(job, pl->cls);
+	stage->busy_time += get_time_sec() - t0;
+
+	if(res && sidx < pl->num_stages - 1) {
+		push_job(pl, sidx + 1, job);
+	}
+}
+
+static void stage_main(Pipeline *pl, int sidx)
+{
+	int job;
+	while((job = pop_job(pl, sidx)) >= 0) {
+		run_job(pl, sidx, job);
+	}
+	if(sidx < pl->num_stages - 1) {
+		close_queue(pl, sidx + 1);
+	}
+}
+
+void run_pipeline(int num_jobs, PipelineStage *stages, int num_stages, void *cls)
+{
+	Pipeline pl;
+	pl.stages = stages;
+	pl.num_stages = num_stages;
+	pl.cls = cls;
+	pl.queues = new StageQueue[num_stages];
+
+	for(int i=0; i<num_stages; i++) {
+		pl.queues[i].depth = stages[i].queue_depth > 0 ? stages[i].queue_depth : 1;
+		pl.queues[i].closed = false;
+		stages[i].busy_time = 0.0;
+	}
+
+	// the calling thread runs the first stage
+	std::vector<std::thread> threads;
+	for(int i=1; i<num_stages; i++) {
+		threads.push_back(std::thread(stage_main, &pl, i));
+	}
+
+	for(int i=0; i<num_jobs; i++) {
+		run_job(&pl, 0, i);
+	}
+	if(num_stages > 1) {
+		close_queue(&pl, 1);
+	}
+
+	for(size_t i=0; i<threads.size(); i++) {
+		threads[i].join();
+	}
+	delete [] pl.queues;
+}
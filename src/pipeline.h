@@ -0,0 +1,44 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+/* stage callback args: (int job index, void *cls). Returns false if the job
+ * failed, in which case it's not passed on to the next stage, and the stage
+ * must release whatever the job holds.
+ */
+typedef bool (*StageFunc)(int, void*);
+
+struct PipelineStage {
+	StageFunc func;
+	/* max number of jobs waiting in front of this stage (>= 1), which bounds
+	 * how far the previous stage can run ahead. Unused for the first stage.
+	 */
+	int queue_depth;
+
+	double busy_time;	// set by run_pipeline: seconds spent in func
+};
+
+/* bounded pipeline: every stage runs in its own thread and processes jobs
+ * 0 to num_jobs - 1 in order, handing each one to the next stage through a
+ * queue, so different jobs are in different stages at the same time. The
+ * steady-state throughput is that of the slowest stage.
+ */
+void run_pipeline(int num_jobs, PipelineStage *stages, int num_stages, void *cls);
+
+#endif	// PIPELINE_H_
@@ -0,0 +1,492 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <new>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PREFILTER_SSE
+#endif
+#include "prefilter.h"
+#include "convert.h"
+#include "threadpool.h"
+
+/* source pyramid level: six faces of size x size texels, 4 floats per texel
+ * (RGB and padding), so that texels are loaded and blended as SIMD vectors
+ */
+struct SrcLevel {
+	int size;
+	float *pix;
+};
+
+// GGX samples of a level in tangent space (N = +Z), structure of arrays
+struct SampleTable {
+	int count;
+	float *x, *y, *z;
+	float *lod;		// source pyramid level
+};
+
+struct PrefilterTile {
+	int level, face;
+	int x, y, w, h;
+};
+
+struct PrefilterJob {
+	const Image *faces;
+	Image *mips;
+	SrcLevel *src;
+	int num_src;
+	SampleTable *tables;	// per destination level, starting at level 1
+	std::vector<PrefilterTile> tiles;
+	float *scratch;			// rotated sample directions, per thread
+	int scratch_size;
+};
+
+// face coordinate selection per face: source axis and sign of s and t (see reverse.cc)
+static const int sc_axis[6] = {2, 2, 0, 0, 0, 0};
+static const float sc_sign[6] = {-1, 1, 1, 1, 1, -1};
+static const int tc_axis[6] = {1, 1, 2, 2, 1, 1};
+static const float tc_sign[6] = {-1, -1, 1, -1, -1, -1};
+
+#ifdef PREFILTER_SSE
+typedef __m128 vec4;
+
+static inline vec4 v4_zero() { return _mm_setzero_ps(); }
+static inline vec4 v4_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void v4_store(float *p, vec4 v) { _mm_storeu_ps(p, v); }
+
+static inline vec4 v4_lerp(vec4 a, vec4 b, float t)
+{
+	return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), _mm_set1_ps(t)));
+}
+
+static inline vec4 v4_madd(vec4 acc, vec4 a, float s)
+{
+	return _mm_add_ps(acc, _mm_mul_ps(a, _mm_set1_ps(s)));
+}
+#else
+struct vec4 {
+	float v[4];
+};
+
+static inline vec4 v4_zero() { vec4 r = {{0, 0, 0, 0}}; return r; }
+static inline vec4 v4_load(const float *p) { vec4 r = {{p[0], p[1], p[2], p[3]}}; return r; }
+static inline void v4_store(float *p, vec4 v) { memcpy(p, v.v, sizeof v.v); }
+
+static inline vec4 v4_lerp(vec4 a, vec4 b, float t)
+{
+	for(int i=0; i<4; i++) {
+		a.v[i] += (b.v[i] - a.v[i]) * t;
+	}
+	return a;
+}
+
+static inline vec4 v4_madd(vec4 acc, vec4 a, float s)
+{
+	for(int i=0; i<4; i++) {
+		acc.v[i] += a.v[i] * s;
+	}
+	return acc;
+}
+#endif
+
+int mip_level_count(int size)
+{
+	int count = 1;
+	while(size > 1) {
+		size /= 2;
+		count++;
+	}
+	return count;
+}
+
+template <typename T>
+static void src_face_task(int idx, int thread, void *cls)
+{
+	PrefilterJob *job = (PrefilterJob*)cls;
+	const Image *face = job->faces + idx;
+	int size = job->src[0].size;
+	float *dest = job->src[0].pix + (size_t)idx * size * size * 4;
+
+	for(int i=0; i<size; i++) {
+		const T *sptr = (const T*)image_row(face, i);
+		for(int j=0; j<size; j++) {
+			dest[0] = PixelOps<T>::to_float(sptr[0]);
+			dest[1] = PixelOps<T>::to_float(sptr[1]);
+			dest[2] = PixelOps<T>::to_float(sptr[2]);
+			dest[3] = 0.0f;
+			sptr += 3;
+			dest += 4;
+		}
+	}
+}
+
+static void src_face_task_any(int idx, int thread, void *cls)
+{
+	PrefilterJob *job = (PrefilterJob*)cls;
+	if(job->faces[0].fmt == PIXFMT_RGB8) {
+		src_face_task<unsigned char>(idx, thread, cls);
+	} else if(job->faces[0].fmt == PIXFMT_RGBH) {
+		src_face_task<half>(idx, thread, cls);
+	} else {
+		src_face_task<float>(idx, thread, cls);
+	}
+}
+
+// 2x2 box filter of a face of the previous pyramid level, task per face
+static void downsample_task(int idx, int thread, void *cls)
+{
+	PrefilterJob *job = (PrefilterJob*)cls;
+	const SrcLevel *src = job->src + job->num_src - 2;
+	const SrcLevel *dest = src + 1;
+	int ssize = src->size;
+	int dsize = dest->size;
+	const float *spix = src->pix + (size_t)idx * ssize * ssize * 4;
+	float *dptr = dest->pix + (size_t)idx * dsize * dsize * 4;
+
+	for(int i=0; i<dsize; i++) {
+		const float *row0 = spix + (size_t)i * 2 * ssize * 4;
+		const float *row1 = i * 2 + 1 < ssize ? row0 + ssize * 4 : row0;
+		for(int j=0; j<dsize; j++) {
+			int x0 = j * 2 * 4;
+			int x1 = j * 2 + 1 < ssize ? x0 + 4 : x0;
+			vec4 a = v4_lerp(v4_load(row0 + x0), v4_load(row0 + x1), 0.5f);
+			vec4 b = v4_lerp(v4_load(row1 + x0), v4_load(row1 + x1), 0.5f);
+			v4_store(dptr, v4_lerp(a, b, 0.5f));
+			dptr += 4;
+		}
+	}
+}
+
+static void run_tasks(int count, TaskFunc func, PrefilterJob *job, ThreadPool *tpool)
+{
+	if(tpool) {
+		tpool->run(count, func, job);
+	} else {
+		for(int i=0; i<count; i++) {
+			func(i, 0, job);
+		}
+	}
+}
+
+// the first count levels of the pyramid
+static bool build_src_pyramid(PrefilterJob *job, int count, ThreadPool *tpool)
+{
+	int size = job->faces[0].width;
+
+	job->src = new SrcLevel[count];
+	job->num_src = 0;
+
+	for(int i=0; i<count; i++) {
+		SrcLevel *lev = job->src + i;
+		lev->size = size;
+		if(!(lev->pix = new (std::nothrow) float[(size_t)size * size * 6 * 4])) {
+			fprintf(stderr, "failed to allocate %dx%d prefiltering pyramid level\n", size, size);
+			return false;
+		}
+		job->num_src++;
+
+		run_tasks(6, i ? downsample_task : src_face_task_any, job, tpool);
+		size /= 2;
+	}
+	return true;
+}
+
+static inline float radical_inverse(unsigned int bits)
+{
+	bits = (bits << 16) | (bits >> 16);
+	bits = ((bits & 0x55555555) << 1) | ((bits & 0xaaaaaaaa) >> 1);
+	bits = ((bits & 0x33333333) << 2) | ((bits & 0xcccccccc) >> 2);
+	bits = ((bits & 0x0f0f0f0f) << 4) | ((bits & 0xf0f0f0f0) >> 4);
+	bits = ((bits & 0x00ff00ff) << 8) | ((bits & 0xff00ff00) >> 8);
+	return (float)bits * 2.3283064365386963e-10f;
+}
+
+/* GGX importance samples of the reflected direction L for N = V = +Z. The pdf
+ * of L is D(H) / 4 in that case, and the pyramid level of a sample is picked
+ * so that a texel covers about the solid angle of the sample, 1 / (pdf * count),
+ * biased by one level for smoother results (GPU Gems 3, ch. 20).
+ */
+static void calc_sample_table(SampleTable *tab, int count, float roughness, int base_size,
+		int num_src)
+{
+	float alpha = roughness * roughness;
+	float a2 = alpha * alpha;
+	float texel_solid_angle = 4.0f * M_PI / (6.0f * base_size * base_size);
+
+	tab->x = new float[count * 4];
+	tab->y = tab->x + count;
+	tab->z = tab->y + count;
+	tab->lod = tab->z + count;
+	tab->count = 0;
+
+	for(int i=0; i<count; i++) {
+		float phi = 2.0f * M_PI * (float)i / (float)count;
+		float xi = radical_inverse(i);
+		float cos_theta_h = sqrt((1.0f - xi) / (1.0f + (a2 - 1.0f) * xi));
+		float sin_theta_h = sqrt(1.0f - cos_theta_h * cos_theta_h);
+
+		// L = reflect(-V, H) = 2 (N.H) H - N
+		float lz = 2.0f * cos_theta_h * cos_theta_h - 1.0f;
+		if(lz <= 0.0f) continue;
+
+		float d = (a2 - 1.0f) * cos_theta_h * cos_theta_h + 1.0f;
+		float pdf = a2 / (M_PI * d * d) * 0.25f;
+		float sample_solid_angle = 1.0f / (pdf * count);
+		float lod = 0.5f * log2(sample_solid_angle / texel_solid_angle) + 1.0f;
+
+		int n = tab->count++;
+		tab->x[n] = 2.0f * cos_theta_h * sin_theta_h * cos(phi);
+		tab->y[n] = 2.0f * cos_theta_h * sin_theta_h * sin(phi);
+		tab->z[n] = lz;
+		tab->lod[n] = lod < 0.0f ? 0.0f : (lod > num_src - 1 ? num_src - 1 : lod);
+	}
+}
+
+static inline vec4 fetch_src(const SrcLevel *lev, int face, float s, float t)
+{
+	int size = lev->size;
+	float fx = s * size - 0.5f;
+	float fy = t * size - 0.5f;
+	fx = fx < 0.0f ? 0.0f : (fx > size - 1 ? size - 1 : fx);
+	fy = fy < 0.0f ? 0.0f : (fy > size - 1 ? size - 1 : fy);
+
+	int x0 = (int)fx;
+	int y0 = (int)fy;
+	float tx = fx - x0;
+	float ty = fy - y0;
+	int x1 = x0 < size - 1 ? x0 + 1 : x0;
+	int y1 = y0 < size - 1 ? y0 + 1 : y0;
+
+	const float *pix = lev->pix + (size_t)face * size * size * 4;
+	const float *row0 = pix + (size_t)y0 * size * 4;
+	const float *row1 = pix + (size_t)y1 * size * 4;
+
+	vec4 a = v4_lerp(v4_load(row0 + x0 * 4), v4_load(row0 + x1 * 4), tx);
+	vec4 b = v4_lerp(v4_load(row1 + x0 * 4), v4_load(row1 + x1 * 4), tx);
+	return v4_lerp(a, b, ty);
+}
+
+template <typename T>
+static void prefilter_tile(const PrefilterJob *job, const PrefilterTile *tile, float *scratch)
+{
+	const SampleTable *tab = job->tables + tile->level - 1;
+	Image *dest = job->mips + (tile->level - 1) * 6 + tile->face;
+	int size = dest->width;
+	int count = tab->count;
+
+	float *dx = scratch;
+	float *dy = dx + count;
+	float *dz = dy + count;
+
+	for(int i=0; i<tile->h; i++) {
+		int y = tile->y + i;
+		T *pptr = (T*)image_row(dest, y) + tile->x * 3;
+
+		for(int j=0; j<tile->w; j++) {
+			float n[3];
+			cube_face_dir(tile->face, (tile->x + j + 0.5f) / size, (y + 0.5f) / size, n);
+			float len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			n[0] /= len;
+			n[1] /= len;
+			n[2] /= len;
+
+			// tangent frame around n
+			float up[3] = {0, 0, 1};
+			if(fabs(n[2]) > 0.999f) {
+				up[0] = 1.0f;
+				up[2] = 0.0f;
+			}
+			float tx = up[1] * n[2] - up[2] * n[1];
+			float ty = up[2] * n[0] - up[0] * n[2];
+			float tz = up[0] * n[1] - up[1] * n[0];
+			len = sqrt(tx * tx + ty * ty + tz * tz);
+			tx /= len;
+			ty /= len;
+			tz /= len;
+			float bx = n[1] * tz - n[2] * ty;
+			float by = n[2] * tx - n[0] * tz;
+			float bz = n[0] * ty - n[1] * tx;
+
+			// rotate all the samples to world space (vectorized by the compiler)
+			for(int k=0; k<count; k++) {
+				dx[k] = tx * tab->x[k] + bx * tab->y[k] + n[0] * tab->z[k];
+				dy[k] = ty * tab->x[k] + by * tab->y[k] + n[1] * tab->z[k];
+				dz[k] = tz * tab->x[k] + bz * tab->y[k] + n[2] * tab->z[k];
+			}
+
+			vec4 acc = v4_zero();
+			float wsum = 0.0f;
+			for(int k=0; k<count; k++) {
+				float dir[3] = {dx[k], dy[k], dz[k]};
+				float ax = fabs(dir[0]);
+				float ay = fabs(dir[1]);
+				float az = fabs(dir[2]);
+				int axis = ax >= ay ? (ax >= az ? 0 : 2) : (ay >= az ? 1 : 2);
+				int f = axis * 2 + (dir[axis] < 0.0f);
+
+				float inv_ma = 0.5f / fabs(dir[axis]);
+				float s = dir[sc_axis[f]] * sc_sign[f] * inv_ma + 0.5f;
+				float t = dir[tc_axis[f]] * tc_sign[f] * inv_ma + 0.5f;
+
+				float lod = tab->lod[k];
+				int l0 = (int)lod;
+				float lt = lod - l0;
+				vec4 col = fetch_src(job->src + l0, f, s, t);
+				if(lt > 0.0f) {
+					col = v4_lerp(col, fetch_src(job->src + l0 + 1, f, s, t), lt);
+				}
+
+				float w = tab->z[k];	// N.L
+				acc = v4_madd(acc, col, w);
+				wsum += w;
+			}
+
+			float res[4];
+			v4_store(res, acc);
+			float s = 1.0f / wsum;
+			res[0] *= s;
+			res[1] *= s;
+			res[2] *= s;
+			PixelOps<T>::from_float(pptr, res);
+			pptr += 3;
+		}
+	}
+}
+
+static void prefilter_task(int idx, int thread, void *cls)
+{
+	PrefilterJob *job = (PrefilterJob*)cls;
+	const PrefilterTile *tile = &job->tiles[idx];
+	float *scratch = job->scratch + (size_t)thread * job->scratch_size;
+
+	if(job->faces[0].fmt == PIXFMT_RGB8) {
+		prefilter_tile<unsigned char>(job, tile, scratch);
+	} else if(job->faces[0].fmt == PIXFMT_RGBH) {
+		prefilter_tile<half>(job, tile, scratch);
+	} else {
+		prefilter_tile<float>(job, tile, scratch);
+	}
+}
+
+bool prefilter_ggx(const Image *faces, Image *mips, int levels, int samples, ThreadPool *tpool)
+{
+	if(levels <= 1) return true;
+
+	PrefilterJob job;
+	job.faces = faces;
+	job.mips = mips;
+	job.tables = 0;
+	job.scratch = 0;
+	bool res = false;
+
+	int size = faces[0].width;
+	if(build_src_pyramid(&job, mip_level_count(size), tpool)) {
+		job.tables = new SampleTable[levels - 1];
+		for(int i=1; i<levels; i++) {
+			calc_sample_table(job.tables + i - 1, samples, (float)i / (float)(levels - 1), size,
+					job.num_src);
+		}
+
+		// the tiles of all the levels are processed in a single run
+		for(int i=1; i<levels; i++) {
+			int lsize = mips[(i - 1) * 6].width;
+			for(int face=0; face<6; face++) {
+				for(int y=0; y<lsize; y+=CONV_TILE_SIZE) {
+					for(int x=0; x<lsize; x+=CONV_TILE_SIZE) {
+						PrefilterTile tile;
+						tile.level = i;
+						tile.face = face;
+						tile.x = x;
+						tile.y = y;
+						tile.w = lsize - x < CONV_TILE_SIZE ? lsize - x : CONV_TILE_SIZE;
+						tile.h = lsize - y < CONV_TILE_SIZE ? lsize - y : CONV_TILE_SIZE;
+						job.tiles.push_back(tile);
+					}
+				}
+			}
+		}
+
+		int num_threads = tpool ? tpool->get_num_threads() : 1;
+		job.scratch_size = samples * 3;
+		job.scratch = new float[(size_t)job.scratch_size * num_threads];
+
+		run_tasks(job.tiles.size(), prefilter_task, &job, tpool);
+		res = true;
+	}
+
+	if(job.tables) {
+		for(int i=0; i<levels - 1; i++) {
+			delete [] job.tables[i].x;
+		}
+		delete [] job.tables;
+	}
+	delete [] job.scratch;
+	for(int i=0; i<job.num_src; i++) {
+		delete [] job.src[i].pix;
+	}
+	delete [] job.src;
+	return res;
+}
+
+// converts a face of the pyramid back to the pixel format of the mip level, task per face
+template <typename T>
+static void mip_face_task(int idx, int thread, void *cls)
+{
+	PrefilterJob *job = (PrefilterJob*)cls;
+	const SrcLevel *src = job->src + idx / 6 + 1;
+	Image *dest = job->mips + idx;
+	const float *sptr = src->pix + (size_t)(idx % 6) * src->size * src->size * 4;
+
+	for(int i=0; i<src->size; i++) {
+		T *dptr = (T*)image_row(dest, i);
+		for(int j=0; j<src->size; j++) {
+			PixelOps<T>::from_float(dptr, sptr);
+			dptr += 3;
+			sptr += 4;
+		}
+	}
+}
+
+bool box_mip_chain(const Image *faces, Image *mips, int levels, ThreadPool *tpool)
+{
+	if(levels <= 1) return true;
+
+	PrefilterJob job;
+	job.faces = faces;
+	job.mips = mips;
+	bool res = build_src_pyramid(&job, levels, tpool);
+
+	if(res) {
+		TaskFunc func = mip_face_task<float>;
+		if(faces[0].fmt == PIXFMT_RGB8) {
+			func = mip_face_task<unsigned char>;
+		} else if(faces[0].fmt == PIXFMT_RGBH) {
+			func = mip_face_task<half>;
+		}
+		run_tasks((levels - 1) * 6, func, &job, tpool);
+	}
+
+	for(int i=0; i<job.num_src; i++) {
+		delete [] job.src[i].pix;
+	}
+	delete [] job.src;
+	return res;
+}
@@ -0,0 +1,51 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PREFILTER_H_
+#define PREFILTER_H_
+
+struct Image;
+class ThreadPool;
+
+// enough for faces up to 32k
+#define PREFILTER_MAX_LEVELS	16
+
+// number of mip levels of size x size faces, down to 1x1
+int mip_level_count(int size);
+
+/* GGX prefiltered specular mip chain, for image based lighting with the split
+ * sum approximation (N = V = R). Level 0 is the cubemap itself, and level i
+ * is prefiltered for roughness i / (levels - 1), alpha being the roughness
+ * squared. mips are the faces of levels 1 to levels - 1, six per level in GL
+ * face order, already initialized to max(size >> i, 1) texels and the pixel
+ * format of the faces.
+ *
+ * Each level is importance sampled with a table of GGX samples precomputed
+ * once per level from a Hammersley sequence. The samples are read from a box
+ * filtered float pyramid of the faces, trilinearly, at the pyramid level
+ * matching the solid angle each sample covers (filtered importance sampling),
+ * which avoids the sparkles of bright texels falling between samples. All
+ * levels are split into tiles and processed in parallel.
+ */
+bool prefilter_ggx(const Image *faces, Image *mips, int levels, int samples, ThreadPool *tpool = 0);
+
+/* plain mip chain, each level a 2x2 box filter of the previous one, like
+ * glGenerateMipmap. mips are initialized as for prefilter_ggx.
+ */
+bool box_mip_chain(const Image *faces, Image *mips, int levels, ThreadPool *tpool = 0);
+
+#endif	// PREFILTER_H_
@@ -0,0 +1,408 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rawimg.h"
+#include "convert.h"
+
+#define MAX_HEADER	512
+
+// next whitespace separated token of a PNM header, skipping comments
+static const char *next_token(const char *ptr, const char *end, char *buf, int bufsz)
+{
+	for(;;) {
+		while(ptr < end && isspace(*ptr)) ptr++;
+		if(ptr < end && *ptr == '#') {
+			while(ptr < end && *ptr != '\n') ptr++;
+			continue;
+		}
+		break;
+	}
+
+	int len = 0;
+	while(ptr < end && !isspace(*ptr) && len < bufsz - 1) {
+		buf[len++] = *ptr++;
+	}
+	buf[len] = 0;
+	return len ? ptr : 0;
+}
+
+static bool big_endian_host()
+{
+	unsigned int x = 1;
+	return *(unsigned char*)&x == 0;
+}
+
+static bool open_raw(RawImage *raw, const char *fname, bool verbose, bool write);
+
+bool open_raw_image(RawImage *raw, const char *fname)
+{
+	return open_raw(raw, fname, true, false);
+}
+
+static bool open_raw(RawImage *raw, const char *fname, bool verbose, bool write)
+{
+	if((raw->fd = open(fname, write ? O_RDWR : O_RDONLY)) == -1) {
+		if(verbose) fprintf(stderr, "failed to open %s\n", fname);
+		return false;
+	}
+
+	char hdr[MAX_HEADER];
+	int sz = pread(raw->fd, hdr, sizeof hdr, 0);
+	const char *ptr = hdr, *end = hdr + (sz > 0 ? sz : 0);
+
+	char tok[4][32];
+	for(int i=0; i<4; i++) {
+		if(!(ptr = next_token(ptr, end, tok[i], sizeof tok[i]))) {
+			break;
+		}
+	}
+	// exactly one whitespace character between the header and the pixels
+	if(!ptr || ptr >= end || (strcmp(tok[0], "P6") != 0 && strcmp(tok[0], "PF") != 0)) {
+		if(verbose) fprintf(stderr, "%s: not a raw PPM (P6) or PFM (PF) file\n", fname);
+		close(raw->fd);
+		return false;
+	}
+
+	raw->width = atoi(tok[1]);
+	raw->height = atoi(tok[2]);
+	raw->data_offs = ptr + 1 - hdr;
+
+	if(tok[0][1] == '6') {
+		if(atoi(tok[3]) != 255) {
+			if(verbose) fprintf(stderr, "%s: only 8bit PPM files are supported\n", fname);
+			close(raw->fd);
+			return false;
+		}
+		raw->fmt = PIXFMT_RGB8;
+		raw->bottom_up = false;
+		raw->swap = false;
+	} else {
+		// the sign of the scale gives the byte order: negative for little endian
+		raw->fmt = PIXFMT_RGBF;
+		raw->bottom_up = true;
+		raw->swap = (atof(tok[3]) < 0.0) == big_endian_host();
+	}
+
+	if(raw->width <= 0 || raw->height <= 0) {
+		if(verbose) fprintf(stderr, "%s: invalid image size\n", fname);
+		close(raw->fd);
+		return false;
+	}
+	return true;
+}
+
+bool raw_image_suffix(const char *fname, int fmt)
+{
+	const char *suffix = strrchr(fname, '.');
+	if(!suffix) return false;
+
+	if(fmt == PIXFMT_RGB8) {
+		return strcasecmp(suffix, ".ppm") == 0;
+	}
+	return strcasecmp(suffix, ".pfm") == 0;
+}
+
+bool create_raw_image(RawImage *raw, const char *fname, int width, int height, int fmt)
+{
+	if(!raw_image_suffix(fname, fmt)) {
+		fprintf(stderr, "create_raw_image: %s: %s images can only be written as %s files\n", fname,
+				fmt == PIXFMT_RGB8 ? "8bit" : "floating point", fmt == PIXFMT_RGB8 ? "ppm" : "pfm");
+		return false;
+	}
+
+	if((raw->fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	char hdr[64];
+	if(fmt == PIXFMT_RGB8) {
+		sprintf(hdr, "P6\n%d %d\n255\n", width, height);
+		raw->fmt = PIXFMT_RGB8;
+		raw->bottom_up = false;
+	} else {
+		// pad the scale with zeros to align the pixels to 4 bytes, for mapping
+		int len = sprintf(hdr, "PF\n%d %d\n%s", width, height, big_endian_host() ? "1.0" : "-1.0");
+		while((len + 1) % 4) {
+			hdr[len++] = '0';
+		}
+		strcpy(hdr + len, "\n");
+		raw->fmt = PIXFMT_RGBF;
+		raw->bottom_up = true;
+	}
+	raw->width = width;
+	raw->height = height;
+	raw->swap = false;
+	raw->data_offs = strlen(hdr);
+
+	if(write(raw->fd, hdr, raw->data_offs) != raw->data_offs) {
+		fprintf(stderr, "failed to write %s: %s\n", fname, strerror(errno));
+		close(raw->fd);
+		return false;
+	}
+
+	/* set the full size upfront, rectangles can be written in any order. The
+	 * blocks are allocated now, so that running out of space fails here,
+	 * instead of raising SIGBUS when a mapped output is written. Filesystems
+	 * without fallocate support get a sparse file.
+	 */
+	long long size = raw->data_offs + (long long)width * height * pixel_size(raw->fmt);
+	int err = posix_fallocate(raw->fd, 0, size);
+	if(err == EOPNOTSUPP) {
+		err = ftruncate(raw->fd, size) == -1 ? errno : 0;
+	}
+	if(err) {
+		fprintf(stderr, "failed to allocate %lld bytes for %s: %s\n", size, fname, strerror(err));
+		close(raw->fd);
+		unlink(fname);
+		return false;
+	}
+	return true;
+}
+
+void close_raw_image(RawImage *raw)
+{
+	if(raw->fd >= 0) {
+		close(raw->fd);
+		raw->fd = -1;
+	}
+}
+
+static long long row_offset(const RawImage *raw, int y)
+{
+	int row = raw->bottom_up ? raw->height - 1 - y : y;
+	return raw->data_offs + (long long)row * raw->width * pixel_size(raw->fmt);
+}
+
+static bool read_fully(int fd, void *buf, size_t size, long long offs)
+{
+	char *ptr = (char*)buf;
+	while(size > 0) {
+		ssize_t rd = pread(fd, ptr, size, offs);
+		if(rd <= 0) return false;
+		ptr += rd;
+		offs += rd;
+		size -= rd;
+	}
+	return true;
+}
+
+static bool write_fully(int fd, const void *buf, size_t size, long long offs)
+{
+	const char *ptr = (const char*)buf;
+	while(size > 0) {
+		ssize_t wr = pwrite(fd, ptr, size, offs);
+		if(wr <= 0) return false;
+		ptr += wr;
+		offs += wr;
+		size -= wr;
+	}
+	return true;
+}
+
+static void swap_floats(float *data, size_t count)
+{
+	unsigned char *ptr = (unsigned char*)data;
+	for(size_t i=0; i<count; i++) {
+		unsigned char tmp = ptr[0]; ptr[0] = ptr[3]; ptr[3] = tmp;
+		tmp = ptr[1]; ptr[1] = ptr[2]; ptr[2] = tmp;
+		ptr += 4;
+	}
+}
+
+bool read_raw_rows(RawImage *raw, int y, int count, int fmt, void *dest)
+{
+	size_t nval = (size_t)raw->width * 3;
+	size_t row_size = raw->width * pixel_size(raw->fmt);
+	float *tmp = 0;
+
+	if(fmt != raw->fmt) {
+		if(fmt != PIXFMT_RGBH || raw->fmt != PIXFMT_RGBF) {
+			fprintf(stderr, "read_raw_rows: unsupported pixel format conversion\n");
+			return false;
+		}
+		if(!(tmp = (float*)malloc(row_size))) {
+			fprintf(stderr, "read_raw_rows: failed to allocate row buffer\n");
+			return false;
+		}
+	}
+
+	// top-down files can be read in one go
+	if(!raw->bottom_up && !tmp) {
+		if(!read_fully(raw->fd, dest, row_size * count, row_offset(raw, y))) {
+			fprintf(stderr, "failed to read rows %d-%d\n", y, y + count - 1);
+			return false;
+		}
+		return true;
+	}
+
+	char *dptr = (char*)dest;
+	for(int i=0; i<count; i++) {
+		void *buf = tmp ? (void*)tmp : (void*)dptr;
+		if(!read_fully(raw->fd, buf, row_size, row_offset(raw, y + i))) {
+			fprintf(stderr, "failed to read row %d\n", y + i);
+			free(tmp);
+			return false;
+		}
+		if(raw->swap) {
+			swap_floats((float*)buf, nval);
+		}
+		if(tmp) {
+			float_to_half_array((half*)dptr, tmp, nval);
+		}
+		dptr += raw->width * pixel_size(fmt);
+	}
+
+	free(tmp);
+	return true;
+}
+
+bool write_raw_rect(RawImage *raw, int x, int y, int w, int h, int fmt, const void *pixels, int pitch)
+{
+	size_t texel_size = pixel_size(raw->fmt);
+	size_t src_texel_size = pixel_size(fmt);
+	float tmp[64 * 3];
+
+	if(fmt != raw->fmt && (fmt != PIXFMT_RGBH || raw->fmt != PIXFMT_RGBF)) {
+		fprintf(stderr, "write_raw_rect: unsupported pixel format conversion\n");
+		return false;
+	}
+
+	for(int i=0; i<h; i++) {
+		const char *src = (const char*)pixels + (size_t)i * pitch * src_texel_size;
+		long long offs = row_offset(raw, y + i) + (long long)x * texel_size;
+
+		if(fmt == raw->fmt) {
+			if(!write_fully(raw->fd, src, w * texel_size, offs)) {
+				return false;
+			}
+			continue;
+		}
+
+		// widen half floats in small chunks
+		for(int j=0; j<w; j+=64) {
+			int n = w - j < 64 ? w - j : 64;
+			half_to_float_array(tmp, (const half*)src + j * 3, n * 3);
+			if(!write_fully(raw->fd, tmp, n * texel_size, offs + j * texel_size)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void init_mapped(Image *img, const RawImage *raw, void *map, size_t size)
+{
+	long row_size = raw->width * pixel_size(raw->fmt);
+	char *pixels = (char*)map + raw->data_offs;
+
+	img->width = raw->width;
+	img->height = raw->height;
+	img->fmt = raw->fmt;
+	if(raw->bottom_up) {
+		img->pixels = pixels + (raw->height - 1) * row_size;
+		img->pitch = -row_size;
+	} else {
+		img->pixels = pixels;
+		img->pitch = row_size;
+	}
+	img->first_row = 0;
+	img->map = map;
+	img->map_size = size;
+}
+
+static bool map_existing(Image *img, const char *fname, bool write)
+{
+	if(!raw_image_suffix(fname, PIXFMT_RGB8) && !raw_image_suffix(fname, PIXFMT_RGBF)) {
+		return false;
+	}
+
+	RawImage raw;
+	if(!open_raw(&raw, fname, false, write)) {
+		return false;
+	}
+
+	size_t size = raw.data_offs + (size_t)raw.width * raw.height * pixel_size(raw.fmt);
+	struct stat st;
+	if(raw.swap || (raw.fmt == PIXFMT_RGBF && (raw.data_offs & 3)) ||
+			fstat(raw.fd, &st) == -1 || (size_t)st.st_size < size) {
+		close(raw.fd);
+		return false;
+	}
+
+	void *map;
+	if(write) {
+		map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, raw.fd, 0);
+	} else {
+		map = mmap(0, size, PROT_READ, MAP_PRIVATE, raw.fd, 0);
+	}
+	close(raw.fd);
+	if(map == MAP_FAILED) {
+		return false;
+	}
+	madvise(map, size, write ? MADV_RANDOM : MADV_WILLNEED);
+
+	init_mapped(img, &raw, map, size);
+	return true;
+}
+
+bool map_raw_image(Image *img, const char *fname)
+{
+	return map_existing(img, fname, false);
+}
+
+bool update_mapped_image(Image *img, const char *fname)
+{
+	return map_existing(img, fname, true);
+}
+
+bool create_mapped_image(Image *img, const char *fname, int width, int height, int fmt)
+{
+	RawImage raw;
+	if(!create_raw_image(&raw, fname, width, height, fmt)) {
+		return false;
+	}
+
+	size_t size = raw.data_offs + (size_t)width * height * pixel_size(fmt);
+	void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, raw.fd, 0);
+	close(raw.fd);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "failed to map %s: %s\n", fname, strerror(errno));
+		return false;
+	}
+	madvise(map, size, MADV_RANDOM);
+
+	init_mapped(img, &raw, map, size);
+	return true;
+}
+
+void unmap_raw_image(Image *img)
+{
+	munmap(img->map, img->map_size);
+	img->map = 0;
+	img->map_size = 0;
+}
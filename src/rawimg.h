@@ -0,0 +1,78 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RAWIMG_H_
+#define RAWIMG_H_
+
+/* row-level access to uncompressed PPM (P6, 8bit) and PFM (PF, RGB float)
+ * files, for images too large to load at once. Rows are always addressed
+ * top to bottom, even though PFM stores them bottom to top. All reads and
+ * writes are positional, so different threads can access different parts
+ * of the same file concurrently.
+ */
+struct Image;
+
+struct RawImage {
+	int fd;
+	int width, height;
+	int fmt;				// PIXFMT_RGB8 for PPM, PIXFMT_RGBF for PFM
+	long long data_offs;	// file offset of the first stored row
+	bool bottom_up;			// PFM row order
+	bool swap;				// big endian PFM
+};
+
+bool open_raw_image(RawImage *raw, const char *fname);
+
+/* creates a raw image file of the given size. The format follows the file
+ * suffix: .ppm files must be PIXFMT_RGB8, and .pfm files PIXFMT_RGBF.
+ */
+bool create_raw_image(RawImage *raw, const char *fname, int width, int height, int fmt);
+void close_raw_image(RawImage *raw);
+
+// true for suffixes create_raw_image accepts for this pixel format
+bool raw_image_suffix(const char *fname, int fmt);
+
+/* reads count rows starting at row y, converting them to the pixel format
+ * fmt if necessary (PIXFMT_RGBH from PFM files)
+ */
+bool read_raw_rows(RawImage *raw, int y, int count, int fmt, void *dest);
+
+/* writes a w x h rectangle at (x, y), from pixels of format fmt, pitch texels
+ * apart. PIXFMT_RGBH pixels are widened for PFM files.
+ */
+bool write_raw_rect(RawImage *raw, int x, int y, int w, int h, int fmt, const void *pixels, int pitch);
+
+/* memory-mapped raw images, released with destroy_image. map_raw_image maps
+ * an existing file read-only, if it can be used in place: PPM files as
+ * PIXFMT_RGB8, and PFM files in native byte order with 4-byte aligned pixels
+ * as bottom-up PIXFMT_RGBF (negative pitch). Otherwise it returns false
+ * without printing anything, so that the caller can fall back to decoding
+ * the file. The whole mapping is prefetched, since the conversions gather
+ * from all over the source.
+ *
+ * create_mapped_image creates a raw image file (see create_raw_image) and
+ * maps it for writing. The conversions scatter tiles over the destination,
+ * so readahead is disabled on it. update_mapped_image maps an existing file
+ * for reading and writing in place, under the same conditions as
+ * map_raw_image, so that only the pages which are modified get written back.
+ */
+bool map_raw_image(Image *img, const char *fname);
+bool create_mapped_image(Image *img, const char *fname, int width, int height, int fmt);
+bool update_mapped_image(Image *img, const char *fname);
+void unmap_raw_image(Image *img);
+
+#endif	// RAWIMG_H_
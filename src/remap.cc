@@ -0,0 +1,385 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <mutex>
+#include "remap.h"
+#include "threadpool.h"
+#include "reverse.h"
+
+#define REMAP_MAGIC		"CMREMAP4"
+
+static std::vector<RemapTable*> cache;	// least recently used first
+static std::string cache_dir;
+static std::mutex cache_mutex;
+
+void init_remap_key(RemapKey *key, int eq_width, int eq_height, int cube_size, const ConvOptions *opt,
+		bool reverse)
+{
+	memset(key, 0, sizeof *key);
+	key->eq_width = eq_width;
+	key->eq_height = eq_height;
+	key->cube_size = cube_size;
+	key->reverse = reverse;
+	key->opt = *opt;
+}
+
+bool remap_key_match(const RemapKey *a, const RemapKey *b)
+{
+	return a->eq_width == b->eq_width && a->eq_height == b->eq_height &&
+		a->cube_size == b->cube_size && a->reverse == b->reverse &&
+		a->opt.filter == b->opt.filter && a->opt.yaw == b->opt.yaw &&
+		a->opt.samples == b->opt.samples;
+}
+
+static size_t remap_entry_count(const RemapKey *key)
+{
+	int samples = key->opt.samples > 1 ? key->opt.samples : 1;
+	if(key->reverse) {
+		return (size_t)key->eq_width * key->eq_height * samples;
+	}
+	return (size_t)key->cube_size * key->cube_size * samples * 6;
+}
+
+static RemapTable *alloc_remap(const RemapKey *key)
+{
+	if(key->opt.filter == FILTER_AREA) {
+		fprintf(stderr, "remap tables don't support the %s filter\n", filter_name[FILTER_AREA]);
+		return 0;
+	}
+	if(key->eq_width > 65536 || key->eq_height > 65536 || key->cube_size > 65536) {
+		fprintf(stderr, "remap tables are limited to 65536x65536 source images\n");
+		return 0;
+	}
+	if(key->opt.samples > MAX_SAMPLES) {
+		fprintf(stderr, "remap tables are limited to %d samples per texel\n", MAX_SAMPLES);
+		return 0;
+	}
+
+	size_t num_ent = remap_entry_count(key);
+
+	RemapTable *rmap = new RemapTable;
+	rmap->key = *key;
+	if(!(rmap->entries = (RemapEntry*)malloc(num_ent * sizeof *rmap->entries))) {
+		fprintf(stderr, "failed to allocate remap table (%lu entries)\n", (unsigned long)num_ent);
+		delete rmap;
+		return 0;
+	}
+	rmap->faces = 0;
+	if(key->reverse && !(rmap->faces = (unsigned char*)malloc(num_ent))) {
+		fprintf(stderr, "failed to allocate remap table (%lu entries)\n", (unsigned long)num_ent);
+		free(rmap->entries);
+		delete rmap;
+		return 0;
+	}
+	return rmap;
+}
+
+struct RemapJob {
+	RemapTable *rmap;
+	int rows;
+	int num_samples;
+	float offs[MAX_SAMPLES * 2];
+	float *cos_theta, *sin_theta;	// reverse only, see calc_longitude_table
+};
+
+static void remap_rows_task(int idx, int thread, void *cls)
+{
+	RemapJob *job = (RemapJob*)cls;
+	const RemapKey *key = &job->rmap->key;
+	int size = key->cube_size;
+
+	float *uarr = new float[size * 2];
+	float *varr = uarr + size;
+
+	int face = idx / job->rows;
+	int row = idx % job->rows;
+
+	int num_samples = job->num_samples;
+	const float *offs = job->offs;
+
+	// each row holds all entries of the first sample, then the second, etc.
+	RemapEntry *ent = job->rmap->entries + ((size_t)face * size + row) * size * num_samples;
+
+	for(int k=0; k<num_samples; k++) {
+		// tile-sized spans, to compute exactly the same coordinates as convert_tile
+		for(int x=0; x<size; x+=CONV_TILE_SIZE) {
+			int w = size - x < CONV_TILE_SIZE ? size - x : CONV_TILE_SIZE;
+			if(num_samples > 1) {
+				calc_span_coords(face, size, row, x, w, &key->opt, uarr + x, varr + x,
+						offs[k * 2], offs[k * 2 + 1]);
+			} else {
+				calc_span_coords(face, size, row, x, w, &key->opt, uarr + x, varr + x);
+			}
+		}
+
+		for(int i=0; i<size; i++) {
+			calc_footprint(key->eq_width, key->eq_height, uarr[i], varr[i], ent++);
+		}
+	}
+
+	delete [] uarr;
+}
+
+static void rev_remap_rows_task(int idx, int thread, void *cls)
+{
+	RemapJob *job = (RemapJob*)cls;
+	const RemapKey *key = &job->rmap->key;
+	int width = key->eq_width;
+
+	float *sarr = new float[width * 2];
+	float *tarr = sarr + width;
+
+	size_t rowstart = (size_t)idx * width * job->num_samples;
+	RemapEntry *ent = job->rmap->entries + rowstart;
+	unsigned char *face = job->rmap->faces + rowstart;
+
+	for(int k=0; k<job->num_samples; k++) {
+		const float *cos_theta = job->cos_theta + k * width;
+		const float *sin_theta = job->sin_theta + k * width;
+		float yoffs = job->num_samples > 1 ? job->offs[k * 2 + 1] : 0.0f;
+
+		equirect_span_to_cube(key->eq_height, idx, 0, width, cos_theta, sin_theta,
+				face, sarr, tarr, yoffs);
+
+		for(int i=0; i<width; i++) {
+			calc_face_footprint(key->cube_size, sarr[i], tarr[i], ent++);
+		}
+		face += width;
+	}
+
+	delete [] sarr;
+}
+
+RemapTable *create_remap(const RemapKey *key, ThreadPool *tpool)
+{
+	RemapTable *rmap = alloc_remap(key);
+	if(!rmap) return 0;
+
+	RemapJob job;
+	job.rmap = rmap;
+	job.num_samples = key->opt.samples > 1 ? key->opt.samples : 1;
+	calc_sample_offsets(job.num_samples, job.offs);
+	job.cos_theta = job.sin_theta = 0;
+
+	int num_rows;
+	TaskFunc func;
+
+	if(key->reverse) {
+		size_t tabsz = (size_t)key->eq_width * job.num_samples;
+		job.cos_theta = new float[tabsz * 2];
+		job.sin_theta = job.cos_theta + tabsz;
+
+		for(int i=0; i<job.num_samples; i++) {
+			calc_longitude_table(key->eq_width, &key->opt, job.offs[i * 2],
+					job.cos_theta + i * key->eq_width, job.sin_theta + i * key->eq_width);
+		}
+		num_rows = key->eq_height;
+		func = rev_remap_rows_task;
+	} else {
+		job.rows = key->cube_size;
+		num_rows = job.rows * 6;
+		func = remap_rows_task;
+	}
+
+	if(tpool) {
+		tpool->run(num_rows, func, &job);
+	} else {
+		for(int i=0; i<num_rows; i++) {
+			func(i, 0, &job);
+		}
+	}
+
+	delete [] job.cos_theta;
+	return rmap;
+}
+
+void free_remap(RemapTable *rmap)
+{
+	if(rmap) {
+		free(rmap->entries);
+		free(rmap->faces);
+		delete rmap;
+	}
+}
+
+const RemapEntry *remap_face_entries(const RemapTable *rmap, int face)
+{
+	return rmap->entries + remap_entry_count(&rmap->key) / 6 * face;
+}
+
+bool save_remap(const RemapTable *rmap, const char *fname)
+{
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open remap table file for writing: %s\n", fname);
+		return false;
+	}
+
+	const RemapKey *key = &rmap->key;
+	int hdr[6] = {key->eq_width, key->eq_height, key->cube_size, key->opt.filter,
+		key->opt.samples, key->reverse ? 1 : 0};
+	size_t num_ent = remap_entry_count(key);
+
+	fwrite(REMAP_MAGIC, 1, 8, fp);
+	fwrite(hdr, sizeof hdr, 1, fp);
+	fwrite(&key->opt.yaw, sizeof key->opt.yaw, 1, fp);
+	if(fwrite(rmap->entries, sizeof *rmap->entries, num_ent, fp) != num_ent ||
+			(rmap->faces && fwrite(rmap->faces, 1, num_ent, fp) != num_ent)) {
+		fprintf(stderr, "failed to write remap table: %s\n", fname);
+		fclose(fp);
+		remove(fname);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+RemapTable *load_remap(const char *fname)
+{
+	FILE *fp = fopen(fname, "rb");
+	if(!fp) return 0;
+
+	char magic[8];
+	int hdr[6];
+	ConvOptions opt;
+	default_conv_options(&opt);
+
+	if(fread(magic, 1, 8, fp) < 8 || memcmp(magic, REMAP_MAGIC, 8) != 0 ||
+			fread(hdr, sizeof hdr, 1, fp) < 1 || fread(&opt.yaw, sizeof opt.yaw, 1, fp) < 1) {
+		fprintf(stderr, "invalid remap table file: %s\n", fname);
+		fclose(fp);
+		return 0;
+	}
+	if(hdr[2] <= 0 || hdr[3] < 0 || hdr[3] >= NUM_FILTERS || hdr[4] < 1) {
+		fprintf(stderr, "invalid remap table file: %s\n", fname);
+		fclose(fp);
+		return 0;
+	}
+	opt.filter = hdr[3];
+	opt.samples = hdr[4];
+
+	RemapKey key;
+	init_remap_key(&key, hdr[0], hdr[1], hdr[2], &opt, hdr[5] != 0);
+
+	RemapTable *rmap = alloc_remap(&key);
+	if(!rmap) {
+		fclose(fp);
+		return 0;
+	}
+
+	size_t num_ent = remap_entry_count(&key);
+	if(fread(rmap->entries, sizeof *rmap->entries, num_ent, fp) != num_ent ||
+			(rmap->faces && fread(rmap->faces, 1, num_ent, fp) != num_ent)) {
+		fprintf(stderr, "truncated remap table file: %s\n", fname);
+		free_remap(rmap);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	return rmap;
+}
+
+void set_remap_cache_dir(const char *dir)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	cache_dir = dir ? dir : "";
+}
+
+static std::string remap_cache_fname(const RemapKey *key)
+{
+	char buf[128];
+	sprintf(buf, "/%s_%dx%d_%d_%s_s%d_%g.bin", key->reverse ? "revmap" : "remap",
+			key->eq_width, key->eq_height, key->cube_size, filter_name[key->opt.filter],
+			key->opt.samples, key->opt.yaw);
+	return cache_dir + buf;
+}
+
+RemapTable *get_remap(const RemapKey *key, ThreadPool *tpool)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	for(size_t i=0; i<cache.size(); i++) {
+		if(remap_key_match(&cache[i]->key, key)) {
+			RemapTable *rmap = cache[i];
+			cache.erase(cache.begin() + i);
+			cache.push_back(rmap);
+			return rmap;
+		}
+	}
+
+	RemapTable *rmap = 0;
+	std::string fname;
+
+	if(!cache_dir.empty()) {
+		fname = remap_cache_fname(key);
+		if((rmap = load_remap(fname.c_str())) && !remap_key_match(&rmap->key, key)) {
+			fprintf(stderr, "ignoring mismatched remap table: %s\n", fname.c_str());
+			free_remap(rmap);
+			rmap = 0;
+		}
+	}
+
+	if(!rmap) {
+		if(!(rmap = create_remap(key, tpool))) {
+			return 0;
+		}
+		if(!fname.empty()) {
+			save_remap(rmap, fname.c_str());
+		}
+	}
+
+	cache.push_back(rmap);
+	return rmap;
+}
+
+void clear_remap_cache()
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	for(size_t i=0; i<cache.size(); i++) {
+		free_remap(cache[i]);
+	}
+	cache.clear();
+}
+
+static size_t remap_size(const RemapTable *rmap)
+{
+	size_t count = remap_entry_count(&rmap->key);
+	return count * sizeof *rmap->entries + (rmap->faces ? count : 0);
+}
+
+void trim_remap_cache(size_t max_bytes)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	size_t total = 0;
+	for(size_t i=0; i<cache.size(); i++) {
+		total += remap_size(cache[i]);
+	}
+
+	size_t num_freed = 0;
+	while(num_freed < cache.size() && total > max_bytes) {
+		total -= remap_size(cache[num_freed]);
+		free_remap(cache[num_freed++]);
+	}
+	cache.erase(cache.begin(), cache.begin() + num_freed);
+}
@@ -0,0 +1,81 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef REMAP_H_
+#define REMAP_H_
+
+#include "convert.h"
+
+struct RemapEntry {
+	unsigned short x, y;	// source texel left/above the sampling point
+	float tx, ty;			// subtexel offsets, to look up the filter weights
+};
+
+// everything the destination texel -> source texel mapping depends on
+struct RemapKey {
+	int eq_width, eq_height;	// equirect size (source, or destination if reverse)
+	int cube_size;
+	bool reverse;				// cubemap -> equirect
+	ConvOptions opt;
+};
+
+/* precomputed source coordinates and weights for every destination texel.
+ * With a remap table, converting another image of the same size is just a
+ * gather pass (see convert_cubemap_remap and convert_equirect_remap).
+ */
+struct RemapTable {
+	RemapKey key;
+	/* forward: cube_size^2 * samples entries per face, face-major
+	 * reverse: eq_width * eq_height * samples entries
+	 * in both cases each row holds the entries of the first sample, then the
+	 * second, and so on.
+	 */
+	RemapEntry *entries;
+	unsigned char *faces;	// reverse only: source face of each entry
+};
+
+void init_remap_key(RemapKey *key, int eq_width, int eq_height, int cube_size, const ConvOptions *opt,
+		bool reverse = false);
+bool remap_key_match(const RemapKey *a, const RemapKey *b);
+
+RemapTable *create_remap(const RemapKey *key, ThreadPool *tpool = 0);
+void free_remap(RemapTable *rmap);
+
+// forward tables only
+const RemapEntry *remap_face_entries(const RemapTable *rmap, int face);
+
+/* the file format is a small header with the key, followed by the raw
+ * entries in native byte order. Only meant as a cache for the same machine.
+ */
+bool save_remap(const RemapTable *rmap, const char *fname);
+RemapTable *load_remap(const char *fname);
+
+/* process-wide remap table cache. get_remap returns a table matching the key,
+ * looking first in memory, then in the cache directory (if set), and finally
+ * creating it (and saving it to the cache directory). The returned table is
+ * owned by the cache and stays valid until clear_remap_cache, or until
+ * trim_remap_cache evicts it. Thread-safe.
+ */
+void set_remap_cache_dir(const char *dir);
+RemapTable *get_remap(const RemapKey *key, ThreadPool *tpool = 0);
+void clear_remap_cache();
+/* frees the least recently used tables until the rest fit in max_bytes. The
+ * caller makes sure none of the tables are still in use.
+ */
+void trim_remap_cache(size_t max_bytes);
+
+#endif	// REMAP_H_
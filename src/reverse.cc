@@ -0,0 +1,332 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include "reverse.h"
+#include "remap.h"
+#include "threadpool.h"
+
+// face coordinate selection per face: source axis and sign of s and t
+static const int sc_axis[6] = {2, 2, 0, 0, 0, 0};
+static const float sc_sign[6] = {-1, 1, 1, 1, 1, -1};
+static const int tc_axis[6] = {1, 1, 2, 2, 1, 1};
+static const float tc_sign[6] = {-1, -1, 1, -1, -1, -1};
+
+bool load_cubemap(Image *faces, const char *px_fname, unsigned int flags)
+{
+	std::string fname = px_fname;
+	size_t pos = fname.rfind("px");
+	if(pos == std::string::npos) {
+		fprintf(stderr, "cubemap face filename must contain \"px\": %s\n", px_fname);
+		return false;
+	}
+
+	for(int i=0; i<6; i++) {
+		fname.replace(pos, 2, cube_face_name[i]);
+
+		if(!load_image(faces + i, fname.c_str(), flags)) {
+			for(int j=0; j<i; j++) {
+				destroy_image(faces + j);
+			}
+			return false;
+		}
+		if(faces[i].width != faces[i].height || faces[i].width != faces[0].width ||
+				faces[i].fmt != faces[0].fmt) {
+			fprintf(stderr, "cubemap faces must be square and of the same size and format: %s\n",
+					fname.c_str());
+			for(int j=0; j<=i; j++) {
+				destroy_image(faces + j);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+void calc_longitude_table(int width, const ConvOptions *opt, float xoffs, float *cos_theta, float *sin_theta)
+{
+	double uoffs = opt->yaw / 360.0;
+
+	for(int i=0; i<width; i++) {
+		double u = ((double)i + 0.5 + xoffs) / (double)width - uoffs;
+		double theta = (u - 0.5) * 2.0 * M_PI;
+		cos_theta[i] = cos(theta);
+		sin_theta[i] = sin(theta);
+	}
+}
+
+void equirect_span_to_cube(int height, int row, int x, int count, const float *cos_theta,
+		const float *sin_theta, unsigned char *face, float *s, float *t, float yoffs)
+{
+	double phi = ((double)row + 0.5 + yoffs) / (double)height * M_PI;
+	float sin_phi = sin(phi);
+	float dy = cos(phi);
+
+	for(int i=0; i<count; i++) {
+		float dir[3];
+		dir[0] = sin_phi * cos_theta[x + i];
+		dir[1] = dy;
+		dir[2] = sin_phi * sin_theta[x + i];
+
+		float ax = fabs(dir[0]);
+		float ay = fabs(dir[1]);
+		float az = fabs(dir[2]);
+		int axis = ax >= ay ? (ax >= az ? 0 : 2) : (ay >= az ? 1 : 2);
+		int f = axis * 2 + (dir[axis] < 0.0f);
+
+		float inv_ma = 0.5f / fabs(dir[axis]);
+		face[i] = f;
+		s[i] = dir[sc_axis[f]] * sc_sign[f] * inv_ma + 0.5f;
+		t[i] = dir[tc_axis[f]] * tc_sign[f] * inv_ma + 0.5f;
+	}
+}
+
+void calc_face_footprint(int size, float s, float t, RemapEntry *res)
+{
+	float fx = s * size - 0.5f;
+	float fy = t * size - 0.5f;
+	float x0f = floor(fx);
+	float y0f = floor(fy);
+	res->tx = fx - x0f;
+	res->ty = fy - y0f;
+
+	int x0 = (int)x0f;
+	int y0 = (int)y0f;
+
+	if(x0 < 0) {
+		x0 = 0;
+		res->tx = 0.0f;
+	} else if(x0 >= size - 1) {
+		x0 = size - 1;
+		res->tx = 0.0f;
+	}
+	if(y0 < 0) {
+		y0 = 0;
+		res->ty = 0.0f;
+	} else if(y0 >= size - 1) {
+		y0 = size - 1;
+		res->ty = 0.0f;
+	}
+
+	res->x = x0;
+	res->y = y0;
+}
+
+struct ReverseJob {
+	const Image *faces;
+	Image *dest;
+	const ConvOptions *opt;
+	const RemapTable *rmap;
+	int num_samples;
+	float offs[MAX_SAMPLES * 2];
+	float *cos_theta, *sin_theta;	// width entries per sample
+	int tiles_x;
+};
+
+static void calc_tile_rect(const ReverseJob *job, int idx, int *x, int *y, int *w, int *h)
+{
+	*x = (idx % job->tiles_x) * CONV_TILE_SIZE;
+	*y = (idx / job->tiles_x) * CONV_TILE_SIZE;
+	*w = job->dest->width - *x < CONV_TILE_SIZE ? job->dest->width - *x : CONV_TILE_SIZE;
+	*h = job->dest->height - *y < CONV_TILE_SIZE ? job->dest->height - *y : CONV_TILE_SIZE;
+}
+
+template <typename T>
+static void rev_tile(const ReverseJob *job, int x, int y, int w, int h)
+{
+	Image *dest = job->dest;
+
+	int filter = job->opt->filter == FILTER_AREA ? FILTER_BILINEAR : job->opt->filter;
+	typename PixelOps<T>::Fetch fetch = PixelOps<T>::fetch(filter, false);
+	int size = job->faces[0].width;
+
+	unsigned char farr[CONV_TILE_SIZE];
+	float sarr[CONV_TILE_SIZE], tarr[CONV_TILE_SIZE];
+	typename PixelOps<T>::Accum acc[CONV_TILE_SIZE * 3];
+
+	for(int i=0; i<h; i++) {
+		T *rowpix = (T*)image_row(dest, y + i) + x * 3;
+
+		if(job->num_samples <= 1) {
+			equirect_span_to_cube(dest->height, y + i, x, w, job->cos_theta, job->sin_theta,
+					farr, sarr, tarr);
+
+			T *pptr = rowpix;
+			for(int j=0; j<w; j++) {
+				RemapEntry ent;
+				calc_face_footprint(size, sarr[j], tarr[j], &ent);
+				fetch(job->faces + farr[j], &ent, pptr);
+				pptr += 3;
+			}
+			continue;
+		}
+
+		memset(acc, 0, w * 3 * sizeof *acc);
+
+		for(int k=0; k<job->num_samples; k++) {
+			const float *cos_theta = job->cos_theta + k * dest->width;
+			const float *sin_theta = job->sin_theta + k * dest->width;
+			equirect_span_to_cube(dest->height, y + i, x, w, cos_theta, sin_theta,
+					farr, sarr, tarr, job->offs[k * 2 + 1]);
+
+			for(int j=0; j<w; j++) {
+				RemapEntry ent;
+				T col[3];
+				calc_face_footprint(size, sarr[j], tarr[j], &ent);
+				fetch(job->faces + farr[j], &ent, col);
+				PixelOps<T>::accum(acc + j * 3, col);
+			}
+		}
+
+		PixelOps<T>::resolve(rowpix, acc, w, job->num_samples);
+	}
+}
+
+static void rev_tile_task(int idx, int thread, void *cls)
+{
+	ReverseJob *job = (ReverseJob*)cls;
+	int x, y, w, h;
+	calc_tile_rect(job, idx, &x, &y, &w, &h);
+
+	if(job->dest->fmt == PIXFMT_RGB8) {
+		rev_tile<unsigned char>(job, x, y, w, h);
+	} else if(job->dest->fmt == PIXFMT_RGBH) {
+		rev_tile<half>(job, x, y, w, h);
+	} else {
+		rev_tile<float>(job, x, y, w, h);
+	}
+}
+
+template <typename T>
+static void rev_remap_tile(const ReverseJob *job, int x, int y, int w, int h)
+{
+	Image *dest = job->dest;
+
+	typename PixelOps<T>::Fetch fetch = PixelOps<T>::fetch(job->opt->filter, false);
+	int num_samples = job->num_samples;
+	typename PixelOps<T>::Accum acc[CONV_TILE_SIZE * 3];
+
+	for(int i=0; i<h; i++) {
+		size_t rowstart = (size_t)(y + i) * dest->width * num_samples;
+		const RemapEntry *rowent = job->rmap->entries + rowstart;
+		const unsigned char *rowface = job->rmap->faces + rowstart;
+		T *rowpix = (T*)image_row(dest, y + i) + x * 3;
+
+		if(num_samples <= 1) {
+			T *pptr = rowpix;
+			for(int j=x; j<x + w; j++) {
+				fetch(job->faces + rowface[j], rowent + j, pptr);
+				pptr += 3;
+			}
+			continue;
+		}
+
+		memset(acc, 0, w * 3 * sizeof *acc);
+
+		for(int k=0; k<num_samples; k++) {
+			const RemapEntry *ent = rowent + k * dest->width;
+			const unsigned char *face = rowface + k * dest->width;
+			typename PixelOps<T>::Accum *aptr = acc;
+
+			for(int j=x; j<x + w; j++) {
+				T col[3];
+				fetch(job->faces + face[j], ent + j, col);
+				PixelOps<T>::accum(aptr, col);
+				aptr += 3;
+			}
+		}
+
+		PixelOps<T>::resolve(rowpix, acc, w, num_samples);
+	}
+}
+
+static void rev_remap_tile_task(int idx, int thread, void *cls)
+{
+	ReverseJob *job = (ReverseJob*)cls;
+	int x, y, w, h;
+	calc_tile_rect(job, idx, &x, &y, &w, &h);
+
+	if(job->dest->fmt == PIXFMT_RGB8) {
+		rev_remap_tile<unsigned char>(job, x, y, w, h);
+	} else if(job->dest->fmt == PIXFMT_RGBH) {
+		rev_remap_tile<half>(job, x, y, w, h);
+	} else {
+		rev_remap_tile<float>(job, x, y, w, h);
+	}
+}
+
+static void run_tiles(ReverseJob *job, TaskFunc func, ThreadPool *tpool)
+{
+	job->tiles_x = (job->dest->width + CONV_TILE_SIZE - 1) / CONV_TILE_SIZE;
+	int tiles_y = (job->dest->height + CONV_TILE_SIZE - 1) / CONV_TILE_SIZE;
+	int num_tiles = job->tiles_x * tiles_y;
+
+	if(tpool) {
+		tpool->run(num_tiles, func, job);
+	} else {
+		for(int i=0; i<num_tiles; i++) {
+			func(i, 0, job);
+		}
+	}
+}
+
+bool convert_equirect(const Image *faces, Image *dest, const ConvOptions *opt, ThreadPool *tpool)
+{
+	if(dest->fmt != faces[0].fmt) {
+		fprintf(stderr, "convert_equirect: the destination must have the same pixel format as the faces\n");
+		return false;
+	}
+
+	ReverseJob job;
+	job.faces = faces;
+	job.dest = dest;
+	job.opt = opt;
+	job.rmap = 0;
+	job.num_samples = opt->samples > 1 ? opt->samples : 1;
+	if(job.num_samples > MAX_SAMPLES) job.num_samples = MAX_SAMPLES;
+	calc_sample_offsets(job.num_samples, job.offs);
+
+	size_t tabsz = (size_t)dest->width * job.num_samples;
+	job.cos_theta = new float[tabsz * 2];
+	job.sin_theta = job.cos_theta + tabsz;
+
+	for(int i=0; i<job.num_samples; i++) {
+		calc_longitude_table(dest->width, opt, job.offs[i * 2], job.cos_theta + i * dest->width,
+				job.sin_theta + i * dest->width);
+	}
+
+	run_tiles(&job, rev_tile_task, tpool);
+
+	delete [] job.cos_theta;
+	return true;
+}
+
+void convert_equirect_remap(const Image *faces, Image *dest, const RemapTable *rmap, ThreadPool *tpool)
+{
+	ReverseJob job;
+	job.faces = faces;
+	job.dest = dest;
+	job.opt = &rmap->key.opt;
+	job.rmap = rmap;
+	job.num_samples = rmap->key.opt.samples > 1 ? rmap->key.opt.samples : 1;
+	job.cos_theta = job.sin_theta = 0;
+
+	run_tiles(&job, rev_remap_tile_task, tpool);
+}
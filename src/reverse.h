@@ -0,0 +1,57 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef REVERSE_H_
+#define REVERSE_H_
+
+#include "convert.h"
+
+/* cubemap -> equirect conversion, the reverse of convert_cubemap. Uses the
+ * same filters, sampling patterns, tiling and remap tables. The yaw option
+ * rotates the opposite way, so converting back and forth with the same
+ * options preserves the orientation. FILTER_AREA is not supported, and falls
+ * back to FILTER_BILINEAR.
+ */
+
+/* load six faces, given the filename of the +X face. The other filenames are
+ * derived by replacing the last occurence of "px" with "nx", "py", etc.
+ * All faces must have the same pixel format, flags are passed to load_image.
+ */
+bool load_cubemap(Image *faces, const char *px_fname, unsigned int flags = 0);
+
+/* cos/sin of the longitude of every column of a width-wide equirect, for the
+ * given horizontal subtexel offset. Precomputed once per conversion, since
+ * the longitude only depends on the column.
+ */
+void calc_longitude_table(int width, const ConvOptions *opt, float xoffs, float *cos_theta, float *sin_theta);
+
+/* face index and face coordinates (s, t in [0, 1]) for count consecutive
+ * texels of an equirect row, starting at x. The major axis is computed once
+ * per texel and the face coordinates are selected through per-face tables,
+ * instead of branching on the face.
+ */
+void equirect_span_to_cube(int height, int row, int x, int count, const float *cos_theta,
+		const float *sin_theta, unsigned char *face, float *s, float *t, float yoffs = 0.0f);
+
+// like calc_footprint, but clamps at all edges of a size x size cube face
+void calc_face_footprint(int size, float s, float t, RemapEntry *res);
+
+// dest must have the same pixel format as the faces
+bool convert_equirect(const Image *faces, Image *dest, const ConvOptions *opt, ThreadPool *tpool = 0);
+void convert_equirect_remap(const Image *faces, Image *dest, const RemapTable *rmap, ThreadPool *tpool = 0);
+
+#endif	// REVERSE_H_
@@ -0,0 +1,379 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <math.h>
+#include <new>
+#include "seams.h"
+#include "convert.h"
+#include "threadpool.h"
+
+enum {
+	EDGE_LEFT,
+	EDGE_RIGHT,
+	EDGE_TOP,
+	EDGE_BOTTOM
+};
+
+struct SeamJob {
+	Image *faces;
+	int size;
+	int width;		// blend band, at most half the face size
+	/* new values of the edge texels, and their difference from the original
+	 * ones, RGB for every texel along each edge, corners included
+	 */
+	float *target[6][4];
+	float *delta[6][4];
+};
+
+static void edge_texel(int size, int edge, int i, int *x, int *y)
+{
+	switch(edge) {
+	case EDGE_LEFT:
+		*x = 0;
+		*y = i;
+		break;
+	case EDGE_RIGHT:
+		*x = size - 1;
+		*y = i;
+		break;
+	case EDGE_TOP:
+		*x = i;
+		*y = 0;
+		break;
+	default:
+		*x = i;
+		*y = size - 1;
+	}
+}
+
+// face coordinates of a direction, for the given face (the inverse of cube_face_dir)
+static void face_coords(int face, const float *dir, float *s, float *t)
+{
+	float sc, tc;
+	switch(face) {
+	case CUBE_PX:
+		sc = -dir[2];
+		tc = -dir[1];
+		break;
+	case CUBE_NX:
+		sc = dir[2];
+		tc = -dir[1];
+		break;
+	case CUBE_PY:
+		sc = dir[0];
+		tc = dir[2];
+		break;
+	case CUBE_NY:
+		sc = dir[0];
+		tc = -dir[2];
+		break;
+	case CUBE_PZ:
+		sc = dir[0];
+		tc = -dir[1];
+		break;
+	case CUBE_NZ:
+	default:
+		sc = -dir[0];
+		tc = -dir[1];
+	}
+	float inv_ma = 1.0f / fabs(dir[face / 2]);
+	*s = (sc * inv_ma + 1.0f) * 0.5f;
+	*t = (tc * inv_ma + 1.0f) * 0.5f;
+}
+
+static inline int clamp_texel(float x, int size)
+{
+	int i = (int)x;
+	return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+/* the texel across the edge from the edge texel (x, y). The adjacent face is
+ * the one that a point half a texel beyond the edge projects onto, and the
+ * point on the edge itself, which lies on both faces, gives the texel.
+ */
+static void edge_neighbor(int face, int size, int edge, int x, int y, int *nface, int *nx, int *ny)
+{
+	float s = (x + 0.5f) / size;
+	float t = (y + 0.5f) / size;
+	float es = s, et = t, os = s, ot = t;
+
+	switch(edge) {
+	case EDGE_LEFT:
+		es = 0.0f;
+		os = -0.5f / size;
+		break;
+	case EDGE_RIGHT:
+		es = 1.0f;
+		os = 1.0f + 0.5f / size;
+		break;
+	case EDGE_TOP:
+		et = 0.0f;
+		ot = -0.5f / size;
+		break;
+	default:
+		et = 1.0f;
+		ot = 1.0f + 0.5f / size;
+	}
+
+	float dir[3], odir[3];
+	cube_face_dir(face, es, et, dir);
+	cube_face_dir(face, os, ot, odir);
+
+	float ax = fabs(odir[0]);
+	float ay = fabs(odir[1]);
+	float az = fabs(odir[2]);
+	int axis = ax >= ay ? (ax >= az ? 0 : 2) : (ay >= az ? 1 : 2);
+	*nface = axis * 2 + (odir[axis] < 0.0f);
+
+	float ns, nt;
+	face_coords(*nface, dir, &ns, &nt);
+	*nx = clamp_texel(ns * size, size);
+	*ny = clamp_texel(nt * size, size);
+}
+
+// cube corner (0-7) of a face corner, from the signs of its direction
+static int cube_corner(int face, int cx, int cy)
+{
+	float dir[3];
+	cube_face_dir(face, cx, cy, dir);
+	return (dir[0] > 0.0f) | (dir[1] > 0.0f) << 1 | (dir[2] > 0.0f) << 2;
+}
+
+template <typename T>
+static void read_texel(const Image *img, int x, int y, float *col)
+{
+	const T *ptr = (const T*)image_row(img, y) + x * 3;
+	col[0] = PixelOps<T>::to_float(ptr[0]);
+	col[1] = PixelOps<T>::to_float(ptr[1]);
+	col[2] = PixelOps<T>::to_float(ptr[2]);
+}
+
+template <typename T>
+static void write_texel(Image *img, int x, int y, const float *col)
+{
+	T *ptr = (T*)image_row(img, y) + x * 3;
+	PixelOps<T>::from_float(ptr, col);
+}
+
+/* both sides of an edge compute the same sum, in the same order, so the
+ * shared texels end up bitwise identical on both faces
+ */
+template <typename T>
+static void calc_targets(SeamJob *job)
+{
+	int size = job->size;
+	int last = size - 1;
+
+	float corner[8][3] = {{0}};
+	for(int i=0; i<6; i++) {
+		for(int j=0; j<4; j++) {
+			int cx = j & 1;
+			int cy = j >> 1;
+			float col[3];
+			read_texel<T>(job->faces + i, cx * last, cy * last, col);
+
+			float *sum = corner[cube_corner(i, cx, cy)];
+			sum[0] += col[0];
+			sum[1] += col[1];
+			sum[2] += col[2];
+		}
+	}
+
+	for(int i=0; i<6; i++) {
+		for(int j=0; j<4; j++) {
+			float *target = job->target[i][j];
+			float *delta = job->delta[i][j];
+
+			for(int k=0; k<size; k++) {
+				int x, y;
+				edge_texel(size, j, k, &x, &y);
+
+				float col[3];
+				read_texel<T>(job->faces + i, x, y, col);
+
+				if(k == 0 || k == last) {
+					const float *sum = corner[cube_corner(i, x > 0, y > 0)];
+					for(int c=0; c<3; c++) {
+						target[c] = sum[c] / 3.0f;
+					}
+				} else {
+					int nface, nx, ny;
+					edge_neighbor(i, size, j, x, y, &nface, &nx, &ny);
+
+					float ncol[3];
+					read_texel<T>(job->faces + nface, nx, ny, ncol);
+					float a[3], b[3];
+					// order the pair by face, so that both sides add the same way
+					for(int c=0; c<3; c++) {
+						a[c] = i < nface ? col[c] : ncol[c];
+						b[c] = i < nface ? ncol[c] : col[c];
+						target[c] = (a[c] + b[c]) * 0.5f;
+					}
+				}
+				for(int c=0; c<3; c++) {
+					delta[c] = target[c] - col[c];
+				}
+				target += 3;
+				delta += 3;
+			}
+		}
+	}
+}
+
+/* edge texels are set to their targets, and the texels within the band get
+ * the edge deltas weighted by their distance from each edge. Near the
+ * corners, where two bands overlap, the corner delta is subtracted once
+ * (a bilinear Coons patch), so that every edge still ends at its target.
+ */
+template <typename T>
+static void fix_face_task(int idx, int thread, void *cls)
+{
+	SeamJob *job = (SeamJob*)cls;
+	Image *face = job->faces + idx;
+	int size = job->size;
+	int last = size - 1;
+	int width = job->width;
+
+	float *const *target = job->target[idx];
+	const float *dl = job->delta[idx][EDGE_LEFT];
+	const float *dr = job->delta[idx][EDGE_RIGHT];
+	const float *dt = job->delta[idx][EDGE_TOP];
+	const float *db = job->delta[idx][EDGE_BOTTOM];
+
+	for(int y=0; y<size; y++) {
+		bool band_row = y < width || y > last - width;
+		float wt = y < width ? 1.0f - (float)y / width : 0.0f;
+		float wb = last - y < width ? 1.0f - (float)(last - y) / width : 0.0f;
+
+		for(int x=0; x<size; x++) {
+			if(x == width && !band_row) {
+				x = size - width;		// skip the inside of the face
+			}
+
+			if(x == 0 || x == last || y == 0 || y == last) {
+				const float *col;
+				if(x == 0) {
+					col = target[EDGE_LEFT] + y * 3;
+				} else if(x == last) {
+					col = target[EDGE_RIGHT] + y * 3;
+				} else if(y == 0) {
+					col = target[EDGE_TOP] + x * 3;
+				} else {
+					col = target[EDGE_BOTTOM] + x * 3;
+				}
+				write_texel<T>(face, x, y, col);
+				continue;
+			}
+
+			float wl = x < width ? 1.0f - (float)x / width : 0.0f;
+			float wr = last - x < width ? 1.0f - (float)(last - x) / width : 0.0f;
+
+			float col[3];
+			read_texel<T>(face, x, y, col);
+			for(int c=0; c<3; c++) {
+				col[c] += wl * dl[y * 3 + c] + wr * dr[y * 3 + c] + wt * dt[x * 3 + c] +
+					wb * db[x * 3 + c] - wl * wt * dt[c] - wr * wt * dt[last * 3 + c] -
+					wl * wb * db[c] - wr * wb * db[last * 3 + c];
+			}
+			write_texel<T>(face, x, y, col);
+		}
+	}
+}
+
+// 1x1 faces have a single texel on every edge and corner, which gets the average of all six
+template <typename T>
+static void fix_single_texel(Image *faces)
+{
+	float avg[3] = {0, 0, 0};
+	for(int i=0; i<6; i++) {
+		float col[3];
+		read_texel<T>(faces + i, 0, 0, col);
+		for(int c=0; c<3; c++) {
+			avg[c] += col[c] / 6.0f;
+		}
+	}
+	for(int i=0; i<6; i++) {
+		write_texel<T>(faces + i, 0, 0, avg);
+	}
+}
+
+template <typename T>
+static bool fix_seams(Image *faces, int width, ThreadPool *tpool)
+{
+	int size = faces[0].width;
+	if(size < 2) {
+		fix_single_texel<T>(faces);
+		return true;
+	}
+
+	SeamJob job;
+	job.faces = faces;
+	job.size = size;
+	job.width = width < size / 2 ? width : size / 2;
+	if(job.width < 1) job.width = 1;
+
+	size_t edge_floats = (size_t)size * 3;
+	float *buf = new (std::nothrow) float[edge_floats * 6 * 4 * 2];
+	if(!buf) {
+		fprintf(stderr, "failed to allocate the seam fixup buffers for %dx%d faces\n", size, size);
+		return false;
+	}
+	for(int i=0; i<6; i++) {
+		for(int j=0; j<4; j++) {
+			job.target[i][j] = buf + (i * 4 + j) * 2 * edge_floats;
+			job.delta[i][j] = job.target[i][j] + edge_floats;
+		}
+	}
+
+	calc_targets<T>(&job);
+
+	if(tpool) {
+		tpool->run(6, fix_face_task<T>, &job);
+	} else {
+		for(int i=0; i<6; i++) {
+			fix_face_task<T>(i, 0, &job);
+		}
+	}
+
+	delete [] buf;
+	return true;
+}
+
+bool fix_cube_seams(Image *faces, int width, ThreadPool *tpool)
+{
+	switch(faces[0].fmt) {
+	case PIXFMT_RGB8:
+		return fix_seams<unsigned char>(faces, width, tpool);
+	case PIXFMT_RGBH:
+		return fix_seams<half>(faces, width, tpool);
+	default:
+		break;
+	}
+	return fix_seams<float>(faces, width, tpool);
+}
+
+bool fix_mip_seams(Image *mips, int levels, int width, ThreadPool *tpool)
+{
+	for(int i=1; i<levels; i++) {
+		int level_width = width >> i > 1 ? width >> i : 1;
+		if(!fix_cube_seams(mips + (i - 1) * 6, level_width, tpool)) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,41 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SEAMS_H_
+#define SEAMS_H_
+
+struct Image;
+class ThreadPool;
+
+/* edge fixup, for cubemaps sampled without seamless cubemap filtering, where
+ * bilinear lookups clamp at the edges of each face and show the seams. The
+ * texels along each edge are averaged with the texels across it on the
+ * adjacent face, and the corner texels with the corners of the other two
+ * faces meeting there, so that adjacent faces share identical edge texels.
+ * The change is blended into the faces over width texels from the edges,
+ * fading out linearly, instead of leaving a step one texel in; width 1
+ * only touches the edge texels. faces can be in any pixel format, and views
+ * into an atlas.
+ */
+bool fix_cube_seams(Image *faces, int width, ThreadPool *tpool = 0);
+
+/* the same for levels 1 to levels - 1 of a mip chain (six faces per level,
+ * see prefilter.h), halving the width at every level, down to 1 texel
+ */
+bool fix_mip_seams(Image *mips, int levels, int width, ThreadPool *tpool = 0);
+
+#endif	// SEAMS_H_
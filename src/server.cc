@@ -0,0 +1,501 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+#define MAX_LINE		4096
+#define MAX_ARGS		16
+
+/* latency histogram buckets: bucket 0 counts requests under 1ms, bucket i
+ * the ones from 2^(i-1) to 2^i ms, and the last one everything above
+ */
+#define NUM_BUCKETS		20
+
+struct Connection {
+	int fd;
+	char buf[MAX_LINE];
+	int len, pos;	// buffered data, and read position
+};
+
+struct ServerRequest {
+	Connection *conn;
+
+	char line[MAX_LINE];
+	const char *cmd;
+	const char *keys[MAX_ARGS], *values[MAX_ARGS];
+	int num_args;
+
+	char errmsg[256];
+	bool hangup;	// close the connection after the reply
+};
+
+struct Server {
+	RequestFunc func;
+	void *cls;
+
+	std::mutex mutex;
+	std::condition_variable cond_idle;
+	std::set<int> clients;
+
+	std::atomic<long> buckets[NUM_BUCKETS];
+	std::atomic<long> num_requests, num_failed;
+	double total_ms, min_ms, max_ms;	// protected by mutex
+};
+
+static volatile sig_atomic_t quit;
+
+static void sig_handler(int sig)
+{
+	quit = 1;
+}
+
+static double get_time_msec()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool send_all(int fd, const void *data, size_t size)
+{
+	const char *ptr = (const char*)data;
+	while(size > 0) {
+		ssize_t sz = send(fd, ptr, size, MSG_NOSIGNAL);
+		if(sz == -1) {
+			if(errno == EINTR) continue;
+			return false;
+		}
+		ptr += sz;
+		size -= sz;
+	}
+	return true;
+}
+
+// reads a line without the newline, returns false at the end of the connection
+static bool read_line(Connection *conn, char *line, bool *too_long)
+{
+	*too_long = false;
+	int n = 0;
+	for(;;) {
+		while(conn->pos < conn->len) {
+			char c = conn->buf[conn->pos++];
+			if(c == '\n') {
+				if(n > 0 && line[n - 1] == '\r') n--;
+				line[n] = 0;
+				return true;
+			}
+			if(n < MAX_LINE - 1) {
+				line[n++] = c;
+			} else {
+				*too_long = true;
+			}
+		}
+
+		ssize_t sz = read(conn->fd, conn->buf, sizeof conn->buf);
+		if(sz <= 0) {
+			if(sz == -1 && errno == EINTR) continue;
+			return false;
+		}
+		conn->len = sz;
+		conn->pos = 0;
+	}
+}
+
+// splits the request line in place into the command and its arguments
+static bool parse_request(ServerRequest *req)
+{
+	char *ptr = req->line;
+	req->cmd = 0;
+	req->num_args = 0;
+
+	for(;;) {
+		while(*ptr == ' ' || *ptr == '\t') ptr++;
+		if(!*ptr) break;
+
+		char *tok = ptr;
+		char *value = 0;
+		char *dest = ptr;
+		bool quoted = false;
+		while(*ptr && (quoted || (*ptr != ' ' && *ptr != '\t'))) {
+			if(*ptr == '"') {
+				quoted = !quoted;
+				ptr++;
+				continue;
+			}
+			if(*ptr == '=' && !value && !quoted) {
+				*dest++ = 0;
+				value = dest;
+				ptr++;
+				continue;
+			}
+			*dest++ = *ptr++;
+		}
+		if(quoted) {
+			return false;
+		}
+		if(*ptr) ptr++;
+		*dest = 0;
+
+		if(!req->cmd) {
+			if(value) return false;
+			req->cmd = tok;
+		} else {
+			if(!value || req->num_args >= MAX_ARGS) return false;
+			req->keys[req->num_args] = tok;
+			req->values[req->num_args++] = value;
+		}
+	}
+	return req->cmd != 0;
+}
+
+static void add_latency(Server *srv, double msec, bool success)
+{
+	int bucket = 0;
+	while(bucket < NUM_BUCKETS - 1 && msec >= (double)(1 << bucket)) {
+		bucket++;
+	}
+	srv->buckets[bucket]++;
+	srv->num_requests++;
+	if(!success) srv->num_failed++;
+
+	std::lock_guard<std::mutex> lock(srv->mutex);
+	srv->total_ms += msec;
+	if(msec < srv->min_ms) srv->min_ms = msec;
+	if(msec > srv->max_ms) srv->max_ms = msec;
+}
+
+// upper bound of the bucket containing the given fraction of the requests
+static double latency_percentile(Server *srv, long count, double frac)
+{
+	long sum = 0;
+	for(int i=0; i<NUM_BUCKETS - 1; i++) {
+		sum += srv->buckets[i];
+		if(sum >= frac * count) {
+			return (double)(1 << i);
+		}
+	}
+	return srv->max_ms;
+}
+
+// writes the latency statistics, one line at a time
+static void print_stats(Server *srv, void (*print)(const char*, void*), void *pcls)
+{
+	char buf[256];
+	long count = srv->num_requests;
+
+	double total, min, max;
+	{
+		std::lock_guard<std::mutex> lock(srv->mutex);
+		total = srv->total_ms;
+		min = srv->min_ms;
+		max = srv->max_ms;
+	}
+
+	if(!count) {
+		print("requests 0", pcls);
+		return;
+	}
+	sprintf(buf, "requests %ld, failed %ld, latency mean %.1f, min %.1f, max %.1f ms", count,
+			(long)srv->num_failed, total / count, min, max);
+	print(buf, pcls);
+	sprintf(buf, "percentiles: 50%% < %g, 90%% < %g, 99%% < %g ms", latency_percentile(srv, count, 0.5),
+			latency_percentile(srv, count, 0.9), latency_percentile(srv, count, 0.99));
+	print(buf, pcls);
+
+	for(int i=0; i<NUM_BUCKETS; i++) {
+		long n = srv->buckets[i];
+		if(!n) continue;
+
+		if(i == 0) {
+			sprintf(buf, "       < 1 ms: %ld", n);
+		} else if(i < NUM_BUCKETS - 1) {
+			sprintf(buf, "%6d - %d ms: %ld", 1 << (i - 1), 1 << i, n);
+		} else {
+			sprintf(buf, "    >= %d ms: %ld", 1 << (i - 1), n);
+		}
+		print(buf, pcls);
+	}
+}
+
+static void print_stdout(const char *str, void *cls)
+{
+	printf("%s\n", str);
+}
+
+static void print_reply(const char *str, void *cls)
+{
+	reply_line((ServerRequest*)cls, "%s", str);
+}
+
+static void serve_connection(Server *srv, int fd)
+{
+	Connection conn;
+	conn.fd = fd;
+	conn.len = conn.pos = 0;
+
+	ServerRequest *req = new ServerRequest;
+	req->conn = &conn;
+
+	bool too_long;
+	while(read_line(&conn, req->line, &too_long)) {
+		double t0 = get_time_msec();
+		req->errmsg[0] = 0;
+		req->hangup = false;
+
+		bool res;
+		if(too_long) {
+			request_error(req, "request line too long");
+			res = false;
+		} else if(!parse_request(req)) {
+			if(!req->line[0]) continue;
+			request_error(req, "invalid request");
+			res = false;
+		} else if(strcmp(req->cmd, "stats") == 0) {
+			print_stats(srv, print_reply, req);
+			reply_line(req, "ok");
+			continue;
+		} else {
+			res = srv->func(req, srv->cls);
+		}
+
+		double dt = get_time_msec() - t0;
+		add_latency(srv, dt, res);
+
+		bool sent;
+		if(res) {
+			sent = reply_line(req, "ok %.1f", dt);
+		} else {
+			sent = reply_line(req, "error %s", req->errmsg[0] ? req->errmsg : "request failed");
+		}
+		if(!sent || req->hangup) break;
+	}
+
+	delete req;
+	close(fd);
+
+	std::lock_guard<std::mutex> lock(srv->mutex);
+	srv->clients.erase(fd);
+	srv->cond_idle.notify_all();
+}
+
+bool run_server(const char *path, RequestFunc func, void *cls)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	int lis = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(lis == -1) {
+		fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+		return false;
+	}
+	unlink(path);	// left over from a previous run
+
+	// only the user running the server can connect, from the moment it's bound
+	mode_t prev_umask = umask(0177);
+	int res = bind(lis, (struct sockaddr*)&addr, sizeof addr);
+	umask(prev_umask);
+	if(res == -1 || chmod(path, 0600) == -1 || listen(lis, 64) == -1) {
+		fprintf(stderr, "failed to listen on %s: %s\n", path, strerror(errno));
+		close(lis);
+		return false;
+	}
+
+	Server *srv = new Server;
+	srv->func = func;
+	srv->cls = cls;
+	for(int i=0; i<NUM_BUCKETS; i++) {
+		srv->buckets[i] = 0;
+	}
+	srv->num_requests = srv->num_failed = 0;
+	srv->total_ms = srv->max_ms = 0.0;
+	srv->min_ms = 1e30;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = sig_handler;	// no SA_RESTART, to interrupt accept
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	printf("listening on %s\n", path);
+	fflush(stdout);
+
+	while(!quit) {
+		int fd = accept4(lis, 0, 0, SOCK_CLOEXEC);
+		if(fd == -1) {
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			fprintf(stderr, "failed to accept connection: %s\n", strerror(errno));
+			break;
+		}
+
+		std::lock_guard<std::mutex> lock(srv->mutex);
+		srv->clients.insert(fd);
+		std::thread(serve_connection, srv, fd).detach();
+	}
+
+	close(lis);
+	unlink(path);
+
+	/* stop reading more requests, and wait for the ones in progress to
+	 * finish and get their replies
+	 */
+	{
+		std::unique_lock<std::mutex> lock(srv->mutex);
+		for(std::set<int>::iterator it = srv->clients.begin(); it != srv->clients.end(); ++it) {
+			shutdown(*it, SHUT_RD);
+		}
+		while(!srv->clients.empty()) {
+			srv->cond_idle.wait(lock);
+		}
+	}
+
+	print_stats(srv, print_stdout, 0);
+	delete srv;
+	return true;
+}
+
+const char *request_command(const ServerRequest *req)
+{
+	return req->cmd;
+}
+
+const char *request_arg(const ServerRequest *req, const char *key)
+{
+	for(int i=0; i<req->num_args; i++) {
+		if(strcmp(req->keys[i], key) == 0) {
+			return req->values[i];
+		}
+	}
+	return 0;
+}
+
+bool request_read_data(ServerRequest *req, size_t size, const char *fname)
+{
+	Connection *conn = req->conn;
+
+	// the rest of the data can't be skipped reliably, the connection is dropped on failure
+	req->hangup = true;
+
+	int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd == -1) {
+		request_error(req, "failed to create %s: %s", fname, strerror(errno));
+		return false;
+	}
+
+	while(size > 0) {
+		if(conn->pos >= conn->len) {
+			ssize_t sz = read(conn->fd, conn->buf, sizeof conn->buf);
+			if(sz <= 0) {
+				if(sz == -1 && errno == EINTR) continue;
+				request_error(req, "connection closed while reading data");
+				close(fd);
+				return false;
+			}
+			conn->len = sz;
+			conn->pos = 0;
+		}
+
+		size_t count = conn->len - conn->pos;
+		if(count > size) count = size;
+		if(write(fd, conn->buf + conn->pos, count) != (ssize_t)count) {
+			request_error(req, "failed to write %s: %s", fname, strerror(errno));
+			close(fd);
+			return false;
+		}
+		conn->pos += count;
+		size -= count;
+	}
+	close(fd);
+	req->hangup = false;
+	return true;
+}
+
+void request_hangup(ServerRequest *req)
+{
+	req->hangup = true;
+}
+
+void request_error(ServerRequest *req, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(req->errmsg, sizeof req->errmsg, fmt, ap);
+	va_end(ap);
+}
+
+bool reply_line(ServerRequest *req, const char *fmt, ...)
+{
+	char buf[MAX_LINE];
+
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof buf - 1, fmt, ap);
+	va_end(ap);
+
+	if(len < 0) return false;
+	if(len > (int)sizeof buf - 2) len = sizeof buf - 2;
+	buf[len++] = '\n';
+	return send_all(req->conn->fd, buf, len);
+}
+
+bool reply_file(ServerRequest *req, const char *name, const char *fname)
+{
+	int fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		request_error(req, "failed to open %s: %s", fname, strerror(errno));
+		return false;
+	}
+	off_t size = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+
+	if(!reply_line(req, "data %lld %s", (long long)size, name)) {
+		close(fd);
+		return false;
+	}
+
+	char buf[65536];
+	ssize_t sz;
+	while((sz = read(fd, buf, sizeof buf)) > 0) {
+		if(!send_all(req->conn->fd, buf, sz)) {
+			close(fd);
+			return false;
+		}
+	}
+	close(fd);
+	return true;
+}
@@ -0,0 +1,62 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <stddef.h>
+
+/* local request server on a Unix domain socket. A request is one line: a
+ * command followed by key=value arguments separated by spaces (values with
+ * spaces can be enclosed in double quotes), optionally followed by binary
+ * data which the request handler reads. Replies are any number of lines and
+ * data blocks, terminated by "ok <latency in ms>" or "error <message>".
+ * Connections can send any number of requests, and each one is served by its
+ * own thread, so the handler must be thread-safe. The socket is only
+ * accessible to the user running the server (mode 0600).
+ *
+ * The request latencies are collected in a histogram, which is returned by
+ * the built-in "stats" command and printed when the server exits.
+ */
+struct ServerRequest;
+
+// request handler, returns false after calling request_error on failure
+typedef bool (*RequestFunc)(ServerRequest*, void*);
+
+// serves requests until SIGINT or SIGTERM, finishing the requests in progress
+bool run_server(const char *path, RequestFunc func, void *cls);
+
+const char *request_command(const ServerRequest *req);
+// returns the value of an argument, or 0 if it wasn't passed
+const char *request_arg(const ServerRequest *req, const char *key);
+
+/* reads size bytes of data following the request line into a new file. On
+ * failure the connection is closed after the reply, since the rest of the
+ * data can't be told apart from the next request.
+ */
+bool request_read_data(ServerRequest *req, size_t size, const char *fname);
+
+// closes the connection after the reply, for requests whose data is left unread
+void request_hangup(ServerRequest *req);
+
+void request_error(ServerRequest *req, const char *fmt, ...);
+
+bool reply_line(ServerRequest *req, const char *fmt, ...);
+// sends "data <size> <name>" followed by the contents of the file
+bool reply_file(ServerRequest *req, const char *name, const char *fname);
+
+#endif	// SERVER_H_
@@ -0,0 +1,251 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include "sh.h"
+#include "convert.h"
+
+bool init_sh(ShProjection *sh, int order)
+{
+	if(order < 2 || order > 3) {
+		fprintf(stderr, "unsupported spherical harmonics order: %d (2 or 3)\n", order);
+		return false;
+	}
+	memset(sh, 0, sizeof *sh);
+	sh->order = order;
+	sh->num_coeffs = (order + 1) * (order + 1);
+	return true;
+}
+
+void destroy_sh(ShProjection *sh)
+{
+	delete [] sh->texel_tab;
+	delete [] sh->partial;
+	sh->texel_tab = 0;
+	sh->partial = 0;
+}
+
+// solid angle of the face area from the center to (x, y), in [-1, 1] face coordinates
+static inline double area_element(double x, double y)
+{
+	return atan2(x * y, sqrt(x * x + y * y + 1.0));
+}
+
+void sh_begin(ShProjection *sh, int face_size, int num_threads)
+{
+	int half = (face_size + 1) / 2;
+
+	if(face_size != sh->face_size) {
+		delete [] sh->texel_tab;
+		sh->texel_tab = new float[half * half * 2];
+		sh->face_size = face_size;
+
+		float *tab = sh->texel_tab;
+		for(int i=0; i<half; i++) {
+			double y0 = 2.0 * i / face_size - 1.0;
+			double y1 = 2.0 * (i + 1) / face_size - 1.0;
+			double yc = (y0 + y1) * 0.5;
+
+			for(int j=0; j<half; j++) {
+				double x0 = 2.0 * j / face_size - 1.0;
+				double x1 = 2.0 * (j + 1) / face_size - 1.0;
+				double xc = (x0 + x1) * 0.5;
+
+				*tab++ = area_element(x0, y0) - area_element(x0, y1) - area_element(x1, y0) +
+					area_element(x1, y1);
+				*tab++ = 1.0 / sqrt(xc * xc + yc * yc + 1.0);
+			}
+		}
+	}
+
+	if(num_threads != sh->num_threads) {
+		delete [] sh->partial;
+		sh->partial = new double[num_threads * SH_MAX_COEFFS * 3];
+		sh->num_threads = num_threads;
+	}
+	memset(sh->partial, 0, num_threads * SH_MAX_COEFFS * 3 * sizeof *sh->partial);
+}
+
+void sh_end(ShProjection *sh)
+{
+	memset(sh->coeffs, 0, sizeof sh->coeffs);
+
+	for(int i=0; i<sh->num_threads; i++) {
+		const double *sum = sh->partial + i * SH_MAX_COEFFS * 3;
+		for(int j=0; j<sh->num_coeffs; j++) {
+			sh->coeffs[j][0] += sum[j * 3];
+			sh->coeffs[j][1] += sum[j * 3 + 1];
+			sh->coeffs[j][2] += sum[j * 3 + 2];
+		}
+	}
+}
+
+static inline void eval_basis(const float *dir, int order, float *res)
+{
+	float x = dir[0];
+	float y = dir[1];
+	float z = dir[2];
+
+	res[0] = 0.282094792f;
+	res[1] = 0.488602512f * y;
+	res[2] = 0.488602512f * z;
+	res[3] = 0.488602512f * x;
+	res[4] = 1.092548431f * x * y;
+	res[5] = 1.092548431f * y * z;
+	res[6] = 0.315391565f * (3.0f * z * z - 1.0f);
+	res[7] = 1.092548431f * x * z;
+	res[8] = 0.546274215f * (x * x - y * y);
+
+	if(order >= 3) {
+		res[9] = 0.590043589f * y * (3.0f * x * x - y * y);
+		res[10] = 2.890611442f * x * y * z;
+		res[11] = 0.457045799f * y * (5.0f * z * z - 1.0f);
+		res[12] = 0.373176332f * z * (5.0f * z * z - 3.0f);
+		res[13] = 0.457045799f * x * (5.0f * z * z - 1.0f);
+		res[14] = 1.445305721f * z * (x * x - y * y);
+		res[15] = 0.590043589f * x * (x * x - 3.0f * y * y);
+	}
+}
+
+template <typename T>
+static void accum_tile(ShProjection *sh, double *sum, int face, int x, int y, int width, int height,
+		const T *pixels, int pitch, float scale)
+{
+	int size = sh->face_size;
+	int half = (size + 1) / 2;
+	int num_coeffs = sh->num_coeffs;
+	float inv_size = 1.0f / size;
+
+	for(int i=0; i<height; i++) {
+		// rows are summed in single precision, and added to the double sums
+		float acc[SH_MAX_COEFFS * 3] = {0};
+
+		int fy = y + i;
+		const float *tab = sh->texel_tab + (fy < half ? fy : size - 1 - fy) * half * 2;
+		const T *pptr = pixels + (long)i * pitch * 3;
+		float t = (fy + 0.5f) * inv_size;
+
+		for(int j=0; j<width; j++) {
+			int fx = x + j;
+			const float *ent = tab + (fx < half ? fx : size - 1 - fx) * 2;
+
+			float dir[3];
+			cube_face_dir(face, (fx + 0.5f) * inv_size, t, dir);
+			dir[0] *= ent[1];
+			dir[1] *= ent[1];
+			dir[2] *= ent[1];
+
+			float w = ent[0] * scale;
+			float col[3];
+			col[0] = PixelOps<T>::to_float(pptr[0]) * w;
+			col[1] = PixelOps<T>::to_float(pptr[1]) * w;
+			col[2] = PixelOps<T>::to_float(pptr[2]) * w;
+			pptr += 3;
+
+			float basis[SH_MAX_COEFFS];
+			eval_basis(dir, sh->order, basis);
+
+			for(int k=0; k<num_coeffs; k++) {
+				acc[k * 3] += basis[k] * col[0];
+				acc[k * 3 + 1] += basis[k] * col[1];
+				acc[k * 3 + 2] += basis[k] * col[2];
+			}
+		}
+
+		for(int k=0; k<num_coeffs * 3; k++) {
+			sum[k] += acc[k];
+		}
+	}
+}
+
+void sh_accum_tile(ShProjection *sh, int thread, int face, int x, int y, int width, int height,
+		int fmt, const void *pixels, int pitch)
+{
+	double *sum = sh->partial + thread * SH_MAX_COEFFS * 3;
+
+	if(fmt == PIXFMT_RGB8) {
+		accum_tile(sh, sum, face, x, y, width, height, (const unsigned char*)pixels, pitch, 1.0f / 255.0f);
+	} else if(fmt == PIXFMT_RGBH) {
+		accum_tile(sh, sum, face, x, y, width, height, (const half*)pixels, pitch, 1.0f);
+	} else {
+		accum_tile(sh, sum, face, x, y, width, height, (const float*)pixels, pitch, 1.0f);
+	}
+}
+
+void sh_irradiance(const ShProjection *sh, double (*irr)[3])
+{
+	static const double band_scale[] = {M_PI, 2.0 * M_PI / 3.0, M_PI / 4.0, 0.0};
+
+	for(int i=0; i<sh->num_coeffs; i++) {
+		int band = (int)sqrt((double)i);
+		for(int j=0; j<3; j++) {
+			irr[i][j] = sh->coeffs[i][j] * band_scale[band];
+		}
+	}
+}
+
+static void write_json_coeffs(FILE *fp, const char *name, const double (*coeffs)[3], int count, bool last)
+{
+	fprintf(fp, "\t\"%s\": [\n", name);
+	for(int i=0; i<count; i++) {
+		fprintf(fp, "\t\t[%.9g, %.9g, %.9g]%s\n", coeffs[i][0], coeffs[i][1], coeffs[i][2],
+				i < count - 1 ? "," : "");
+	}
+	fprintf(fp, "\t]%s\n", last ? "" : ",");
+}
+
+bool save_sh(const ShProjection *sh, const char *fname)
+{
+	double irr[SH_MAX_COEFFS][3];
+	sh_irradiance(sh, irr);
+
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		return false;
+	}
+
+	const char *suffix = strrchr(fname, '.');
+	if(suffix && strcasecmp(suffix, ".json") == 0) {
+		fprintf(fp, "{\n\t\"order\": %d,\n", sh->order);
+		write_json_coeffs(fp, "radiance", sh->coeffs, sh->num_coeffs, false);
+		write_json_coeffs(fp, "irradiance", irr, sh->num_coeffs, true);
+		fprintf(fp, "}\n");
+	} else {
+		int hdr[2] = {sh->order, sh->num_coeffs};
+		float data[SH_MAX_COEFFS * 3 * 2];
+		for(int i=0; i<sh->num_coeffs; i++) {
+			for(int j=0; j<3; j++) {
+				data[i * 3 + j] = sh->coeffs[i][j];
+				data[(sh->num_coeffs + i) * 3 + j] = irr[i][j];
+			}
+		}
+		fwrite("CMSH", 1, 4, fp);
+		fwrite(hdr, sizeof hdr, 1, fp);
+		fwrite(data, sizeof *data, sh->num_coeffs * 3 * 2, fp);
+	}
+
+	bool res = !ferror(fp);
+	if(fclose(fp) != 0 || !res) {
+		fprintf(stderr, "failed to write %s\n", fname);
+		return false;
+	}
+	return true;
+}
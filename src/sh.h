@@ -0,0 +1,75 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SH_H_
+#define SH_H_
+
+// coefficients of up to order 3 (bands 0 to 3)
+#define SH_MAX_COEFFS	16
+
+/* spherical harmonics projection of the environment, accumulated by the
+ * conversion functions one face tile at a time, while the tile is still in
+ * the cache, instead of in a separate pass over the faces. Each tile is
+ * weighted by the exact solid angles of its texels, precomputed for one
+ * quadrant of a face (the other quadrants and faces are symmetric), and
+ * summed into per-thread partial sums, which are reduced at the end.
+ *
+ * Directions are in the cubemap coordinate system (+Y up, see dirmap.h), and
+ * the real SH basis is in the usual order: Y00, Y1-1 (y), Y10 (z), Y11 (x),
+ * Y2-2 (xy), Y2-1 (yz), Y20, Y21 (xz), Y22, and likewise for band 3. 8bit
+ * faces are projected as values in [0, 1].
+ */
+struct ShProjection {
+	int order;			// highest band, 2 (9 coefficients) or 3 (16 coefficients)
+	int num_coeffs;
+
+	// set up by sh_begin
+	int face_size;
+	float *texel_tab;	// solid angle and 1 / length of the face direction per quadrant texel
+	int num_threads;
+	double *partial;	// SH_MAX_COEFFS RGB sums per thread
+
+	double coeffs[SH_MAX_COEFFS][3];	// radiance coefficients, after sh_end
+};
+
+bool init_sh(ShProjection *sh, int order);
+void destroy_sh(ShProjection *sh);
+
+// called by the conversion functions, before and after processing the tiles
+void sh_begin(ShProjection *sh, int face_size, int num_threads);
+void sh_end(ShProjection *sh);
+
+/* adds a tile of face texels at (x, y) to the sums of the given thread.
+ * pitch is in texels.
+ */
+void sh_accum_tile(ShProjection *sh, int thread, int face, int x, int y, int width, int height,
+		int fmt, const void *pixels, int pitch);
+
+/* irradiance coefficients: the radiance coefficients convolved with the
+ * clamped cosine lobe (scaled by pi, 2pi/3, pi/4 and 0 for bands 0 to 3).
+ * Divided by pi they give the lambertian diffuse lighting for a normal.
+ */
+void sh_irradiance(const ShProjection *sh, double (*irr)[3]);
+
+/* writes the radiance and irradiance coefficients as JSON for .json files,
+ * and as a binary blob otherwise: "CMSH", the order and the number of
+ * coefficients as 32bit integers, then the radiance and the irradiance
+ * coefficients as RGB 32bit floats, all in native byte order.
+ */
+bool save_sh(const ShProjection *sh, const char *fname);
+
+#endif	// SH_H_
@@ -0,0 +1,289 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <algorithm>
+#include "stream.h"
+#include "rawimg.h"
+#include "threadpool.h"
+#include "sh.h"
+
+struct StreamTile {
+	int face, x, y, w, h;
+	int row0, row1;		// range of source rows read by the tile, inclusive
+};
+
+struct StreamJob {
+	const Image *win;
+	const ConvOptions *opt;
+	RawImage *out;
+	int size;
+	const StreamTile *tiles;
+	char *tilebuf;		// one tile per thread
+	size_t tilebuf_size;
+	ShProjection *sh;
+	std::atomic<bool> failed;
+};
+
+/* the v extremes of a tile are on its border, unless it contains a pole,
+ * which is at the center of the +Y and -Y faces. The border is sampled at
+ * texel corners, which bounds every supersample, and the range is padded by
+ * the filter footprint and one extra row for the approximations in dirmap.
+ */
+static void update_range(const float *v, int count, float *vmin, float *vmax)
+{
+	for(int i=0; i<count; i++) {
+		if(v[i] < *vmin) *vmin = v[i];
+		if(v[i] > *vmax) *vmax = v[i];
+	}
+}
+
+static void calc_tile_rows(StreamTile *tile, int size, int src_height, int taps)
+{
+	float uarr[CONV_TILE_SIZE + 1], varr[CONV_TILE_SIZE + 1];
+	float vmin = 1.0f, vmax = 0.0f;
+
+	// top and bottom edges
+	for(int i=0; i<2; i++) {
+		int y = i ? tile->y + tile->h : tile->y;
+		dirmap_face_span(tile->face, size, y, tile->x, tile->w + 1, uarr, varr, -0.5f, -0.5f);
+		update_range(varr, tile->w + 1, &vmin, &vmax);
+	}
+	// left and right edges
+	for(int i=1; i<tile->h; i++) {
+		dirmap_face_span(tile->face, size, tile->y + i, tile->x, 1, uarr, varr, -0.5f, -0.5f);
+		update_range(varr, 1, &vmin, &vmax);
+		dirmap_face_span(tile->face, size, tile->y + i, tile->x + tile->w, 1, uarr, varr, -0.5f, -0.5f);
+		update_range(varr, 1, &vmin, &vmax);
+	}
+
+	if(tile->x * 2 <= size && (tile->x + tile->w) * 2 >= size &&
+			tile->y * 2 <= size && (tile->y + tile->h) * 2 >= size) {
+		if(tile->face == CUBE_PY) vmin = 0.0f;
+		if(tile->face == CUBE_NY) vmax = 1.0f;
+	}
+
+	int row0 = (int)floor(vmin * src_height - 0.5f) - (taps / 2 - 1) - 1;
+	int row1 = (int)floor(vmax * src_height - 0.5f) + taps / 2 + 1;
+	tile->row0 = row0 < 0 ? 0 : row0;
+	tile->row1 = row1 >= src_height ? src_height - 1 : row1;
+}
+
+static bool tile_order(const StreamTile &a, const StreamTile &b)
+{
+	return a.row1 < b.row1;
+}
+
+static void stream_tile_task(int idx, int thread, void *cls)
+{
+	StreamJob *job = (StreamJob*)cls;
+	const StreamTile *tile = job->tiles + idx;
+	void *buf = job->tilebuf + thread * job->tilebuf_size;
+
+	convert_tile_buf(job->win, tile->face, job->size, tile->x, tile->y, tile->w, tile->h,
+			job->opt, buf, tile->w);
+	if(job->sh) {
+		sh_accum_tile(job->sh, thread, tile->face, tile->x, tile->y, tile->w, tile->h,
+				job->win->fmt, buf, tile->w);
+	}
+
+	if(!write_raw_rect(job->out + tile->face, tile->x, tile->y, tile->w, tile->h,
+				job->win->fmt, buf, tile->w)) {
+		job->failed = true;
+	}
+}
+
+bool convert_cubemap_stream(const char *src_fname, const char *const *face_fnames, int cube_size,
+		const ConvOptions *opt, unsigned int load_flags, size_t mem_limit, ThreadPool *tpool,
+		ShProjection *sh)
+{
+	if(opt->filter == FILTER_AREA) {
+		fprintf(stderr, "convert_cubemap_stream: the %s filter isn't supported\n", filter_name[FILTER_AREA]);
+		return false;
+	}
+
+	RawImage src;
+	if(!open_raw_image(&src, src_fname)) {
+		return false;
+	}
+
+	int fmt = src.fmt;
+	if(fmt == PIXFMT_RGBF && (load_flags & LOAD_HALF)) {
+		fmt = PIXFMT_RGBH;
+	}
+	int size = cube_size > 0 ? cube_size : src.height;
+	int taps = get_filter_taps(opt->filter);
+
+	// find the source rows of every tile, and process them in the order they
+	// become ready as the window moves down
+	int tiles_per_row = (size + CONV_TILE_SIZE - 1) / CONV_TILE_SIZE;
+	int tiles_per_face = tiles_per_row * tiles_per_row;
+	int num_tiles = tiles_per_face * 6;
+
+	StreamTile *tiles = new StreamTile[num_tiles];
+	for(int i=0; i<num_tiles; i++) {
+		StreamTile *tile = tiles + i;
+		int idx = i % tiles_per_face;
+		tile->face = i / tiles_per_face;
+		tile->x = (idx % tiles_per_row) * CONV_TILE_SIZE;
+		tile->y = (idx / tiles_per_row) * CONV_TILE_SIZE;
+		tile->w = size - tile->x < CONV_TILE_SIZE ? size - tile->x : CONV_TILE_SIZE;
+		tile->h = size - tile->y < CONV_TILE_SIZE ? size - tile->y : CONV_TILE_SIZE;
+		calc_tile_rows(tile, size, src.height, taps);
+	}
+	std::stable_sort(tiles, tiles + num_tiles, tile_order);
+
+	/* the window can only move down to the first row of any remaining tile,
+	 * so it must be able to span from there to the last row of the next
+	 * tile in order
+	 */
+	int *first_row = new int[num_tiles];
+	int min_rows = 0;
+	for(int i=num_tiles-1; i>=0; i--) {
+		first_row[i] = i < num_tiles - 1 ? std::min(tiles[i].row0, first_row[i + 1]) : tiles[i].row0;
+		min_rows = std::max(min_rows, tiles[i].row1 - first_row[i] + 1);
+	}
+
+	int num_threads = tpool ? tpool->get_num_threads() : 1;
+	size_t row_size = (size_t)src.width * pixel_size(fmt);
+	size_t tilebuf_size = CONV_TILE_SIZE * CONV_TILE_SIZE * pixel_size(fmt);
+	size_t tilebuf_total = tilebuf_size * num_threads;
+
+	size_t max_rows = mem_limit > tilebuf_total ? (mem_limit - tilebuf_total) / row_size : 0;
+	if(max_rows > (size_t)src.height) max_rows = src.height;
+
+	if(max_rows < (size_t)min_rows) {
+		size_t need = (size_t)min_rows * row_size + tilebuf_total;
+		fprintf(stderr, "memory limit too low, converting %dx%d to %dx%d faces needs at least %lu MB\n",
+				src.width, src.height, size, size, (unsigned long)((need + 0xfffff) >> 20));
+		delete [] first_row;
+		delete [] tiles;
+		close_raw_image(&src);
+		return false;
+	}
+
+	char *winbuf = (char*)malloc(max_rows * row_size + tilebuf_total);
+	if(!winbuf) {
+		fprintf(stderr, "failed to allocate %lu rows of %s\n", (unsigned long)max_rows, src_fname);
+		delete [] first_row;
+		delete [] tiles;
+		close_raw_image(&src);
+		return false;
+	}
+
+	RawImage out[6];
+	bool res = true;
+	int num_open = 0;
+	for(int i=0; i<6; i++) {
+		if(!create_raw_image(out + i, face_fnames[i], size, size, fmt == PIXFMT_RGB8 ? PIXFMT_RGB8 : PIXFMT_RGBF)) {
+			res = false;
+			break;
+		}
+		num_open++;
+	}
+
+	/* the window is exposed to the conversion as a full size image holding
+	 * only the resident rows, starting at first_row. Tiles never read outside
+	 * of their row range.
+	 */
+	Image win;
+	win.width = src.width;
+	win.height = src.height;
+	win.fmt = fmt;
+	win.pixels = winbuf;
+	win.pitch = row_size;
+	win.first_row = 0;
+	win.map = 0;
+	win.map_size = 0;
+
+	StreamJob job;
+	job.win = &win;
+	job.opt = opt;
+	job.out = out;
+	job.size = size;
+	job.tiles = tiles;
+	job.tilebuf = winbuf + max_rows * row_size;
+	job.tilebuf_size = tilebuf_size;
+	job.sh = sh;
+	if(sh) {
+		sh_begin(sh, size, num_threads);
+	}
+	job.failed = false;
+
+	int win_start = 0, win_end = 0;	// resident rows
+	int pos = 0;
+
+	while(res && pos < num_tiles) {
+		// drop the rows no remaining tile needs
+		int start = first_row[pos];
+		if(start > win_start) {
+			if(start < win_end) {
+				memmove(winbuf, winbuf + (start - win_start) * row_size, (win_end - start) * row_size);
+			} else {
+				win_end = start;
+			}
+			win_start = start;
+		}
+
+		int end = std::min(src.height, win_start + (int)max_rows);
+		if(end > win_end) {
+			if(!read_raw_rows(&src, win_end, end - win_end, fmt, winbuf + (win_end - win_start) * row_size)) {
+				res = false;
+				break;
+			}
+			win_end = end;
+		}
+		win.first_row = win_start;
+
+		int count = 0;
+		while(pos + count < num_tiles && tiles[pos + count].row1 < win_end) {
+			count++;
+		}
+
+		job.tiles = tiles + pos;
+		if(tpool) {
+			tpool->run(count, stream_tile_task, &job);
+		} else {
+			for(int i=0; i<count; i++) {
+				stream_tile_task(i, 0, &job);
+			}
+		}
+		pos += count;
+
+		if(job.failed) {
+			fprintf(stderr, "failed to write cubemap faces\n");
+			res = false;
+		}
+	}
+
+	if(sh) {
+		sh_end(sh);
+	}
+
+	for(int i=0; i<num_open; i++) {
+		close_raw_image(out + i);
+	}
+	free(winbuf);
+	delete [] first_row;
+	delete [] tiles;
+	close_raw_image(&src);
+	return res;
+}
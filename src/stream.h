@@ -0,0 +1,42 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <stddef.h>
+#include "convert.h"
+
+/* streaming equirect -> cubemap conversion, for panoramas too large to load
+ * at once. The source must be a raw PPM or PFM file (see rawimg.h), which is
+ * read top to bottom in bands into a window of at most mem_limit bytes. Each
+ * face tile is converted and written to the output files as soon as all the
+ * source rows it reads are in the window, so neither the source nor the
+ * faces are ever fully in memory. The faces are written as PPM for 8bit
+ * sources and PFM for floating point sources (face_fnames must have the
+ * matching suffixes).
+ *
+ * LOAD_HALF in load_flags keeps the window in half floats, LOAD_FLOAT is
+ * ignored. FILTER_AREA is not supported. Fails if mem_limit is too small to
+ * hold the rows needed by the largest tiles. sh, if not null, accumulates the
+ * spherical harmonics projection of the tiles as they are written (see sh.h).
+ */
+bool convert_cubemap_stream(const char *src_fname, const char *const *face_fnames, int cube_size,
+		const ConvOptions *opt, unsigned int load_flags, size_t mem_limit, ThreadPool *tpool = 0,
+		ShProjection *sh = 0);
+
+#endif	// STREAM_H_
@@ -0,0 +1,372 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sumtab.h"
+#include "convert.h"
+#include "threadpool.h"
+
+struct SumTableJob {
+	SumTable *sat;
+	const Image *img;
+	double *acc;	// 6 * (width + 1) per thread
+};
+
+static inline double *row_sums(const SumTable *sat, int by)
+{
+	return sat->row_sums + (size_t)by * (sat->width + 1) * 3;
+}
+
+static inline double *col_sums(const SumTable *sat, int bx)
+{
+	return sat->col_sums + (size_t)bx * (sat->num_rows + 1) * 3;
+}
+
+static inline float *block_sums(const SumTable *sat, int y)
+{
+	return sat->sums + (size_t)y * (sat->width + 1) * 3;
+}
+
+/* sums the rows of block row by: the sums within its blocks, the row sums
+ * at the block columns (added up by sat_prefix_task), and for a full block
+ * row, its total at each x (added up into the next row_sums)
+ */
+template <typename T>
+static void sum_block_row(SumTable *sat, const Image *img, int by, double *acc)
+{
+	int width = sat->width;
+	int y0 = by * SAT_BLOCK;
+	int y1 = y0 + SAT_BLOCK < sat->num_rows ? y0 + SAT_BLOCK : sat->num_rows;
+
+	// sums over [x0, x) x [y0, y) within the blocks, and over [0, x) x [y0, y)
+	double *local = acc;
+	double *total = acc + (width + 1) * 3;
+	memset(acc, 0, (width + 1) * 6 * sizeof *acc);
+
+	for(int y=y0; y<y1; y++) {
+		const T *src = (const T*)image_row(img, sat->first_row + y);
+		double r = 0.0, g = 0.0, b = 0.0;		// over [0, x) of this row
+		double lr = 0.0, lg = 0.0, lb = 0.0;	// over [x0, x)
+
+		for(int x=0; x<=width; x++) {
+			if(x % SAT_BLOCK == 0) {
+				double *cs = col_sums(sat, x / SAT_BLOCK) + (y + 1) * 3;
+				cs[0] = r;
+				cs[1] = g;
+				cs[2] = b;
+				lr = lg = lb = 0.0;
+			}
+			local[x * 3] += lr;
+			local[x * 3 + 1] += lg;
+			local[x * 3 + 2] += lb;
+			total[x * 3] += r;
+			total[x * 3 + 1] += g;
+			total[x * 3 + 2] += b;
+
+			if(x < width) {
+				float pr = PixelOps<T>::to_float(src[0]);
+				float pg = PixelOps<T>::to_float(src[1]);
+				float pb = PixelOps<T>::to_float(src[2]);
+				r += pr;
+				g += pg;
+				b += pb;
+				lr += pr;
+				lg += pg;
+				lb += pb;
+				src += 3;
+			}
+		}
+
+		// the first row of each block row is all zeros
+		float *dest = block_sums(sat, y + 1);
+		bool first = (y + 1) % SAT_BLOCK == 0;
+		for(int i=0; i<(width + 1) * 3; i++) {
+			dest[i] = first ? 0.0f : (float)local[i];
+		}
+	}
+
+	if(y1 - y0 == SAT_BLOCK) {
+		memcpy(row_sums(sat, by + 1), total, (width + 1) * 3 * sizeof *total);
+	}
+}
+
+/* adds up the rows [0, first_row) into row_sums[0] and the first entries
+ * of col_sums, one block row at a time, with the same operations as
+ * sum_block_row and sat_prefix_task do for the full table
+ */
+template <typename T>
+static void sum_rows_above(SumTable *sat, const Image *img, double *total)
+{
+	int width = sat->width;
+	double *rs = row_sums(sat, 0);
+
+	for(int by=0; by<sat->first_row / SAT_BLOCK; by++) {
+		memset(total, 0, (width + 1) * 3 * sizeof *total);
+
+		for(int y=by*SAT_BLOCK; y<(by + 1)*SAT_BLOCK; y++) {
+			const T *src = (const T*)image_row(img, y);
+			double r = 0.0, g = 0.0, b = 0.0;
+
+			for(int x=0; x<=width; x++) {
+				if(x % SAT_BLOCK == 0) {
+					double *cs = col_sums(sat, x / SAT_BLOCK);
+					cs[0] += r;
+					cs[1] += g;
+					cs[2] += b;
+				}
+				total[x * 3] += r;
+				total[x * 3 + 1] += g;
+				total[x * 3 + 2] += b;
+
+				if(x < width) {
+					float pr = PixelOps<T>::to_float(src[0]);
+					float pg = PixelOps<T>::to_float(src[1]);
+					float pb = PixelOps<T>::to_float(src[2]);
+					r += pr;
+					g += pg;
+					b += pb;
+					src += 3;
+				}
+			}
+		}
+
+		for(int i=0; i<(width + 1) * 3; i++) {
+			rs[i] += total[i];
+		}
+	}
+}
+
+static void sat_rows_task(int idx, int thread, void *cls)
+{
+	SumTableJob *job = (SumTableJob*)cls;
+	double *acc = job->acc + (size_t)thread * (job->sat->width + 1) * 6;
+
+	if(job->img->fmt == PIXFMT_RGB8) {
+		sum_block_row<unsigned char>(job->sat, job->img, idx, acc);
+	} else if(job->img->fmt == PIXFMT_RGBH) {
+		sum_block_row<half>(job->sat, job->img, idx, acc);
+	} else {
+		sum_block_row<float>(job->sat, job->img, idx, acc);
+	}
+}
+
+/* adds up the row sums of block column idx top to bottom, and the block row
+ * totals of its columns
+ */
+static void sat_prefix_task(int idx, int thread, void *cls)
+{
+	SumTable *sat = ((SumTableJob*)cls)->sat;
+
+	double *cs = col_sums(sat, idx);
+	for(int i=3; i<(sat->num_rows + 1) * 3; i++) {
+		cs[i] += cs[i - 3];
+	}
+
+	int start = idx * SAT_BLOCK * 3;
+	int end = start + SAT_BLOCK * 3;
+	if(end > (sat->width + 1) * 3) end = (sat->width + 1) * 3;
+
+	for(int i=1; i<=sat->num_rows / SAT_BLOCK; i++) {
+		const double *prev = row_sums(sat, i - 1);
+		double *row = row_sums(sat, i);
+
+		for(int j=start; j<end; j++) {
+			row[j] += prev[j];
+		}
+	}
+}
+
+bool build_sumtab(SumTable *sat, const Image *img, ThreadPool *tpool)
+{
+	return build_sumtab_rows(sat, img, 0, img->height, tpool);
+}
+
+bool build_sumtab_rows(SumTable *sat, const Image *img, int first_row, int num_rows,
+		ThreadPool *tpool)
+{
+	num_rows += first_row % SAT_BLOCK;
+	first_row -= first_row % SAT_BLOCK;
+
+	int block_rows = (num_rows + SAT_BLOCK - 1) / SAT_BLOCK;
+	int col_blocks = img->width / SAT_BLOCK + 1;
+	size_t num = (size_t)(img->width + 1) * (num_rows + 1) * 3;
+	size_t num_row_sums = (size_t)(num_rows / SAT_BLOCK + 1) * (img->width + 1) * 3;
+	size_t num_col_sums = (size_t)col_blocks * (num_rows + 1) * 3;
+
+	sat->sums = (float*)malloc(num * sizeof *sat->sums);
+	sat->row_sums = (double*)malloc((num_row_sums + num_col_sums) * sizeof *sat->row_sums);
+	if(!sat->sums || !sat->row_sums) {
+		fprintf(stderr, "failed to allocate %dx%d summed-area table\n", img->width, num_rows);
+		free(sat->sums);
+		free(sat->row_sums);
+		return false;
+	}
+	sat->col_sums = sat->row_sums + num_row_sums;
+	sat->width = img->width;
+	sat->height = img->height;
+	sat->first_row = first_row;
+	sat->num_rows = num_rows;
+
+	int num_threads = tpool ? tpool->get_num_threads() : 1;
+	SumTableJob job;
+	job.sat = sat;
+	job.img = img;
+	if(!(job.acc = (double*)malloc((size_t)num_threads * (img->width + 1) * 6 * sizeof *job.acc))) {
+		fprintf(stderr, "failed to allocate %dx%d summed-area table\n", img->width, num_rows);
+		destroy_sumtab(sat);
+		return false;
+	}
+
+	memset(block_sums(sat, 0), 0, (img->width + 1) * 3 * sizeof *sat->sums);
+	memset(row_sums(sat, 0), 0, (img->width + 1) * 3 * sizeof *sat->row_sums);
+	for(int i=0; i<col_blocks; i++) {
+		double *cs = col_sums(sat, i);
+		cs[0] = cs[1] = cs[2] = 0.0;
+	}
+
+	if(first_row > 0) {
+		if(img->fmt == PIXFMT_RGB8) {
+			sum_rows_above<unsigned char>(sat, img, job.acc);
+		} else if(img->fmt == PIXFMT_RGBH) {
+			sum_rows_above<half>(sat, img, job.acc);
+		} else {
+			sum_rows_above<float>(sat, img, job.acc);
+		}
+	}
+
+	// first the block rows, then add up the sums along the block rows and columns
+	if(tpool) {
+		tpool->run(block_rows, sat_rows_task, &job);
+		tpool->run(col_blocks, sat_prefix_task, &job);
+	} else {
+		for(int i=0; i<block_rows; i++) {
+			sat_rows_task(i, 0, &job);
+		}
+		for(int i=0; i<col_blocks; i++) {
+			sat_prefix_task(i, 0, &job);
+		}
+	}
+
+	free(job.acc);
+	return true;
+}
+
+void destroy_sumtab(SumTable *sat)
+{
+	free(sat->sums);
+	free(sat->row_sums);	// col_sums is in the same allocation
+	sat->sums = 0;
+	sat->row_sums = sat->col_sums = 0;
+}
+
+// S(x, y) at integer coordinates, see SumTable
+static inline void table_sum(const SumTable *sat, int x, int y, double *res)
+{
+	int bx = x / SAT_BLOCK;
+	const double *rs = row_sums(sat, y / SAT_BLOCK);
+	const double *cs = col_sums(sat, bx) + y * 3;
+	const float *ls = block_sums(sat, y) + x * 3;
+	int x0 = bx * SAT_BLOCK * 3;
+
+	for(int i=0; i<3; i++) {
+		res[i] = (rs[x * 3 + i] - rs[x0 + i]) + cs[i] + ls[i];
+	}
+}
+
+/* the integral of a piecewise-constant image is bilinear within each texel,
+ * so interpolating the table bilinearly gives exact sums at fractional
+ * positions. x must be in [0, width], y in [0, num_rows] (relative to
+ * first_row).
+ */
+static void lookup(const SumTable *sat, double x, double y, double *res)
+{
+	if(y < 0.0) y = 0.0;
+	if(y > sat->num_rows) y = sat->num_rows;
+
+	int x0 = (int)x;
+	int y0 = (int)y;
+	if(x0 >= sat->width) x0 = sat->width - 1;
+	if(y0 >= sat->num_rows) y0 = sat->num_rows - 1;
+	double tx = x - x0;
+	double ty = y - y0;
+
+	double p00[3], p01[3], p10[3], p11[3];
+	table_sum(sat, x0, y0, p00);
+	table_sum(sat, x0 + 1, y0, p01);
+	table_sum(sat, x0, y0 + 1, p10);
+	table_sum(sat, x0 + 1, y0 + 1, p11);
+
+	for(int i=0; i<3; i++) {
+		double top = p00[i] + (p01[i] - p00[i]) * tx;
+		double bot = p10[i] + (p11[i] - p10[i]) * tx;
+		res[i] = top + (bot - top) * ty;
+	}
+}
+
+static void box_sum(const SumTable *sat, double x0, double y0, double x1, double y1, double *res)
+{
+	double s00[3], s01[3], s10[3], s11[3];
+
+	lookup(sat, x0, y0, s00);
+	lookup(sat, x1, y0, s01);
+	lookup(sat, x0, y1, s10);
+	lookup(sat, x1, y1, s11);
+
+	for(int i=0; i<3; i++) {
+		res[i] += s11[i] - s01[i] - s10[i] + s00[i];
+	}
+}
+
+void sumtab_box_avg(const SumTable *sat, float x0, float y0, float x1, float y1, float *res)
+{
+	double w = sat->width;
+
+	if(y0 < 0.0f) y0 = 0.0f;
+	if(y1 > sat->height) y1 = sat->height;
+	if(y1 - y0 < 1e-3f) {
+		// fully clamped away, keep a sliver of the edge row
+		if(y0 >= sat->height) y0 = sat->height - 1e-3f;
+		y1 = y0 + 1e-3f;
+	}
+	if(x1 - x0 > w) {
+		x0 = 0.0f;
+		x1 = w;
+	}
+
+	double start = fmod((double)x0, w);
+	if(start < 0.0) start += w;
+	double end = start + (x1 - x0);
+
+	double ty0 = (double)y0 - sat->first_row;
+	double ty1 = (double)y1 - sat->first_row;
+
+	double sum[3] = {0.0, 0.0, 0.0};
+	if(end <= w) {
+		box_sum(sat, start, ty0, end, ty1, sum);
+	} else {
+		box_sum(sat, start, ty0, w, ty1, sum);
+		box_sum(sat, 0.0, ty0, end - w, ty1, sum);
+	}
+
+	double inv_area = 1.0 / ((x1 - x0) * (y1 - y0));
+	for(int i=0; i<3; i++) {
+		res[i] = sum[i] * inv_area;
+	}
+}
@@ -0,0 +1,67 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SUMTAB_H_
+#define SUMTAB_H_
+
+struct Image;
+class ThreadPool;
+
+#define SAT_BLOCK	16
+
+/* summed-area table of an RGB image, for O(1) box filtering regardless of
+ * the box size. Averages are in the units of the source pixel format.
+ * The table may cover only the rows [first_row, first_row + num_rows) of the
+ * image. S(x, y), the sum of all pixels in [0, x) x [0, first_row + y),
+ * is split at the corner (x0, y0) of the SAT_BLOCK x SAT_BLOCK block it falls
+ * in, into S(x, y0) + S(x0, y) - S(x0, y0) and the sum over [x0, x) x [y0, y).
+ * Single precision runs out of mantissa bits long before the end of a large
+ * panorama, so the sums along the block rows and columns are kept in double
+ * precision, and only the sums within a block, of at most 256 pixels, in
+ * single precision. That's about 15 bytes per pixel, instead of 24.
+ *
+ * sums has (width + 1) x (num_rows + 1) RGB entries, the sums within the
+ * blocks. row_sums has num_rows / SAT_BLOCK + 1 rows of width + 1 entries,
+ * S(x, y) at each block row, and col_sums width / SAT_BLOCK + 1 columns of
+ * num_rows + 1 entries, S(x, y) at each block column.
+ */
+struct SumTable {
+	int width, height;		// of the whole image
+	int first_row, num_rows;
+	float *sums;
+	double *row_sums, *col_sums;
+};
+
+bool build_sumtab(SumTable *sat, const Image *img, ThreadPool *tpool = 0);
+/* table of the rows [first_row, first_row + num_rows) only. first_row is
+ * rounded down to a multiple of SAT_BLOCK, and the sums of the rows above it
+ * are added up the same way as in the full table, so lookups within the
+ * rows give bit-identical results.
+ */
+bool build_sumtab_rows(SumTable *sat, const Image *img, int first_row, int num_rows,
+		ThreadPool *tpool = 0);
+void destroy_sumtab(SumTable *sat);
+
+/* average of the box [x0, x1) x [y0, y1) in texel units. The box may extend
+ * past the left and right edges, in which case it wraps around, and it's
+ * clamped at the top and bottom of the image. Fractional box edges are
+ * handled exactly, with partial coverage of the edge texels. The clamped box
+ * must lie within the rows of the table.
+ */
+void sumtab_box_avg(const SumTable *sat, float x0, float y0, float x1, float y1, float *res);
+
+#endif	// SUMTAB_H_
@@ -23,6 +23,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 Texture::Texture()
 {
 	width = height = tex_width = tex_height = 0;
+	hdr = false;
 	tex = 0;
 }
 
@@ -54,6 +55,11 @@ int Texture::get_height() const
 	return height;
 }
 
+bool Texture::is_float() const
+{
+	return hdr;
+}
+
 bool Texture::load(const char *fname)
 {
 	img_pixmap img;
@@ -70,6 +76,7 @@ bool Texture::load(const char *fname)
 
 	width = img.width;
 	height = img.height;
+	hdr = img_is_float(&img);
 	tex_width = next_pow2(width);
 	tex_height = next_pow2(height);
 
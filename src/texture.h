@@ -24,6 +24,7 @@ class Texture {
 private:
 	int width, height;
 	int tex_width, tex_height;
+	bool hdr;
 	unsigned int tex;
 	Mat4 tmat;
 
@@ -33,6 +34,7 @@ public:
 
 	int get_width() const;
 	int get_height() const;
+	bool is_float() const;	// true for HDR images
 
 	bool load(const char *fname);
 
@@ -0,0 +1,163 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "threadpool.h"
+
+#define RANGE(b, e)		((unsigned long long)(unsigned int)(b) | ((unsigned long long)(unsigned int)(e) << 32))
+#define RANGE_BEGIN(r)	((int)((r) & 0xffffffff))
+#define RANGE_END(r)	((int)((r) >> 32))
+
+ThreadPool::ThreadPool(int num_threads)
+{
+	if(num_threads <= 0) {
+		num_threads = std::thread::hardware_concurrency();
+		if(num_threads <= 0) num_threads = 1;
+	}
+	this->num_threads = num_threads;
+
+	ranges = new std::atomic<unsigned long long>[num_threads];
+	for(int i=0; i<num_threads; i++) {
+		ranges[i] = 0;
+	}
+
+	generation = 0;
+	num_busy = 0;
+	quit = false;
+	func = 0;
+	cls = 0;
+
+	// the calling thread acts as worker 0
+	for(int i=1; i<num_threads; i++) {
+		workers.push_back(std::thread(&ThreadPool::worker_main, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	cond_start.notify_all();
+
+	for(size_t i=0; i<workers.size(); i++) {
+		workers[i].join();
+	}
+	delete [] ranges;
+}
+
+int ThreadPool::get_num_threads() const
+{
+	return num_threads;
+}
+
+void ThreadPool::run(int count, TaskFunc func, void *cls)
+{
+	if(count <= 0) return;
+
+	if(num_threads == 1) {
+		for(int i=0; i<count; i++) {
+			func(i, 0, cls);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->func = func;
+		this->cls = cls;
+
+		for(int i=0; i<num_threads; i++) {
+			int beg = (long long)count * i / num_threads;
+			int end = (long long)count * (i + 1) / num_threads;
+			ranges[i] = RANGE(beg, end);
+		}
+		num_busy = num_threads - 1;
+		generation++;
+	}
+	cond_start.notify_all();
+
+	process(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while(num_busy > 0) {
+		cond_done.wait(lock);
+	}
+}
+
+void ThreadPool::worker_main(int idx)
+{
+	unsigned int last_gen = 0;
+
+	for(;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while(!quit && generation == last_gen) {
+				cond_start.wait(lock);
+			}
+			if(quit) return;
+			last_gen = generation;
+		}
+
+		process(idx);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			num_busy--;
+		}
+		cond_done.notify_all();
+	}
+}
+
+void ThreadPool::process(int idx)
+{
+	std::atomic<unsigned long long> *range = ranges + idx;
+
+	do {
+		unsigned long long r = range->load();
+		while(RANGE_BEGIN(r) < RANGE_END(r)) {
+			int task = RANGE_BEGIN(r);
+			if(range->compare_exchange_weak(r, RANGE(task + 1, RANGE_END(r)))) {
+				func(task, idx, cls);
+				r = range->load();
+			}
+		}
+	} while(steal(idx));
+}
+
+/* steal the back half of the remaining range of another thread, into our own
+ * (empty) range. Returns false when there's nothing left to steal.
+ */
+bool ThreadPool::steal(int idx)
+{
+	for(int i=1; i<num_threads; i++) {
+		int victim = (idx + i) % num_threads;
+		unsigned long long r = ranges[victim].load();
+
+		while(RANGE_BEGIN(r) < RANGE_END(r)) {
+			int beg = RANGE_BEGIN(r);
+			int end = RANGE_END(r);
+			int mid = end - (end - beg + 1) / 2;
+
+			if(ranges[victim].compare_exchange_weak(r, RANGE(beg, mid))) {
+				ranges[idx] = RANGE(mid, end);
+				return true;
+			}
+		}
+	}
+	return false;
+}
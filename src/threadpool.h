@@ -0,0 +1,72 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/* task callback args: (int task index, int thread index, void *cls)
+ * thread index is in [0, get_num_threads()), and can be used to index
+ * per-thread scratch data.
+ */
+typedef void (*TaskFunc)(int, int, void*);
+
+/* work-stealing thread pool. run() splits the task index range evenly across
+ * the threads up-front; each thread consumes its own range from the front,
+ * and when it runs out it steals the back half of another thread's range.
+ */
+class ThreadPool {
+private:
+	int num_threads;
+	std::vector<std::thread> workers;
+
+	// per-thread task ranges: begin in the low 32 bits, end in the high 32 bits
+	std::atomic<unsigned long long> *ranges;
+
+	std::mutex mutex;
+	std::condition_variable cond_start, cond_done;
+	unsigned int generation;
+	int num_busy;
+	bool quit;
+
+	TaskFunc func;
+	void *cls;
+
+	void worker_main(int idx);
+	void process(int idx);
+	bool steal(int idx);
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool &operator =(const ThreadPool&);
+
+public:
+	// num_threads <= 0 means one per hardware thread
+	explicit ThreadPool(int num_threads = 0);
+	~ThreadPool();
+
+	int get_num_threads() const;
+
+	// calls func(i, thread, cls) for each i in [0, count), returns when all are done
+	void run(int count, TaskFunc func, void *cls);
+};
+
+#endif	// THREADPOOL_H_
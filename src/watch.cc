@@ -0,0 +1,389 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include "watch.h"
+
+#ifdef __linux__
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/* the journal is a text file with one line per finished file: D (done) or F
+ * (failed), followed by the file key. Lines are appended and synced one at a
+ * time, so a crash can at most leave a partial last line, which is ignored.
+ * It's compacted at startup, and again whenever the lines appended since the
+ * last compaction outnumber the entries it kept (but at least JOURNAL_MIN_APPENDS),
+ * so it stays within about twice the number of live files.
+ */
+#define JOURNAL_MIN_APPENDS	256
+
+struct WatchDir {
+	std::string path;
+	int ifd;	// inotify
+	int jfd;	// journal, opened for appending
+	int kept;		// entries kept by the last compaction
+	int appends;	// lines appended since then
+
+	std::map<std::string, char> journal;	// file key -> D/F
+	std::deque<std::string> queue;			// filenames
+	std::set<std::string> queued;
+
+	std::string cur_key;	// key of the file last returned by watch_dir_next
+};
+
+// size, mtime and name, or false if it's not a regular file
+static bool file_key(const WatchDir *wd, const char *name, std::string *key, struct stat *st = 0)
+{
+	struct stat stbuf;
+	if(!st) st = &stbuf;
+
+	std::string fname = wd->path + "/" + name;
+	if(stat(fname.c_str(), st) == -1 || !S_ISREG(st->st_mode)) {
+		return false;
+	}
+
+	char buf[64];
+	sprintf(buf, "%lld %lld.%09ld ", (long long)st->st_size, (long long)st->st_mtim.tv_sec,
+			st->st_mtim.tv_nsec);
+	*key = std::string(buf) + name;
+	return true;
+}
+
+static bool ignore_file(const char *name)
+{
+	return name[0] == '.' || strchr(name, '\n');
+}
+
+static void enqueue(WatchDir *wd, const char *name)
+{
+	if(ignore_file(name) || wd->queued.count(name)) {
+		return;
+	}
+	wd->queue.push_back(name);
+	wd->queued.insert(name);
+}
+
+static void load_journal(WatchDir *wd, const char *fname)
+{
+	FILE *fp = fopen(fname, "rb");
+	if(!fp) return;
+
+	std::string line;
+	int c;
+	while((c = fgetc(fp)) != EOF) {
+		if(c != '\n') {
+			line += (char)c;
+			continue;
+		}
+		if(line.size() > 2 && (line[0] == 'D' || line[0] == 'F') && line[1] == ' ') {
+			wd->journal[line.substr(2)] = line[0];
+		}
+		line.clear();
+	}
+	fclose(fp);
+}
+
+/* rewrites the journal without the entries of files which are gone or have
+ * changed, through a temporary file which replaces it atomically
+ */
+static bool compact_journal(WatchDir *wd, const char *fname, const std::set<std::string> &keys)
+{
+	std::string tmpname = std::string(fname) + ".tmp";
+	FILE *fp = fopen(tmpname.c_str(), "wb");
+	if(!fp) {
+		fprintf(stderr, "failed to create journal: %s: %s\n", tmpname.c_str(), strerror(errno));
+		return false;
+	}
+
+	std::map<std::string, char>::iterator it = wd->journal.begin();
+	while(it != wd->journal.end()) {
+		if(keys.count(it->first)) {
+			fprintf(fp, "%c %s\n", it->second, it->first.c_str());
+			++it;
+		} else {
+			wd->journal.erase(it++);
+		}
+	}
+
+	if(fflush(fp) != 0 || fsync(fileno(fp)) == -1) {
+		fprintf(stderr, "failed to write journal: %s: %s\n", tmpname.c_str(), strerror(errno));
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	if(rename(tmpname.c_str(), fname) == -1) {
+		fprintf(stderr, "failed to replace journal: %s: %s\n", fname, strerror(errno));
+		return false;
+	}
+	int dfd = open(wd->path.c_str(), O_RDONLY);
+	if(dfd != -1) {
+		fsync(dfd);
+		close(dfd);
+	}
+	return true;
+}
+
+// keys of the files currently in the directory
+static bool scan_keys(WatchDir *wd, std::set<std::string> *keys)
+{
+	DIR *dir = opendir(wd->path.c_str());
+	if(!dir) {
+		fprintf(stderr, "failed to open directory: %s: %s\n", wd->path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct dirent *dent;
+	while((dent = readdir(dir))) {
+		std::string key;
+		if(!ignore_file(dent->d_name) && file_key(wd, dent->d_name, &key)) {
+			keys->insert(key);
+		}
+	}
+	closedir(dir);
+	return true;
+}
+
+/* compacts the journal, and reopens it for appending, since the old file
+ * has been replaced. On failure the old journal is kept open.
+ */
+static bool reopen_journal(WatchDir *wd, const std::set<std::string> &keys)
+{
+	std::string jname = wd->path + "/" + WATCH_JOURNAL;
+	if(!compact_journal(wd, jname.c_str(), keys)) {
+		return false;
+	}
+
+	int fd = open(jname.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if(fd == -1) {
+		fprintf(stderr, "failed to open journal: %s: %s\n", jname.c_str(), strerror(errno));
+		return false;
+	}
+	if(wd->jfd != -1) close(wd->jfd);
+	wd->jfd = fd;
+	wd->kept = (int)wd->journal.size();
+	wd->appends = 0;
+	return true;
+}
+
+struct ScanEntry {
+	struct timespec mtime;
+	std::string name;
+
+	bool operator <(const ScanEntry &e) const
+	{
+		if(mtime.tv_sec != e.mtime.tv_sec) return mtime.tv_sec < e.mtime.tv_sec;
+		if(mtime.tv_nsec != e.mtime.tv_nsec) return mtime.tv_nsec < e.mtime.tv_nsec;
+		return name < e.name;
+	}
+};
+
+/* queues the files of the directory which aren't in the journal, oldest
+ * first, and returns the keys of all its files
+ */
+static bool queue_unfinished(WatchDir *wd, std::set<std::string> *keys)
+{
+	DIR *dir = opendir(wd->path.c_str());
+	if(!dir) {
+		fprintf(stderr, "failed to open directory: %s: %s\n", wd->path.c_str(), strerror(errno));
+		return false;
+	}
+
+	std::vector<ScanEntry> pending;
+	struct dirent *dent;
+	while((dent = readdir(dir))) {
+		ScanEntry ent;
+		std::string key;
+		struct stat st;
+		if(ignore_file(dent->d_name) || !file_key(wd, dent->d_name, &key, &st)) {
+			continue;
+		}
+		keys->insert(key);
+		if(!wd->journal.count(key)) {
+			ent.mtime = st.st_mtim;
+			ent.name = dent->d_name;
+			pending.push_back(ent);
+		}
+	}
+	closedir(dir);
+
+	std::sort(pending.begin(), pending.end());
+	for(size_t i=0; i<pending.size(); i++) {
+		enqueue(wd, pending[i].name.c_str());
+	}
+	return true;
+}
+
+WatchDir *open_watch_dir(const char *path)
+{
+	WatchDir *wd = new WatchDir;
+	wd->path = path;
+	wd->jfd = -1;
+	wd->kept = wd->appends = 0;
+
+	/* start watching before scanning the directory, so no file can slip
+	 * through in between. Files seen twice are only queued once.
+	 */
+	if((wd->ifd = inotify_init1(IN_CLOEXEC)) == -1 ||
+			inotify_add_watch(wd->ifd, path, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		fprintf(stderr, "failed to watch directory: %s: %s\n", path, strerror(errno));
+		close_watch_dir(wd);
+		return 0;
+	}
+
+	std::string jname = wd->path + "/" + WATCH_JOURNAL;
+	load_journal(wd, jname.c_str());
+
+	std::set<std::string> keys;
+	if(!queue_unfinished(wd, &keys) || !reopen_journal(wd, keys)) {
+		close_watch_dir(wd);
+		return 0;
+	}
+	return wd;
+}
+
+void close_watch_dir(WatchDir *wd)
+{
+	if(!wd) return;
+
+	if(wd->ifd != -1) close(wd->ifd);
+	if(wd->jfd != -1) close(wd->jfd);
+	delete wd;
+}
+
+// blocks until inotify events arrive, and queues the new files
+static bool read_events(WatchDir *wd)
+{
+	char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	ssize_t sz = read(wd->ifd, buf, sizeof buf);
+	if(sz <= 0) {
+		if(sz == -1 && errno != EINTR) {
+			fprintf(stderr, "failed to read directory events: %s\n", strerror(errno));
+		}
+		return false;
+	}
+
+	char *ptr = buf;
+	while(ptr < buf + sz) {
+		struct inotify_event *ev = (struct inotify_event*)ptr;
+		if(ev->mask & IN_Q_OVERFLOW) {
+			// events were dropped, so any file could have been missed
+			std::set<std::string> keys;
+			if(!queue_unfinished(wd, &keys)) {
+				return false;
+			}
+		} else if(ev->len && !(ev->mask & IN_ISDIR)) {
+			enqueue(wd, ev->name);
+		}
+		ptr += sizeof *ev + ev->len;
+	}
+	return true;
+}
+
+bool watch_dir_next(WatchDir *wd, char *fname, int size)
+{
+	for(;;) {
+		while(!wd->queue.empty()) {
+			std::string name = wd->queue.front();
+			wd->queue.pop_front();
+			wd->queued.erase(name);
+
+			// it might have been removed, or finished under the same key already
+			std::string key;
+			if(!file_key(wd, name.c_str(), &key) || wd->journal.count(key)) {
+				continue;
+			}
+			wd->cur_key = key;
+			snprintf(fname, size, "%s/%s", wd->path.c_str(), name.c_str());
+			return true;
+		}
+
+		if(!read_events(wd)) {
+			return false;
+		}
+	}
+}
+
+int watch_dir_pending(const WatchDir *wd)
+{
+	return (int)wd->queue.size();
+}
+
+bool watch_dir_done(WatchDir *wd, const char *fname, bool success)
+{
+	char state = success ? 'D' : 'F';
+	std::string line = std::string(1, state) + " " + wd->cur_key + "\n";
+
+	if(write(wd->jfd, line.c_str(), line.size()) != (ssize_t)line.size() || fdatasync(wd->jfd) == -1) {
+		fprintf(stderr, "failed to update journal for %s: %s\n", fname, strerror(errno));
+		return false;
+	}
+	wd->journal[wd->cur_key] = state;
+
+	/* a failed compaction isn't fatal, the journal is still valid, it's just
+	 * tried again after as many appends
+	 */
+	if(++wd->appends >= std::max(wd->kept, JOURNAL_MIN_APPENDS)) {
+		std::set<std::string> keys;
+		if(!scan_keys(wd, &keys) || !reopen_journal(wd, keys)) {
+			wd->appends = 0;
+		}
+	}
+	return true;
+}
+
+#else	// !__linux__
+
+WatchDir *open_watch_dir(const char *path)
+{
+	fprintf(stderr, "watching directories is only supported on Linux\n");
+	return 0;
+}
+
+void close_watch_dir(WatchDir *wd)
+{
+}
+
+bool watch_dir_next(WatchDir *wd, char *fname, int size)
+{
+	return false;
+}
+
+int watch_dir_pending(const WatchDir *wd)
+{
+	return 0;
+}
+
+bool watch_dir_done(WatchDir *wd, const char *fname, bool success)
+{
+	return false;
+}
+
+#endif	// __linux__
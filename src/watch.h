@@ -0,0 +1,47 @@
+/*
+Cubemapper - a program for converting panoramic images into cubemaps
+Copyright (C) 2017  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef WATCH_H_
+#define WATCH_H_
+
+/* watched spool directory (Linux only, uses inotify). New files written to, or moved
+ * into the directory are queued for conversion. Finished files are recorded
+ * in a journal in the directory (WATCH_JOURNAL), so that after a restart or
+ * a crash only the files which weren't finished are converted. A file is
+ * identified by its name, size and modification time, so replacing it with
+ * a new version queues it again. Files starting with a dot are ignored.
+ */
+#define WATCH_JOURNAL	".cubemapper-journal"
+
+struct WatchDir;
+
+// queues the files already in the directory which aren't in the journal
+WatchDir *open_watch_dir(const char *path);
+void close_watch_dir(WatchDir *wd);
+
+/* waits for the next queued file, and writes its path in fname. Returns false
+ * if interrupted by a signal, or on errors.
+ */
+bool watch_dir_next(WatchDir *wd, char *fname, int size);
+
+// number of files waiting in the queue
+int watch_dir_pending(const WatchDir *wd);
+
+// records a file returned by watch_dir_next as done (or failed) in the journal
+bool watch_dir_done(WatchDir *wd, const char *fname, bool success);
+
+#endif	// WATCH_H_